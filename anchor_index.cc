@@ -0,0 +1,155 @@
+#include "anchor_index.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+const char kAnchorMagic[8] = {'G', 'A', 'M', 'L', 'A', 'N', 'C', 'H'};
+const int kAnchorVersion = 1;
+}
+
+CsrIds& CsrIds::operator=(const CsrIds& o) {
+  num_keys_ = o.num_keys_;
+  num_ids_ = o.num_ids_;
+  offsets_store_ = o.offsets_store_;
+  ids_store_ = o.ids_store_;
+  if (o.offsets_ == o.offsets_store_.data()) {
+    // owned arrays, point to our copy
+    offsets_ = offsets_store_.data();
+    ids_ = ids_store_.data();
+  } else {
+    offsets_ = o.offsets_;
+    ids_ = o.ids_;
+  }
+  return *this;
+}
+
+void CsrIds::Reset() {
+  num_keys_ = 0;
+  num_ids_ = 0;
+  offsets_store_.clear();
+  ids_store_.clear();
+  offsets_ = NULL;
+  ids_ = NULL;
+}
+
+void CsrIds::Build(int num_keys, vector<pair<int, int> >& pairs) {
+  Reset();
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+  for (auto &p: pairs) {
+    num_keys = max(num_keys, p.first + 1);
+  }
+  offsets_store_.assign(num_keys + 1, 0);
+  ids_store_.reserve(pairs.size());
+  for (auto &p: pairs) {
+    offsets_store_[p.first + 1]++;
+    ids_store_.push_back(p.second);
+  }
+  for (int i = 0; i < num_keys; i++) {
+    offsets_store_[i+1] += offsets_store_[i];
+  }
+  num_keys_ = num_keys;
+  num_ids_ = ids_store_.size();
+  offsets_ = offsets_store_.data();
+  ids_ = ids_store_.data();
+}
+
+void CsrIds::Write(FILE* f) const {
+  fwrite(&num_keys_, sizeof(int), 1, f);
+  fwrite(&num_ids_, sizeof(int), 1, f);
+  if (offsets_ != NULL) {
+    fwrite(offsets_, sizeof(int), num_keys_ + 1, f);
+  } else {
+    int zero = 0;
+    fwrite(&zero, sizeof(int), 1, f);
+  }
+  if (num_ids_ > 0) {
+    fwrite(ids_, sizeof(int), num_ids_, f);
+  }
+}
+
+long long CsrIds::Map(const char* data, size_t size) {
+  Reset();
+  if (size < 2 * sizeof(int)) return -1;
+  int num_keys, num_ids;
+  memcpy(&num_keys, data, sizeof(int));
+  memcpy(&num_ids, data + sizeof(int), sizeof(int));
+  if (num_keys < 0 || num_ids < 0) return -1;
+  long long need = (2LL + num_keys + 1 + num_ids) * sizeof(int);
+  if (need > (long long)size) return -1;
+  offsets_ = (const int*)(data + 2 * sizeof(int));
+  ids_ = offsets_ + num_keys + 1;
+  if (offsets_[0] != 0 || offsets_[num_keys] != num_ids) {
+    Reset();
+    return -1;
+  }
+  num_keys_ = num_keys;
+  num_ids_ = num_ids;
+  return need;
+}
+
+void AnchorIndex::Build(int num_nodes, const vector<AnchorHit>& hits) {
+  mapped_.reset();
+  vector<pair<int, int> > all, ends, begins;
+  for (auto &h: hits) {
+    all.push_back(make_pair(h.node, h.read));
+    if (h.at_end) {
+      ends.push_back(make_pair(h.node, h.read));
+    }
+    if (h.at_begin) {
+      begins.push_back(make_pair(h.read, h.node));
+    }
+  }
+  node_reads_.Build(num_nodes, all);
+  node_reads_end_.Build(num_nodes, ends);
+  read_nodes_begin_.Build(0, begins);
+}
+
+int AnchorIndex::NumNodesWithAnchors() const {
+  int ret = 0;
+  for (int i = 0; i < node_reads_.NumKeys(); i++) {
+    if (!node_reads_.Get(i).empty()) ret++;
+  }
+  return ret;
+}
+
+bool AnchorIndex::Save(const string& filename) const {
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (f == NULL) return false;
+  fwrite(kAnchorMagic, 1, sizeof(kAnchorMagic), f);
+  fwrite(&kAnchorVersion, sizeof(int), 1, f);
+  node_reads_.Write(f);
+  node_reads_end_.Write(f);
+  read_nodes_begin_.Write(f);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+bool AnchorIndex::Load(const string& filename) {
+  shared_ptr<MappedFile> mapped(new MappedFile);
+  if (!mapped->Open(filename)) return false;
+  const char* data = mapped->data();
+  size_t size = mapped->size();
+  size_t header = sizeof(kAnchorMagic) + sizeof(int);
+  if (size < header || memcmp(data, kAnchorMagic, sizeof(kAnchorMagic)) != 0) {
+    return false;
+  }
+  int version;
+  memcpy(&version, data + sizeof(kAnchorMagic), sizeof(int));
+  if (version != kAnchorVersion) return false;
+  size_t pos = header;
+  CsrIds* parts[3] = {&node_reads_, &node_reads_end_, &read_nodes_begin_};
+  for (int i = 0; i < 3; i++) {
+    long long used = parts[i]->Map(data + pos, size - pos);
+    if (used < 0) {
+      for (int j = 0; j < 3; j++) {
+        *parts[j] = CsrIds();
+      }
+      return false;
+    }
+    pos += used;
+  }
+  mapped_ = mapped;
+  return true;
+}
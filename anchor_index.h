@@ -0,0 +1,108 @@
+#ifndef ANCHOR_INDEX_H__
+#define ANCHOR_INDEX_H__
+
+#include <string>
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include "mapped_file.h"
+
+using namespace std;
+
+// Contiguous run of sorted ids.
+struct IdRange {
+  IdRange() : b(NULL), e(NULL) {}
+  IdRange(const int* b_, const int* e_) : b(b_), e(e_) {}
+
+  const int* begin() const { return b; }
+  const int* end() const { return e; }
+  int size() const { return e - b; }
+  bool empty() const { return b == e; }
+
+  const int* b;
+  const int* e;
+};
+
+// Compressed sparse rows: ids of key k are ids[offsets[k]..offsets[k+1]).
+// The arrays are either owned or point into a mapped file.
+class CsrIds {
+ public:
+  CsrIds() : num_keys_(0), num_ids_(0), offsets_(NULL), ids_(NULL) {}
+  CsrIds(const CsrIds& o) {
+    *this = o;
+  }
+  CsrIds& operator=(const CsrIds& o);
+
+  // pairs are (key, id), they get sorted and deduplicated
+  void Build(int num_keys, vector<pair<int, int> >& pairs);
+
+  IdRange Get(int key) const {
+    if (key < 0 || key >= num_keys_) return IdRange();
+    return IdRange(ids_ + offsets_[key], ids_ + offsets_[key+1]);
+  }
+
+  int NumKeys() const {
+    return num_keys_;
+  }
+
+  int NumIds() const {
+    return num_ids_;
+  }
+
+  void Write(FILE* f) const;
+  // Points the arrays into data, returns number of bytes consumed or -1.
+  long long Map(const char* data, size_t size);
+
+ private:
+  void Reset();
+
+  int num_keys_;
+  int num_ids_;
+  const int* offsets_;
+  const int* ids_;
+  vector<int> offsets_store_;
+  vector<int> ids_store_;
+};
+
+struct AnchorHit {
+  AnchorHit(int node_, int read_, bool at_begin_, bool at_end_)
+      : node(node_), read(read_), at_begin(at_begin_), at_end(at_end_) {}
+  int node;
+  int read;
+  bool at_begin;
+  bool at_end;
+};
+
+// Anchors of long reads on graph nodes.
+class AnchorIndex {
+ public:
+  void Build(int num_nodes, const vector<AnchorHit>& hits);
+
+  // reads anchored anywhere on node
+  IdRange NodeReads(int node) const {
+    return node_reads_.Get(node);
+  }
+
+  // reads anchored at the end of node
+  IdRange NodeReadsEnd(int node) const {
+    return node_reads_end_.Get(node);
+  }
+
+  // nodes on which read is anchored at the begin
+  IdRange ReadNodesBegin(int read) const {
+    return read_nodes_begin_.Get(read);
+  }
+
+  int NumNodesWithAnchors() const;
+
+  bool Save(const string& filename) const;
+  bool Load(const string& filename);
+
+ private:
+  CsrIds node_reads_;
+  CsrIds node_reads_end_;
+  CsrIds read_nodes_begin_;
+  shared_ptr<MappedFile> mapped_;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "compact_graph.h"
+#include "graph.h"
+#include <algorithm>
+#include <cstring>
+
+void CompactGraph::Reset() {
+  mapped_.reset();
+  lens_store_.clear();
+  seq_offsets_store_.clear();
+  seqs_store_.clear();
+  edge_offsets_store_.clear();
+  targets_store_.clear();
+  weights_store_.clear();
+  weight_sums_store_.clear();
+  by_target_.clear();
+  num_nodes_ = 0;
+  num_edges_ = 0;
+  lens_ = NULL;
+  seq_offsets_ = NULL;
+  seqs_ = NULL;
+  edge_offsets_ = NULL;
+  targets_ = NULL;
+  weights_ = NULL;
+  weight_sums_ = NULL;
+  ResetTables();
+}
+
+void CompactGraph::Build(const vector<Node*>& nodes) {
+  Reset();
+  int n = nodes.size();
+  lens_store_.resize(n);
+  seq_offsets_store_.resize(n + 1);
+  edge_offsets_store_.resize(n + 1);
+  long long total_seq = 0;
+  int total_edges = 0;
+  for (int i = 0; i < n; i++) {
+    seq_offsets_store_[i] = total_seq;
+    edge_offsets_store_[i] = total_edges;
+    total_seq += nodes[i]->s.length();
+    total_edges += nodes[i]->next.size();
+  }
+  seq_offsets_store_[n] = total_seq;
+  edge_offsets_store_[n] = total_edges;
+
+  seqs_store_.reserve(total_seq);
+  targets_store_.resize(total_edges);
+  for (int i = 0; i < n; i++) {
+    lens_store_[i] = nodes[i]->s.length();
+    seqs_store_ += nodes[i]->s;
+    for (int j = 0; j < nodes[i]->next.size(); j++) {
+      targets_store_[edge_offsets_store_[i] + j] = nodes[i]->next[j]->id;
+    }
+  }
+  num_nodes_ = n;
+  num_edges_ = total_edges;
+  lens_ = lens_store_.data();
+  seq_offsets_ = seq_offsets_store_.data();
+  seqs_ = seqs_store_.data();
+  edge_offsets_ = edge_offsets_store_.data();
+  targets_ = targets_store_.data();
+  BuildTargetIndex();
+  UpdateWeights(nodes);
+}
+
+void CompactGraph::UpdateWeights(const vector<Node*>& nodes) {
+  if (nodes.size() != num_nodes_) return;
+  // mapped weights are replaced by own copies
+  weights_store_.resize(num_edges_);
+  weight_sums_store_.resize(num_nodes_);
+  for (int i = 0; i < num_nodes_; i++) {
+    const vector<double>& p = nodes[i]->next_prob;
+    for (int j = 0; j < p.size() && j < OutDegree(i); j++) {
+      weights_store_[edge_offsets_[i] + j] = p[j];
+    }
+    weight_sums_store_[i] = OutDegree(i) ? nodes[i]->next_sum : 0;
+  }
+  weights_ = weights_store_.data();
+  weight_sums_ = weight_sums_store_.data();
+  ResetTables();
+}
+
+void CompactGraph::UpdateWeights(const vector<Node*>& nodes, const vector<int>& changed) {
+  if (nodes.size() != num_nodes_) return;
+  if (weights_ != weights_store_.data() || weight_sums_ != weight_sums_store_.data()) {
+    UpdateWeights(nodes);
+    return;
+  }
+  for (auto i: changed) {
+    const vector<double>& p = nodes[i]->next_prob;
+    for (int j = 0; j < p.size() && j < OutDegree(i); j++) {
+      weights_store_[edge_offsets_[i] + j] = p[j];
+    }
+    weight_sums_store_[i] = OutDegree(i) ? nodes[i]->next_sum : 0;
+    table_ready_[i].store(0, memory_order_relaxed);
+  }
+}
+
+namespace {
+long long Padded(long long bytes) {
+  return (bytes + 7) / 8 * 8;
+}
+
+void WritePadded(FILE* f, const void* data, long long bytes) {
+  fwrite(data, 1, bytes, f);
+  for (long long i = bytes; i < Padded(bytes); i++) {
+    fputc(0, f);
+  }
+}
+
+template<class T>
+const T* MapArray(const char* data, size_t size, long long& pos, long long n) {
+  long long bytes = n * sizeof(T);
+  if (pos + Padded(bytes) > (long long)size) return NULL;
+  const T* ret = (const T*)(data + pos);
+  pos += Padded(bytes);
+  return ret;
+}
+}
+
+void CompactGraph::Write(FILE* f) const {
+  long long seq_bytes = num_nodes_ ? seq_offsets_[num_nodes_] : 0;
+  long long header[3] = {num_nodes_, num_edges_, seq_bytes};
+  fwrite(header, sizeof(long long), 3, f);
+  if (num_nodes_ == 0) return;
+  WritePadded(f, lens_, num_nodes_ * sizeof(int));
+  WritePadded(f, seq_offsets_, (num_nodes_ + 1) * sizeof(long long));
+  WritePadded(f, edge_offsets_, (num_nodes_ + 1) * sizeof(int));
+  WritePadded(f, targets_, num_edges_ * sizeof(int));
+  WritePadded(f, weights_, num_edges_ * sizeof(double));
+  WritePadded(f, weight_sums_, num_nodes_ * sizeof(double));
+  WritePadded(f, seqs_, seq_bytes);
+}
+
+long long CompactGraph::Map(const char* data, size_t size, shared_ptr<MappedFile> mapped) {
+  Reset();
+  long long header[3];
+  if (size < sizeof(header)) return -1;
+  memcpy(header, data, sizeof(header));
+  long long n = header[0], e = header[1], seq_bytes = header[2];
+  if (n < 0 || n >= (1LL << 31) || e < 0 || e >= (1LL << 31) || seq_bytes < 0) return -1;
+  long long pos = sizeof(header);
+  if (n == 0) return pos;
+  const int* lens = MapArray<int>(data, size, pos, n);
+  const long long* seq_offsets = MapArray<long long>(data, size, pos, n + 1);
+  const int* edge_offsets = MapArray<int>(data, size, pos, n + 1);
+  const int* targets = MapArray<int>(data, size, pos, e);
+  const double* weights = MapArray<double>(data, size, pos, e);
+  const double* weight_sums = MapArray<double>(data, size, pos, n);
+  const char* seqs = MapArray<char>(data, size, pos, seq_bytes);
+  if (seqs == NULL || lens == NULL || seq_offsets == NULL || edge_offsets == NULL ||
+      targets == NULL || weights == NULL || weight_sums == NULL) {
+    return -1;
+  }
+  if (seq_offsets[0] != 0 || seq_offsets[n] != seq_bytes ||
+      edge_offsets[0] != 0 || edge_offsets[n] != e) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (edge_offsets[i] > edge_offsets[i+1] ||
+        seq_offsets[i+1] - seq_offsets[i] != lens[i] || lens[i] < 0) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < e; i++) {
+    if (targets[i] < 0 || targets[i] >= n) {
+      return -1;
+    }
+  }
+  num_nodes_ = n;
+  num_edges_ = e;
+  lens_ = lens;
+  seq_offsets_ = seq_offsets;
+  seqs_ = seqs;
+  edge_offsets_ = edge_offsets;
+  targets_ = targets;
+  weights_ = weights;
+  weight_sums_ = weight_sums;
+  mapped_ = mapped;
+  BuildTargetIndex();
+  ResetTables();
+  return pos;
+}
+
+namespace {
+const int kBanRedraws = 4;
+}
+
+void CompactGraph::BuildTargetIndex() {
+  by_target_.resize(num_edges_);
+  for (int i = 0; i < num_nodes_; i++) {
+    int* b = by_target_.data() + edge_offsets_[i];
+    int d = OutDegree(i);
+    const int* next = Next(i);
+    for (int k = 0; k < d; k++) {
+      b[k] = k;
+    }
+    stable_sort(b, b + d, [next](int x, int y) {
+      return next[x] < next[y];
+    });
+  }
+}
+
+void CompactGraph::ResetTables() {
+  table_offsets_.assign(num_nodes_, -1);
+  int total = 0;
+  for (int i = 0; i < num_nodes_; i++) {
+    if (OutDegree(i) >= kAliasMinDegree) {
+      table_offsets_[i] = total;
+      total += OutDegree(i);
+    }
+  }
+  alias_prob_.assign(total, 1);
+  alias_.assign(total, 0);
+  prefix_.assign(total, 0);
+  table_ready_.reset(new atomic<unsigned char>[num_nodes_]);
+  for (int i = 0; i < num_nodes_; i++) {
+    table_ready_[i].store(0, memory_order_relaxed);
+  }
+}
+
+void CompactGraph::BuildTables(int i) const {
+  lock_guard<mutex> g(tables_lock_);
+  if (table_ready_[i].load(memory_order_relaxed)) return;
+  int d = OutDegree(i), t = table_offsets_[i];
+  const double* w = NextWeights(i);
+  double total = 0;
+  for (int k = 0; k < d; k++) {
+    total += w[k];
+    prefix_[t+k] = total;
+  }
+  // Vose's method: columns with less than average weight get topped up by
+  // one with more.
+  vector<double> scaled(d);
+  vector<int> small, large;
+  for (int k = 0; k < d; k++) {
+    scaled[k] = total > 0 ? w[k] * d / total : 1;
+    if (scaled[k] < 1) {
+      small.push_back(k);
+    } else {
+      large.push_back(k);
+    }
+  }
+  while (!small.empty() && !large.empty()) {
+    int s = small.back(), l = large.back();
+    small.pop_back();
+    alias_prob_[t+s] = scaled[s];
+    alias_[t+s] = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  for (auto k: small) {
+    alias_prob_[t+k] = 1;
+    alias_[t+k] = k;
+  }
+  for (auto k: large) {
+    alias_prob_[t+k] = 1;
+    alias_[t+k] = k;
+  }
+  table_ready_[i].store(1, memory_order_release);
+}
+
+int CompactGraph::SampleEdgeAlias(int i, default_random_engine& gen) const {
+  if (!table_ready_[i].load(memory_order_acquire)) {
+    BuildTables(i);
+  }
+  int d = OutDegree(i), t = table_offsets_[i];
+  uniform_real_distribution<double> dist(0.0, d);
+  double u = dist(gen);
+  int k = min((int)u, d - 1);
+  int col = u - k < alias_prob_[t+k] ? k : alias_[t+k];
+  return edge_offsets_[i] + col;
+}
+
+pair<int, double> CompactGraph::SampleNextWithBan(int i, int ban,
+                                                  default_random_engine& gen) const {
+  int b = edge_offsets_[i], d = OutDegree(i);
+  const int* next = Next(i);
+  const double* w = NextWeights(i);
+  if (d < kAliasMinDegree) {
+    double sum_ban = 0;
+    int last = -1;
+    for (int k = 0; k < d; k++) {
+      if (next[k] == ban) continue;
+      sum_ban += w[k];
+      last = k;
+    }
+    if (last < 0 || sum_ban <= 0) return make_pair(-1, 0.0);
+    uniform_real_distribution<double> dist(0.0, sum_ban);
+    double samp = dist(gen);
+    double ss = 0;
+    for (int k = 0; k < d; k++) {
+      if (next[k] == ban) continue;
+      ss += w[k];
+      if (ss > samp || k == last) {
+        return make_pair(next[k], w[k] / sum_ban);
+      }
+    }
+  }
+
+  if (!table_ready_[i].load(memory_order_acquire)) {
+    BuildTables(i);
+  }
+  const double* prefix = prefix_.data() + table_offsets_[i];
+  pair<const int*, const int*> bans = FindEdges(i, ban);
+  double ban_weight = 0;
+  for (const int* it = bans.first; it != bans.second; ++it) {
+    ban_weight += w[*it];
+  }
+  double sum_ban = prefix[d-1] - ban_weight;
+  if (sum_ban <= 0) return make_pair(-1, 0.0);
+  // Redrawing while ban comes out is exact and usually ends after one or
+  // two draws. If ban holds most of the weight (or keeps coming out), draw
+  // from the weight without ban edges instead, step over their ranges of the
+  // prefix sums and binary search the edge.
+  for (int tries = 0; tries < kBanRedraws && 2 * ban_weight < prefix[d-1]; tries++) {
+    int k = SampleEdgeAlias(i, gen) - b;
+    if (next[k] != ban) {
+      return make_pair(next[k], w[k] / sum_ban);
+    }
+  }
+  uniform_real_distribution<double> dist(0.0, sum_ban);
+  double q = dist(gen);
+  for (const int* it = bans.first; it != bans.second; ++it) {
+    if (q >= (*it ? prefix[*it-1] : 0)) {
+      q += w[*it];
+    }
+  }
+  int k = min((int)(upper_bound(prefix, prefix + d, q) - prefix), d - 1);
+  while (k > 0 && next[k] == ban) k--;
+  while (k < d && next[k] == ban) k++;
+  if (k == d) return make_pair(-1, 0.0);
+  return make_pair(next[k], w[k] / sum_ban);
+}
@@ -0,0 +1,163 @@
+#ifndef COMPACT_GRAPH_H__
+#define COMPACT_GRAPH_H__
+
+#include <cstddef>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+using namespace std;
+
+class Node;
+
+// Read-only copy of the graph in flat arrays: node lengths, all sequences in
+// one arena and edges in CSR form (edge_offsets_[i]..edge_offsets_[i+1] are
+// edges of node i). Walks over it touch a few contiguous arrays instead of
+// chasing Node pointers.
+// The arrays are either built from nodes or point into a mapped snapshot.
+class CompactGraph {
+ public:
+  CompactGraph()
+      : num_nodes_(0), num_edges_(0), lens_(NULL), seq_offsets_(NULL), seqs_(NULL),
+        edge_offsets_(NULL), targets_(NULL), weights_(NULL), weight_sums_(NULL) {}
+
+  void Build(const vector<Node*>& nodes);
+  // Copies edge weights (next_prob, next_sum) from nodes again, of all
+  // nodes or only of changed ones.
+  void UpdateWeights(const vector<Node*>& nodes);
+  void UpdateWeights(const vector<Node*>& nodes, const vector<int>& changed);
+
+  int NumNodes() const {
+    return num_nodes_;
+  }
+
+  int NodeLen(int i) const {
+    return lens_[i];
+  }
+
+  const char* NodeSeq(int i) const {
+    return seqs_ + seq_offsets_[i];
+  }
+
+  int OutDegree(int i) const {
+    return edge_offsets_[i+1] - edge_offsets_[i];
+  }
+
+  // Targets of edges from i, OutDegree(i) of them.
+  const int* Next(int i) const {
+    return targets_ + edge_offsets_[i];
+  }
+
+  const double* NextWeights(int i) const {
+    return weights_ + edge_offsets_[i];
+  }
+
+  double WeightSum(int i) const {
+    return weight_sums_[i];
+  }
+
+  // Edges from i to target, as positions in Next(i) in increasing order.
+  // Binary search in edges of i sorted by target.
+  pair<const int*, const int*> FindEdges(int i, int target) const {
+    const int* b = by_target_.data() + edge_offsets_[i];
+    const int* e = by_target_.data() + edge_offsets_[i+1];
+    const int* next = Next(i);
+    const int* lo = lower_bound(b, e, target, [next](int k, int t) {
+      return next[k] < t;
+    });
+    const int* hi = lo;
+    while (hi != e && next[*hi] == target) hi++;
+    return make_pair(lo, hi);
+  }
+
+  // Arrays as they are in memory, each padded to 8 bytes. Map points the
+  // arrays into data (which mapped keeps alive) and returns the number of
+  // bytes consumed or -1.
+  void Write(FILE* f) const;
+  long long Map(const char* data, size_t size, shared_ptr<MappedFile> mapped);
+
+  // Nodes with at least this many edges sample through a Walker alias table.
+  static const int kAliasMinDegree = 8;
+
+  // Index of a random edge of i (by weight) or -1. Alias tables are built on
+  // first use, smaller nodes are scanned in edge order.
+  int SampleEdge(int i, default_random_engine& gen) const {
+    int b = edge_offsets_[i], e = edge_offsets_[i+1];
+    if (b == e) return -1;
+    if (e - b >= kAliasMinDegree) return SampleEdgeAlias(i, gen);
+    uniform_real_distribution<double> dist(0.0, weight_sums_[i]);
+    double samp = dist(gen);
+    double ss = 0;
+    for (int k = b; k < e; k++) {
+      ss += weights_[k];
+      if (ss > samp || k == e - 1) {
+        return k;
+      }
+    }
+    return -1;
+  }
+
+  // Next node or -1 for nodes without edges.
+  int SampleNext(int i, default_random_engine& gen) const {
+    int k = SampleEdge(i, gen);
+    return k < 0 ? -1 : targets_[k];
+  }
+
+  // Next node and probability of picking it.
+  pair<int, double> SampleNextWithProb(int i, default_random_engine& gen) const {
+    int k = SampleEdge(i, gen);
+    if (k < 0) return make_pair(-1, 0.0);
+    return make_pair(targets_[k], weights_[k] / weight_sums_[i]);
+  }
+
+  // Same with edges to ban left out, (-1, 0) when nothing else is left.
+  pair<int, double> SampleNextWithBan(int i, int ban, default_random_engine& gen) const;
+
+ private:
+  CompactGraph(const CompactGraph&);
+  CompactGraph& operator=(const CompactGraph&);
+
+  void Reset();
+  // Marks alias tables of all nodes as stale.
+  void ResetTables();
+  void BuildTargetIndex();
+  int SampleEdgeAlias(int i, default_random_engine& gen) const;
+  void BuildTables(int i) const;
+
+  int num_nodes_;
+  int num_edges_;
+  const int* lens_;
+  const long long* seq_offsets_;
+  const char* seqs_;
+  const int* edge_offsets_;
+  const int* targets_;
+  const double* weights_;
+  const double* weight_sums_;
+  vector<int> lens_store_;
+  vector<long long> seq_offsets_store_;
+  string seqs_store_;
+  vector<int> edge_offsets_store_;
+  vector<int> targets_store_;
+  vector<double> weights_store_;
+  vector<double> weight_sums_store_;
+  shared_ptr<MappedFile> mapped_;
+  // positions of edges of each node sorted by (target, position)
+  vector<int> by_target_;
+
+  // Per node with kAliasMinDegree or more edges, from table_offsets_[i]:
+  // alias table and prefix sums of weights. Filled when first needed.
+  vector<int> table_offsets_;
+  unique_ptr<atomic<unsigned char>[]> table_ready_;
+  mutable vector<double> alias_prob_;
+  mutable vector<int> alias_;
+  mutable vector<double> prefix_;
+  mutable mutex tables_lock_;
+};
+
+#endif
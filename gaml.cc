@@ -3,18 +3,26 @@
 #include <fstream>
 #include <cassert>
 #include <boost/algorithm/string.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/utility.hpp>
 #include <map>
 #include <cstdlib>
 #include <ctime>
+#include <chrono>
 #include <queue>
 #include <deque>
 #include <set>
+#include <sstream>
+#include <unistd.h>
 #include "graph.h"
 #include "utility.h"
 #include "input_output.h"
 #include "moves.h"
 #include "prob_calculator.h"
 #include "graph_from_assembly.h"
+#include "parallel.h"
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_YELLOW  "\x1b[33m"
@@ -28,6 +36,7 @@ using namespace boost;
 
 string gBowtiePath;
 string gBlasrPath;
+int gThreads;
 
 double ExtractDouble(const string& key, unordered_map<string, string>& cfg, double def) {
   if (cfg.count(key)) {
@@ -63,6 +72,26 @@ struct AssemblySettings {
   int localp;
   int fixlenp;
   double t0;
+  bool lazy_reach;
+  int reach_cache_size;
+  bool reach_prefetch;
+  string reach_file;
+  string graph_snapshot;
+  int chains;
+  int swap_interval;
+  double temp_ladder;
+  int speculate;
+  bool adaptive_moves;
+  int adaptive_interval;
+  string checkpoint;
+  int checkpoint_interval;
+  string resume;
+  double time_limit;
+  int stop_no_improvement;
+  double min_acceptance;
+  int acceptance_window;
+  string telemetry;
+  string telemetry_format;
   AssemblySettings() {}
   AssemblySettings(unordered_map<string, string>& configs) {
     threshold = ExtractInt("long_contig_threshold", configs, 500);
@@ -81,264 +110,1164 @@ struct AssemblySettings {
     localp = ExtractInt("local_p", configs, 60);
     fixlenp = ExtractInt("fixlen_p", configs, 1);
     t0 = ExtractDouble("t0", configs, 0.008);
+    lazy_reach = configs.count("lazy_reachability") > 0;
+    reach_cache_size = ExtractInt("reachability_cache_size", configs, 100000);
+    reach_prefetch = configs.count("reachability_prefetch") > 0;
+    reach_file = ExtractString("reachability_file", configs, "");
+    graph_snapshot = ExtractString("graph_snapshot", configs, "");
+    chains = ExtractInt("chains", configs, 1);
+    swap_interval = max(ExtractInt("swap_interval", configs, 10), 1);
+    temp_ladder = ExtractDouble("temp_ladder", configs, 2.0);
+    speculate = ExtractInt("speculate", configs, 1);
+    adaptive_moves = configs.count("adaptive_moves") > 0;
+    adaptive_interval = max(ExtractInt("adaptive_interval", configs, 100), 1);
+    checkpoint = ExtractString("checkpoint", configs, "");
+    checkpoint_interval = max(ExtractInt("checkpoint_interval", configs, 1000), 1);
+    resume = ExtractString("resume", configs, "");
+    time_limit = ExtractDouble("time_limit", configs, 0);
+    stop_no_improvement = ExtractInt("stop_no_improvement", configs, 0);
+    min_acceptance = ExtractDouble("min_acceptance", configs, 0);
+    acceptance_window = max(ExtractInt("acceptance_window", configs, 1000), 1);
+    telemetry = ExtractString("telemetry", configs, "");
+    telemetry_format = ExtractString("telemetry_format", configs, "csv");
     gBlasrPath = ExtractString("blasr_path", configs, "blasr/alignment/bin");
     printf("gBlasrPath %s\n", gBlasrPath.c_str());
     gBowtiePath = ExtractString("bowtie_path", configs, "bowtie2");
+    gThreads = ExtractInt("threads", configs, 0);
   }
 };
 
-// Core of optimalization procedure
-void Optimize(Graph& gr, ProbCalculator& prob_calc, vector<vector<int>> paths,
-    vector<pair<ReadSet*, ReadSet*>>& advice_paired,
-    vector<PacbioReadSet*>& advice_pacbio,
-    int longest_read, AssemblySettings& settings) {
-  int threshold = settings.threshold;
-  gr.CalcReachability();
-  gr.CalcReachabilityBig(threshold);
-  gr.CalcReachabilityLimit(2*longest_read);
-  gr.reach_limit_.resize(gr.nodes.size());
+// Moves extend paths from either end, so these are the nodes whose
+// reachability is asked for next.
+void PrefetchPathEnds(Graph& gr, const PathSet& paths) {
+  vector<int> ends;
+  for (auto &p: paths) {
+    if (p.empty()) continue;
+    if (p.back() >= 0) ends.push_back(p.back());
+    if (p[0] >= 0) ends.push_back(p[0]^1);
+  }
+  gr.PrefetchReachability(ends);
+}
 
-  int total_len;
-  int kmer = 47;
+// Move types in the order of their buckets. kPostprocess has no bucket, it
+// is the only move with do_postprocess.
+enum MoveType {
+  kExtend, kInterchange, kLocal, kExtendAdv, kFixLen, kBreak, kPostprocess, kNumMoves
+};
 
-  vector<pair<int, int>> zeros;
-  double cur_prob = prob_calc.CalcProb(paths, zeros, total_len);
-  printf("start prob %lf len %d low prob reads", cur_prob, total_len);
-  for (auto &e: zeros) {
-    printf("%d/%d ", e.first, e.second);
+const char* kMoveNames[kNumMoves] = {
+  "extend", "interchange", "local", "join_by_advice", "fixlen", "disconnect", "postprocess"
+};
+
+// Picks moves with probability proportional to their weights. Weights start
+// as configured (the *_p settings). With adaptive_moves they are recomputed
+// every adaptive_interval iterations from likelihood gained per second of
+// each move type: weight = configured * (floor + (1 - floor) * rate / mean
+// rate), scaled to stay integral. The floor keeps moves which only pay off
+// later (like disconnect) in play. Statistics are halved after every
+// reweighting, so the weights follow the phase of the annealing.
+const int kMoveWeightScale = 100;
+const double kMoveWeightFloor = 0.1;
+const double kMoveMaxBoost = 10;
+
+struct MoveScheduler {
+  MoveScheduler() : base(kNumMoves), weights(kNumMoves), tried(kNumMoves),
+                    accepted(kNumMoves), seconds(kNumMoves), gain(kNumMoves) {}
+
+  void Init(const AssemblySettings& settings, bool has_advice) {
+    base[kExtend] = settings.extendp;
+    base[kInterchange] = settings.fixp;
+    base[kLocal] = settings.localp;
+    base[kExtendAdv] = has_advice ? settings.extendadvp : 0;
+    base[kFixLen] = settings.fixlenp;
+    base[kBreak] = settings.breakp;
+    weights = base;
   }
-  printf("\n");
-  OutputPathsToFile(paths, gr, kmer, threshold, settings.output_prefix);
-  printf("\n");
 
-  int itnum = 0;
-  int start_len = total_len;
-  double T = 5;
-  double best_prob = cur_prob;
-  vector<vector<int> > best_paths = paths;
-  int num_start_paths = paths.size();
-  while (true) {
-    int clean = -1;
-    unordered_map<int, vector<int> > locs;
-    for (int i = 0; i < paths.size(); i++) {
-      for (int j = 0; j < paths[i].size(); j++) {
-        locs[paths[i][j]].push_back(i);
-        locs[paths[i][j]^1].push_back(i);
-      }
+  int Pick(default_random_engine& gen) const {
+    int total = 0;
+    for (auto w: weights) total += w;
+    int r = RandomInt(gen, total);
+    for (int i = 0; i < kNumMoves; i++) {
+      if (r < weights[i]) return i;
+      r -= weights[i];
     }
-    for (int i = 0; i < paths.size(); i++) {
-      if (paths[i].size() > 1) {
-        continue;
-      }
-      for (int j = 0; j < locs[paths[i][0]].size(); j++) {
-        if (locs[paths[i][0]][j] != i) {
-          clean = i;
-        }
+    return kNumMoves - 1;
+  }
+
+  // A try of move which took seconds and raised the likelihood by gain.
+  void Record(int move, double secs, double g, bool acc) {
+    tried[move]++;
+    seconds[move] += secs;
+    gain[move] += max(g, 0.0);
+    if (acc) accepted[move]++;
+  }
+
+  void Reweight(int itnum) {
+    vector<double> rate(kNumMoves, -1);
+    double rate_sum = 0, base_sum = 0;
+    for (int i = 0; i < kNumMoves; i++) {
+      if (base[i] == 0 || tried[i] == 0 || seconds[i] <= 0) continue;
+      rate[i] = gain[i] / seconds[i];
+      rate_sum += base[i] * rate[i];
+      base_sum += base[i];
+    }
+    printf("move weights itnum %d:", itnum);
+    for (int i = 0; i < kNumMoves; i++) {
+      double factor = 1;
+      if (rate_sum > 0) {
+        double mean = rate_sum / base_sum;
+        // moves not tried yet keep the mean rate
+        double rel = rate[i] < 0 ? 1 : min(rate[i] / mean, kMoveMaxBoost);
+        factor = kMoveWeightFloor + (1 - kMoveWeightFloor) * rel;
       }
+      weights[i] = (int)round(base[i] * kMoveWeightScale * factor);
+      if (base[i] > 0 && weights[i] == 0) weights[i] = 1;
+      printf(" %s %d (acc %.0lf/%.0lf %.3lfs gain/s %lf)", kMoveNames[i], weights[i],
+             accepted[i], tried[i], seconds[i], seconds[i] > 0 ? gain[i] / seconds[i] : 0);
+      tried[i] /= 2;
+      accepted[i] /= 2;
+      seconds[i] /= 2;
+      gain[i] /= 2;
     }
-    if (clean == -1) {
-      break;
+    printf("\n");
+  }
+
+  template<class Archive>
+  void serialize(Archive & ar, const unsigned int version) {
+    ar & weights;
+    ar & tried;
+    ar & accepted;
+    ar & seconds;
+    ar & gain;
+  }
+
+  vector<int> base;
+  vector<int> weights;
+  // decayed statistics since the start
+  vector<double> tried;
+  vector<double> accepted;
+  vector<double> seconds;
+  vector<double> gain;
+};
+
+// Resident memory of the process in kB, 0 when it cannot be read.
+long long ResidentMemoryKb() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return 0;
+  long long size = 0, resident = 0;
+  if (fscanf(f, "%lld %lld", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// One iteration of a chain as written to the telemetry.
+struct TelemetryRow {
+  int chain;
+  int itnum;
+  double temp;
+  int move;
+  // time spent on making and scoring the proposal
+  double eval_seconds;
+  double new_prob;
+  double cur_prob;
+  double best_prob;
+  double delta;
+  bool accepted;
+  int len;
+  int paths;
+  int low_prob_reads;
+};
+
+// Per iteration records in CSV (with a header line) or JSONL, in place of
+// the itnum lines on the console. Chains of parallel tempering share one
+// stream. A resumed run appends to the file. Rows are buffered until the next
+// checkpoint or the end of the run.
+class Telemetry {
+ public:
+  // resident memory is read once per this many rows
+  static const int kRssInterval = 100;
+
+  Telemetry() : f_(NULL), jsonl_(false), rows_(0), rss_(0) {}
+  ~Telemetry() {
+    if (f_ != NULL) fclose(f_);
+  }
+
+  bool Open(const string& filename, const string& format, bool append) {
+    jsonl_ = format == "jsonl";
+    f_ = fopen(filename.c_str(), append ? "a" : "w");
+    if (f_ == NULL) {
+      printf("cannot open telemetry file %s\n", filename.c_str());
+      return false;
+    }
+    start_ = chrono::steady_clock::now();
+    if (!jsonl_ && ftell(f_) == 0) {
+      fprintf(f_, "chain,itnum,seconds,temp,move,eval_seconds,new_prob,cur_prob,best_prob,"
+                  "delta,accepted,len,paths,low_prob_reads,rss_kb\n");
     }
-    printf("clean %d\n", clean);
-    paths.erase(paths.begin() + clean);
-  }
-
-  map<int, int> last_rep;
-
-  while (itnum <= settings.max_iterations) {
-    // Start with checking repeated nodes and fix them
-    
-    vector<vector<int> > new_paths = paths;
-    int extendadvp = settings.extendadvp;
-    int extendp = settings.extendp;
-    int breakp = settings.breakp;
-    int fixp = settings.fixp;
-    int localp = settings.localp;
-    int fixlenp = settings.fixlenp;
-    if (advice_pacbio.size() + advice_paired.size() == 0) {
-      extendadvp = 0;
-    }
-    int r = rand() % (extendp + breakp + fixp + localp + extendadvp + fixlenp);
-    bool was_local = false;
-    bool was_break = false;
-    int local_p, local_s, local_t;
-    bool accept = false;
-    bool force_best = false;
-   
-    // Pick move and do it
-    if (settings.do_postprocess) {
-      FixBigReps(new_paths, gr, threshold, true, prob_calc);
+    return true;
+  }
+
+  // Seconds of rows are counted from start, which is earlier than Open in a
+  // resumed run.
+  void SetStart(chrono::steady_clock::time_point start) {
+    start_ = start;
+  }
+
+  void Write(const TelemetryRow& r) {
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start_).count();
+    lock_guard<mutex> g(lock_);
+    if (rows_++ % kRssInterval == 0) {
+      rss_ = ResidentMemoryKb();
+    }
+    long long rss = rss_;
+    if (jsonl_) {
+      fprintf(f_, "{\"chain\":%d,\"itnum\":%d,\"seconds\":%.3lf,\"temp\":%lg,"
+                  "\"move\":\"%s\",\"eval_seconds\":%.6lf,\"new_prob\":%.9lf,"
+                  "\"cur_prob\":%.9lf,\"best_prob\":%.9lf,\"delta\":%.9lf,"
+                  "\"accepted\":%s,\"len\":%d,\"paths\":%d,\"low_prob_reads\":%d,"
+                  "\"rss_kb\":%lld}\n",
+              r.chain, r.itnum, secs, r.temp, kMoveNames[r.move], r.eval_seconds,
+              r.new_prob, r.cur_prob, r.best_prob, r.delta, r.accepted ? "true" : "false",
+              r.len, r.paths, r.low_prob_reads, rss);
     } else {
+      fprintf(f_, "%d,%d,%.3lf,%lg,%s,%.6lf,%.9lf,%.9lf,%.9lf,%.9lf,%d,%d,%d,%d,%lld\n",
+              r.chain, r.itnum, secs, r.temp, kMoveNames[r.move], r.eval_seconds,
+              r.new_prob, r.cur_prob, r.best_prob, r.delta, r.accepted ? 1 : 0,
+              r.len, r.paths, r.low_prob_reads, rss);
+    }
+  }
 
-      if (r < extendp) {
-        if (!ExtendPaths(new_paths, gr, threshold, prob_calc)) {
-          continue;
-        }
-      } else if (r < extendp + fixp) {
-        if (!FixSomeBigReps(new_paths, gr, threshold, false, prob_calc)) {
-          continue;
-        }
-      } else if (r < extendp + fixp + localp) {
-        if (!LocalChange(new_paths, gr, threshold, local_p, local_s, local_t, prob_calc)) {
-          continue;
-        }
-        if (local_p != -1) {
-          was_local = true;
-          printf("loc %d %d %d %d %d\n", new_paths[local_p][local_s], new_paths[local_p][local_t],
-                 local_p, local_s, local_t);
-        }
-      } else if (r < extendp + fixp + localp + extendadvp) {
-        int r2 = rand() % (advice_pacbio.size() + advice_paired.size());
-        if (r2 < advice_pacbio.size()) {
-          PacbioReadSet* advice_set = advice_pacbio[rand()%advice_pacbio.size()];
-          if (!ExtendPathsAdv(new_paths, gr, threshold, *advice_set, kmer, prob_calc)) {
-            continue;
-          }
-        } else {
-          pair<ReadSet*, ReadSet*> advice_set = advice_paired[rand()%advice_paired.size()];
-          if (!ExtendPathsAdv(new_paths, gr, threshold, *advice_set.first, 
-                              *advice_set.second, kmer, prob_calc)) {
-            continue;
-          }          
-        }
-      } else if (r < extendp + fixp + localp + extendadvp + fixlenp) {
-        if (!FixGapLength(new_paths, prob_calc)) {
-          continue;
-        }
-      } else {
-        if (!BreakPath(new_paths, gr, threshold)) {
-          continue;
-        }
-        was_break = true;
+  void Flush() {
+    lock_guard<mutex> g(lock_);
+    fflush(f_);
+  }
+
+ private:
+  FILE* f_;
+  bool jsonl_;
+  int rows_;
+  // last sampled resident memory
+  long long rss_;
+  chrono::steady_clock::time_point start_;
+  mutex lock_;
+};
+
+// Occurrences of nodes in the paths of a chain, kept up to date path by path
+// as accepted moves take paths out and put new ones in. A node and its
+// reverse share the key x >> 1 (gaps too).
+struct PathIndex {
+  void Init(Graph& gr, int threshold, const PathSet& paths) {
+    counts.clear();
+    lone.clear();
+    long_counts.assign(gr.nodes.size() / 2, 0);
+    for (auto &p: paths) {
+      AddPath(gr, threshold, p);
+    }
+  }
+
+  void AddPath(Graph& gr, int threshold, const vector<int>& p) {
+    Update(gr, threshold, p, 1);
+  }
+  void RemovePath(Graph& gr, int threshold, const vector<int>& p) {
+    Update(gr, threshold, p, -1);
+  }
+
+  int Count(int key) const {
+    auto it = counts.find(key);
+    return it == counts.end() ? 0 : it->second;
+  }
+  int Lone(int key) const {
+    auto it = lone.find(key);
+    return it == lone.end() ? 0 : it->second;
+  }
+
+  // occurrences by key
+  unordered_map<int, int> counts;
+  // paths made of one node by key
+  unordered_map<int, int> lone;
+  // occurrences of long nodes by node/2
+  vector<int> long_counts;
+
+ private:
+  static void Bump(unordered_map<int, int>& m, int key, int d) {
+    int& c = m[key];
+    c += d;
+    if (c == 0) {
+      m.erase(key);
+    }
+  }
+
+  void Update(Graph& gr, int threshold, const vector<int>& p, int d) {
+    for (auto x: p) {
+      Bump(counts, x >> 1, d);
+      if (x >= 0 && gr.NodeLen(x) > threshold) {
+        long_counts[x/2] += d;
       }
     }
-    // Rep stats
-    {
-      unordered_map<int, int> counts;
-      for (int i = 0; i < gr.nodes.size(); i+=2) {
-        if (gr.nodes[i]->s.length() > threshold) {
-          counts[i] = 0;
-        }
+    if (p.size() == 1) {
+      Bump(lone, p[0] >> 1, d);
+    }
+  }
+};
+
+// State of one annealing chain. With parallel tempering every chain has its
+// own scoring state (prob_calc) and random generator, temp_scale places it on
+// the temperature ladder.
+struct Chain {
+  Chain() : prob_calc(NULL), itnum(0), T(5), temp_scale(1), proposed(0),
+            accepted(0), output_best(true), id(0), best_itnum(0), acceptance(1),
+            telemetry(NULL) {}
+
+  ProbCalculator* prob_calc;
+  PathSet paths;
+  PathSet best_paths;
+  double cur_prob;
+  double best_prob;
+  int total_len;
+  vector<pair<int, int>> zeros;
+  int itnum;
+  double T;
+  double temp_scale;
+  int proposed;
+  int accepted;
+  // print best paths every 100 iterations
+  bool output_best;
+  int id;
+  default_random_engine gen;
+  // long nodes, their occurrences are in index
+  vector<int> long_nodes;
+  // occurrences of nodes in paths, updated by accepted proposals
+  PathIndex index;
+  MoveScheduler moves;
+  // iteration of the last improvement of best_prob
+  int best_itnum;
+  // moving average of acceptance over about acceptance_window iterations
+  double acceptance;
+  // iterations go here instead of the console when set
+  Telemetry* telemetry;
+  // paths of local changes saved by Decide, other chains do not see them
+  ReachOverrides reach;
+
+  // Checkpoints keep what changes during the run, the rest is set up again.
+  template<class Archive>
+  void save(Archive & ar, const unsigned int version) const {
+    ostringstream gen_state;
+    gen_state << gen;
+    string gs = gen_state.str();
+    ar << paths << best_paths << cur_prob << best_prob << total_len << zeros;
+    ar << itnum << T << temp_scale << proposed << accepted << gs << moves;
+    ar << best_itnum << acceptance << reach;
+  }
+  template<class Archive>
+  void load(Archive & ar, const unsigned int version) {
+    string gs;
+    ar >> paths >> best_paths >> cur_prob >> best_prob >> total_len >> zeros;
+    ar >> itnum >> T >> temp_scale >> proposed >> accepted >> gs >> moves;
+    ar >> best_itnum >> acceptance >> reach;
+    istringstream gen_state(gs);
+    gen_state >> gen;
+  }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+// Long nodes with a forward id, in increasing order.
+vector<int> LongNodes(Graph& gr, int threshold) {
+  vector<int> ret;
+  for (int i = 0; i < gr.nodes.size(); i+=2) {
+    if (gr.NodeLen(i) > threshold) {
+      ret.push_back(i);
+    }
+  }
+  return ret;
+}
+
+// Removes paths made of one node which is also in another path. paths were
+// made from old_paths (described by index), which have no such paths, so
+// only nodes of the paths taken out or put in are looked at. Paths are
+// checked from the last one, so the printed indexes are the same as with
+// removing the last such path and looking again. The paths of old_paths
+// which are gone in the end go to removed, the new ones to added.
+void RemoveLoneRepeatedNodes(const PathSet& old_paths, const PathIndex& index,
+                             PathSet& paths, bool was_local, int& local_p,
+                             PathSet& removed, PathSet& added) {
+  vector<int> out, in;
+  old_paths.Diff(paths, out, in);
+  unordered_map<int, int> count_delta, lone_delta;
+  auto change = [&](const vector<int>& p, int d) {
+    for (auto x: p) {
+      count_delta[x >> 1] += d;
+    }
+    if (p.size() == 1) {
+      lone_delta[p[0] >> 1] += d;
+    }
+  };
+  for (auto i: out) {
+    change(old_paths[i], -1);
+  }
+  for (auto i: in) {
+    change(paths[i], 1);
+  }
+  // occurrences of touched keys which have a lone path and appear elsewhere
+  unordered_map<int, int> occ;
+  for (auto &e: count_delta) {
+    int c = index.Count(e.first) + e.second;
+    if (c > 1 && index.Lone(e.first) + lone_delta[e.first] > 0) {
+      occ[e.first] = c;
+    }
+  }
+  bool erased = false;
+  for (int i = (int)paths.size() - 1; i >= 0 && !occ.empty(); i--) {
+    if (paths[i].size() > 1) {
+      continue;
+    }
+    auto it = occ.find(paths[i][0] >> 1);
+    if (it == occ.end() || it->second <= 1) {
+      continue;
+    }
+    it->second--;
+    if (was_local && i < local_p) {
+      local_p--;
+    }
+    printf("clean %d\n", i);
+    paths.erase(paths.begin() + i);
+    erased = true;
+  }
+  if (erased) {
+    out.clear();
+    in.clear();
+    old_paths.Diff(paths, out, in);
+  }
+  removed = PathSet();
+  added = PathSet();
+  for (auto i: out) {
+    removed.Append(old_paths, i);
+  }
+  for (auto i: in) {
+    added.Append(paths, i);
+  }
+}
+
+// Proposed state of a chain.
+struct Proposal {
+  PathSet paths;
+  bool was_local;
+  bool was_break;
+  int local_p, local_s, local_t;
+  double prob;
+  int total_len;
+  vector<pair<int, int>> zeros;
+  int move;
+  // paths of the chain the proposal takes out and the ones it puts in
+  PathSet removed;
+  PathSet added;
+  // time spent on making and scoring the proposal, without waiting for
+  // aligment cache locks held by other threads
+  double seconds;
+};
+
+// Makes a random move from the current paths of the chain, all random choices
+// are drawn from gen. Returns false when the move could not be made.
+bool Propose(Graph& gr, const Chain& chain, ProbCalculator& prob_calc, Proposal& p,
+             vector<pair<ReadSet*, ReadSet*>>& advice_paired,
+             vector<PacbioReadSet*>& advice_pacbio,
+             AssemblySettings& settings, int kmer, default_random_engine& gen) {
+  int threshold = settings.threshold;
+  PathSet& new_paths = p.paths;
+  new_paths = chain.paths;
+  int move = p.move = settings.do_postprocess ? kPostprocess : chain.moves.Pick(gen);
+  bool& was_local = p.was_local;
+  bool& was_break = p.was_break;
+  int& local_p = p.local_p;
+  int& local_s = p.local_s;
+  int& local_t = p.local_t;
+  was_local = false;
+  was_break = false;
+
+  // Pick move and do it
+  if (settings.do_postprocess) {
+    FixBigReps(new_paths, gr, threshold, true, prob_calc);
+  } else {
+
+    if (move == kExtend) {
+      if (!ExtendPaths(new_paths, gr, threshold, chain.reach, prob_calc, gen)) {
+        return false;
       }
-      for (int i = 0; i < paths.size(); i++) {
-        for (int j = 0; j < paths[i].size(); j++) {
-          if (paths[i][j] >= 0 && gr.nodes[paths[i][j]]->s.length() > threshold) {
-            counts[(paths[i][j]/2)*2]++;
-          }
-        }
+    } else if (move == kInterchange) {
+      if (!FixSomeBigReps(new_paths, gr, threshold, false, prob_calc, gen)) {
+        return false;
       }
-      bool rep = false;
-      for (auto &e: counts) {
-        if (e.second > 1) {
-          rep = true;
-          printf("(%d: %dx %d) ", e.first, e.second, gr.nodes[e.first]->s.length());
-        }
-        if (e.second == 0) {
-          new_paths.push_back(vector<int>({e.first}));
+    } else if (move == kLocal) {
+      if (!LocalChange(new_paths, gr, threshold, local_p, local_s, local_t, prob_calc, gen)) {
+        return false;
+      }
+      if (local_p != -1) {
+        was_local = true;
+        printf("loc %d %d %d %d %d\n", new_paths[local_p][local_s], new_paths[local_p][local_t],
+               local_p, local_s, local_t);
+      }
+    } else if (move == kExtendAdv) {
+      int r2 = RandomInt(gen, advice_pacbio.size() + advice_paired.size());
+      if (r2 < advice_pacbio.size()) {
+        PacbioReadSet* advice_set = advice_pacbio[RandomInt(gen, advice_pacbio.size())];
+        if (!ExtendPathsAdv(new_paths, gr, threshold, *advice_set, kmer, chain.reach,
+                            prob_calc, gen)) {
+          return false;
         }
+      } else {
+        pair<ReadSet*, ReadSet*> advice_set = advice_paired[RandomInt(gen, advice_paired.size())];
+        if (!ExtendPathsAdv(new_paths, gr, threshold, *advice_set.first, 
+                            *advice_set.second, kmer, chain.reach, prob_calc, gen)) {
+          return false;
+        }          
       }
-      if (rep) printf("\n");
+    } else if (move == kFixLen) {
+      if (!FixGapLength(new_paths, prob_calc, chain.cur_prob, gen)) {
+        return false;
+      }
+    } else {
+      if (!BreakPath(new_paths, gr, threshold, gen)) {
+        return false;
+      }
+      was_break = true;
     }
-
-    // Remove lone repeated nodes
-    while (true) {
-      int clean = -1;
-      unordered_map<int, vector<int> > locs;
-      for (int i = 0; i < new_paths.size(); i++) {
-        for (int j = 0; j < new_paths[i].size(); j++) {
-          locs[new_paths[i][j]].push_back(i);
-          locs[new_paths[i][j]^1].push_back(i);
-        }
+  }
+  // Rep stats
+  {
+    bool rep = false;
+    for (auto n: chain.long_nodes) {
+      int count = chain.index.long_counts[n/2];
+      if (count > 1) {
+        rep = true;
+        printf("(%d: %dx %d) ", n, count, gr.NodeLen(n));
       }
-      for (int i = 0; i < new_paths.size(); i++) {
-        if (new_paths[i].size() > 1) {
-          continue;
-        }
-        for (int j = 0; j < locs[new_paths[i][0]].size(); j++) {
-          if (locs[new_paths[i][0]][j] != i) {
-            clean = i;
-          }
-        }
+      if (count == 0) {
+        new_paths.push_back(vector<int>({n}));
       }
-      if (clean == -1) {
-        break;
+    }
+    if (rep) printf("\n");
+  }
+
+  // Remove lone repeated nodes
+  RemoveLoneRepeatedNodes(chain.paths, chain.index, new_paths, was_local, local_p,
+                          p.removed, p.added);
+  return true;
+}
+
+// Counts the scored proposal p as the next iteration and accepts or rejects
+// it, random acceptance draws from gen. Returns true when it was accepted.
+bool Decide(Graph& gr, Chain& chain, Proposal& p, AssemblySettings& settings,
+            default_random_engine& gen) {
+  bool accept = false;
+  bool force_best = false;
+  PathSet& new_paths = p.paths;
+  double new_prob = p.prob;
+  double old_prob = chain.cur_prob;
+  chain.proposed++;
+
+  if (new_prob > chain.cur_prob || settings.do_postprocess) {
+    if (p.was_local) {
+      printf("local save\n");
+      vector<int> pp;
+      for (int i = p.local_s+1; i < p.local_t; i++) {
+        pp.push_back(new_paths[p.local_p][i]);
+      }
+      int s = new_paths[p.local_p][p.local_s];
+      int t = new_paths[p.local_p][p.local_t];
+      printf("s t %d %d\n", s, t);
+      if (gr.reach_big_.HasTarget(s, t)) {
+        chain.reach.big[ReachTable::PairKey(s, t)] = pp;
       }
-      if (was_local && clean < local_p) {
-        local_p--;
+      if (gr.reach_limit_.HasTarget(s, t)) {
+        chain.reach.limit[ReachTable::PairKey(s, t)] = pp;
       }
-      printf("clean %d\n", clean);
-      new_paths.erase(new_paths.begin() + clean);
     }
+    accept = true;
+  } else if (p.was_break) {
+    double prob = exp((new_prob - chain.cur_prob) / chain.T);
+    uniform_real_distribution<double> dist(0.0, 1.0);
+    double samp = dist(gen);
+    if (samp < prob) {
+      accept = true;
+    }
+  }
+  if (new_prob > chain.best_prob || force_best) {
+    chain.best_prob = new_prob;
+    chain.best_paths = new_paths;
+    chain.best_itnum = chain.itnum;
+  }
+  chain.acceptance += ((accept ? 1 : 0) - chain.acceptance) / settings.acceptance_window;
+  if (accept) {
+    printf("accept\n");
+    chain.accepted++;
+    chain.cur_prob = new_prob;
+    chain.paths.swap(new_paths);
+    for (auto &q: p.removed) {
+      chain.index.RemovePath(gr, settings.threshold, q);
+    }
+    for (auto &q: p.added) {
+      chain.index.AddPath(gr, settings.threshold, q);
+    }
+    if (settings.lazy_reach && settings.reach_prefetch) {
+      PrefetchPathEnds(gr, chain.paths);
+    }
+  }
+  chain.moves.Record(p.move, p.seconds, accept ? new_prob - old_prob : 0, accept);
+  chain.total_len = p.total_len;
+  chain.zeros = p.zeros;
+  int num_paths = accept ? chain.paths.size() : new_paths.size();
+  if (chain.telemetry != NULL) {
+    TelemetryRow r;
+    r.chain = chain.id;
+    r.itnum = chain.itnum;
+    r.temp = chain.T;
+    r.move = p.move;
+    r.eval_seconds = p.seconds;
+    r.new_prob = new_prob;
+    r.cur_prob = chain.cur_prob;
+    r.best_prob = chain.best_prob;
+    r.delta = new_prob - old_prob;
+    r.accepted = accept;
+    r.len = p.total_len;
+    r.paths = num_paths;
+    r.low_prob_reads = 0;
+    for (auto &e: p.zeros) {
+      r.low_prob_reads += e.first;
+    }
+    chain.telemetry->Write(r);
+    return accept;
+  }
+  time_t rawtime;
+  struct tm timeinfo;
+  char buffer [80];
+
+  time (&rawtime);
+  // chains decide on several threads
+  localtime_r (&rawtime, &timeinfo);
+
+  // Output debug info
+  strftime (buffer,80,"%H:%M:%S",&timeinfo);
+  if (!chain.output_best) {
+    printf("chain %d ", chain.id);
+  }
+  printf("itnum %d temp %lf time %s new prob %lf %lf %lf len %d paths %d low prob reads ",
+         chain.itnum, chain.T,
+         buffer, new_prob,
+         chain.cur_prob, chain.best_prob,
+         p.total_len, num_paths);
+  for (auto &e: p.zeros) {
+    printf("%d/%d ", e.first, e.second);
+  }
+  printf("\n");
+  return accept;
+}
+
+// Starts the next iteration: updates temperature and outputs best paths
+// every 100 iterations.
+void NextIteration(Graph& gr, Chain& chain, AssemblySettings& settings, int kmer) {
+  chain.itnum++;
+  chain.T = settings.t0 / log(chain.itnum + 1) * chain.temp_scale;
+  if (chain.output_best && chain.itnum % 100 == 0) {
+    printf("cur best %lf: ", chain.best_prob);
+    OutputPathsToFile(chain.best_paths.ToVectors(), gr, kmer, settings.threshold, settings.output_prefix);
+    printf("\n");
+  }
+}
+
+// With adaptive_moves, recomputes move weights when the chain has passed a
+// multiple of adaptive_interval since prev_itnum. Called between steps only,
+// so all proposals taken in one step were picked with the same weights.
+void ReweightMovesIfDue(Chain& chain, int prev_itnum, AssemblySettings& settings) {
+  int interval = settings.adaptive_interval;
+  if (settings.adaptive_moves && chain.itnum / interval > prev_itnum / interval) {
+    chain.moves.Reweight(chain.itnum);
+  }
+}
+
+// One iteration of the chain: proposes a move, scores it and accepts or
+// rejects it. Returns false when the move could not be made, such tries do
+// not count as iterations.
+bool Step(Graph& gr, Chain& chain,
+          vector<pair<ReadSet*, ReadSet*>>& advice_paired,
+          vector<PacbioReadSet*>& advice_pacbio,
+          AssemblySettings& settings, int kmer) {
+  Proposal p;
+  auto start = chrono::steady_clock::now();
+  double wait_start = LockWaitSeconds();
+  if (!Propose(gr, chain, *chain.prob_calc, p, advice_paired, advice_pacbio,
+               settings, kmer, chain.gen)) {
+    chain.moves.Record(p.move, chrono::duration<double>(
+        chrono::steady_clock::now() - start).count() - (LockWaitSeconds() - wait_start),
+        0, false);
+    return false;
+  }
+  NextIteration(gr, chain, settings, kmer);
+  //OutputPathsToConsole(new_paths, gr, threshold);
+  //printf("\n");
+
+  // Evaluate probability
+  p.prob = chain.prob_calc->CalcProb(p.paths, p.zeros, p.total_len);
+  p.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() -
+              (LockWaitSeconds() - wait_start);
+  Decide(gr, chain, p, settings, chain.gen);
+  ReweightMovesIfDue(chain, chain.itnum - 1, settings);
+  return true;
+}
+
+// Speculative version of Step: calcs.size() proposals are made from the
+// current state and scored in parallel, then they are taken as consecutive
+// iterations in order up to the first accepted one. The rest was proposed
+// from a state which is no longer current and is dropped. As proposals are
+// independent given the current state, the chain moves as with Step.
+void SpeculativeStep(Graph& gr, Chain& chain, vector<ProbCalculator>& calcs,
+                     vector<pair<ReadSet*, ReadSet*>>& advice_paired,
+                     vector<PacbioReadSet*>& advice_pacbio,
+                     AssemblySettings& settings, int kmer) {
+  int k = calcs.size();
+  vector<Proposal> proposals(k);
+  vector<char> ok(k);
+  // every proposal draws from its own generator
+  vector<unsigned> seeds(k);
+  for (auto &s: seeds) {
+    s = chain.gen();
+  }
+  ParallelFor(0, k, 1, [&](int t, int i) {
+    default_random_engine gen(seeds[i]);
+    auto start = chrono::steady_clock::now();
+    double wait_start = LockWaitSeconds();
+    Proposal& p = proposals[i];
+    ok[i] = Propose(gr, chain, calcs[i], p, advice_paired, advice_pacbio,
+                    settings, kmer, gen);
+    if (ok[i]) {
+      p.prob = calcs[i].CalcProb(p.paths, p.zeros, p.total_len);
+    }
+    // proposals made at the same time wait for each other's aligment cache
+    // fills, that time is not the cost of the move
+    p.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() -
+                (LockWaitSeconds() - wait_start);
+  });
+  int first_itnum = chain.itnum;
+  int i = 0;
+  for (; i < k && chain.itnum <= settings.max_iterations; i++) {
+    if (!ok[i]) {
+      chain.moves.Record(proposals[i].move, proposals[i].seconds, 0, false);
+      continue;
+    }
+    NextIteration(gr, chain, settings, kmer);
+    if (Decide(gr, chain, proposals[i], settings, chain.gen)) {
+      i++;
+      break;
+    }
+  }
+  // dropped proposals cost time too
+  for (; i < k; i++) {
+    chain.moves.Record(proposals[i].move, proposals[i].seconds, 0, false);
+  }
+  ReweightMovesIfDue(chain, first_itnum, settings);
+}
+
+// seed of the run's random engine, chains are seeded from it
+const unsigned kRandomSeed = 47;
+
+// Chains of a run and the calculators scoring for them, with counters of
+// parallel tempering.
+struct RunState {
+  RunState() : gen(kRandomSeed), round(0), swaps(0), swap_tries(0), next_checkpoint(0) {}
+
+  // Seconds since start of the run, counted over resumes.
+  double Elapsed() const {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  // start of the optimization, moved back by the time of the runs before a
+  // resume
+  chrono::steady_clock::time_point start;
+  vector<Chain> chains;
+  vector<ProbCalculator*> calcs;
+  // seeds chains and draws temperature swaps
+  default_random_engine gen;
+  int round;
+  int swaps;
+  int swap_tries;
+  // iteration of chain 0 after which the next checkpoint is written
+  int next_checkpoint;
+};
+
+const int kCheckpointVersion = 7;
+
+// Writes checkpoints in a background thread, one at a time. Data go to a
+// temporary file first, so a write cut short keeps the previous checkpoint.
+class CheckpointWriter {
+ public:
+  CheckpointWriter(const string& filename) : filename_(filename) {}
+  ~CheckpointWriter() {
+    Wait();
+  }
+
+  // Aligment caches of calc are pinned right away and saved in background
+  // too, before the checkpoint itself.
+  void Write(int itnum, string data, ProbCalculator* calc) {
+    Wait();
+    calc->PinAligments();
+    writer_ = thread(&CheckpointWriter::WriteFile, this, itnum, std::move(data), calc);
+  }
+
+  void Wait() {
+    if (writer_.joinable()) {
+      writer_.join();
+    }
+  }
 
-    itnum++;
-    T = settings.t0 / log(itnum + 1);
-    if (itnum % 100 == 0) {
-      printf("cur best %lf: ", best_prob);
-      OutputPathsToFile(best_paths, gr, kmer, threshold, settings.output_prefix);
-      printf("\n");
+ private:
+  void WriteFile(int itnum, string data, ProbCalculator* calc) {
+    calc->SavePinnedAligments();
+    string tmpname = filename_ + ".tmp";
+    FILE* f = fopen(tmpname.c_str(), "wb");
+    if (f == NULL) {
+      printf("cannot write checkpoint %s\n", tmpname.c_str());
+      return;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+    if (ok && rename(tmpname.c_str(), filename_.c_str()) == 0) {
+      printf("checkpoint itnum %d written to %s\n", itnum, filename_.c_str());
+    } else {
+      printf("cannot write checkpoint %s\n", filename_.c_str());
     }
-    //OutputPathsToConsole(new_paths, gr, threshold);
-    //printf("\n");
+  }
 
-    // Evaluate probability
-    double new_prob = prob_calc.CalcProb(new_paths, zeros, total_len);
+  string filename_;
+  thread writer_;
+};
 
-    if (new_prob > cur_prob || settings.do_postprocess) {
-      if (was_local) {
-        printf("local save\n");
-        vector<int> pp;
-        for (int i = local_s+1; i < local_t; i++) {
-          pp.push_back(new_paths[local_p][i]);
-        }
-        int s = new_paths[local_p][local_s];
-        int t = new_paths[local_p][local_t];
-        printf("s t %d %d\n", s, t);
-        if (gr.reach_big_[s].count(t)) {
-          gr.reach_big_[s][t] = pp;
-        }
-        if (gr.reach_limit_[s].count(t)) {
-          gr.reach_limit_[s][t] = pp;
+// Serializes the run.
+string SaveCheckpoint(Graph& gr, RunState& run) {
+  ostringstream gen_state;
+  gen_state << run.gen;
+  string gs = gen_state.str();
+  int version = kCheckpointVersion;
+  unsigned long long fingerprint = gr.Fingerprint();
+  int num_chains = run.chains.size();
+  int num_calcs = run.calcs.size();
+  ostringstream out;
+  {
+    boost::archive::binary_oarchive oa(out);
+    oa << version << fingerprint << num_chains << num_calcs;
+    double elapsed = run.Elapsed();
+    oa << run.round << run.swaps << run.swap_tries << gs << elapsed;
+    for (auto &c: run.chains) {
+      oa << c;
+    }
+    for (auto c: run.calcs) {
+      oa << *c;
+    }
+  }
+  return out.str();
+}
+
+// Loads a checkpoint into a run set up with the same settings. Returns false
+// (and leaves the run as it was) when there is none or it is of another run.
+bool LoadCheckpoint(const string& filename, Graph& gr, RunState& run, int threshold) {
+  ifstream ifs(filename, ios::binary);
+  if (!ifs.is_open()) {
+    printf("no checkpoint %s, starting from the beginning\n", filename.c_str());
+    return false;
+  }
+  boost::archive::binary_iarchive ia(ifs);
+  int version, num_chains, num_calcs;
+  unsigned long long fingerprint;
+  ia >> version >> fingerprint >> num_chains >> num_calcs;
+  if (version != kCheckpointVersion || fingerprint != gr.Fingerprint() ||
+      num_chains != run.chains.size() || num_calcs != run.calcs.size()) {
+    printf("checkpoint %s is of another graph or settings, starting from the beginning\n",
+           filename.c_str());
+    return false;
+  }
+  string gs;
+  double elapsed;
+  ia >> run.round >> run.swaps >> run.swap_tries >> gs >> elapsed;
+  run.start = chrono::steady_clock::now() -
+              chrono::duration_cast<chrono::steady_clock::duration>(
+                  chrono::duration<double>(elapsed));
+  for (auto &c: run.chains) {
+    ia >> c;
+    c.index.Init(gr, threshold, c.paths);
+  }
+  for (auto c: run.calcs) {
+    ia >> *c;
+  }
+  istringstream gen_state(gs);
+  gen_state >> run.gen;
+  printf("resumed from %s at itnum %d\n", filename.c_str(), run.chains[0].itnum);
+  return true;
+}
+
+int NextCheckpoint(int itnum, int interval) {
+  return (itnum / interval + 1) * interval;
+}
+
+// Writes a checkpoint once chain 0 passes run.next_checkpoint, in background
+// with the aligment caches. The telemetry is flushed with it.
+void CheckpointIfDue(Graph& gr, RunState& run, CheckpointWriter* writer,
+                     AssemblySettings& settings) {
+  int itnum = run.chains[0].itnum;
+  if (writer == NULL || itnum < run.next_checkpoint) {
+    return;
+  }
+  run.next_checkpoint = NextCheckpoint(itnum, settings.checkpoint_interval);
+  if (run.chains[0].telemetry != NULL) {
+    run.chains[0].telemetry->Flush();
+  }
+  writer->Write(itnum, SaveCheckpoint(gr, run), run.calcs[0]);
+}
+
+// Paths saved by the chain whose result is output are kept in the graph.
+void MergeReachOverrides(Graph& gr, const Chain& chain) {
+  gr.reach_big_.MergeOverrides(chain.reach.big);
+  gr.reach_limit_.MergeOverrides(chain.reach.limit);
+}
+
+// Why the annealing should stop before max_iterations, or NULL. Convergence
+// rules hold for the run when they hold for all of its chains.
+const char* StopReason(const RunState& run, AssemblySettings& settings) {
+  const vector<Chain>& chains = run.chains;
+  double secs = run.Elapsed();
+  if (settings.time_limit > 0 && secs >= settings.time_limit) {
+    return "time limit";
+  }
+  bool no_improvement = settings.stop_no_improvement > 0;
+  bool low_acceptance = settings.min_acceptance > 0;
+  for (auto &c: chains) {
+    no_improvement &= c.itnum - c.best_itnum >= settings.stop_no_improvement;
+    low_acceptance &= c.itnum >= settings.acceptance_window &&
+                      c.acceptance < settings.min_acceptance;
+  }
+  if (no_improvement) {
+    return "no improvement of best";
+  }
+  if (low_acceptance) {
+    return "low acceptance";
+  }
+  return NULL;
+}
+
+// Runs settings.chains chains at temperatures t0 * temp_ladder^k. Every
+// swap_interval iterations neighbouring chains exchange temperatures with the
+// usual replica exchange probability.
+void OptimizeTempering(Graph& gr, ProbCalculator& prob_calc, const PathSet& paths,
+                       vector<pair<ReadSet*, ReadSet*>>& advice_paired,
+                       vector<PacbioReadSet*>& advice_pacbio,
+                       AssemblySettings& settings, int kmer, CheckpointWriter* writer,
+                       Telemetry* telemetry, chrono::steady_clock::time_point start) {
+  int num_chains = settings.chains;
+  int threshold = settings.threshold;
+  vector<ProbCalculator> calcs(num_chains, prob_calc);
+  RunState run;
+  run.start = start;
+  vector<Chain>& chains = run.chains;
+  chains.resize(num_chains);
+  for (int k = 0; k < num_chains; k++) {
+    Chain& c = chains[k];
+    c.id = k;
+    c.prob_calc = &calcs[k];
+    c.paths = paths;
+    c.best_paths = paths;
+    c.temp_scale = pow(settings.temp_ladder, k);
+    c.output_best = false;
+    c.telemetry = telemetry;
+    c.gen.seed(run.gen() + k);
+    c.cur_prob = c.prob_calc->CalcProb(c.paths, c.zeros, c.total_len);
+    c.best_prob = c.cur_prob;
+    c.long_nodes = LongNodes(gr, threshold);
+    c.index.Init(gr, threshold, c.paths);
+    c.moves.Init(settings, advice_paired.size() + advice_pacbio.size() > 0);
+    run.calcs.push_back(c.prob_calc);
+  }
+  if (!settings.resume.empty()) {
+    LoadCheckpoint(settings.resume, gr, run, threshold);
+  }
+  if (telemetry != NULL) {
+    telemetry->SetStart(run.start);
+  }
+  run.next_checkpoint = NextCheckpoint(chains[0].itnum, settings.checkpoint_interval);
+  double best_prob = chains[0].best_prob;
+  // chains keep their threads for the whole run, one each when there are
+  // enough threads
+  WorkerPool pool(min(num_chains, NumThreads()));
+  while (true) {
+    bool running = false;
+    for (auto &c: chains) {
+      running |= c.itnum <= settings.max_iterations;
+    }
+    if (!running) break;
+
+    pool.Run([&](int t) {
+      for (int k = t; k < num_chains; k += pool.Size()) {
+        Chain& c = chains[k];
+        int stop = c.itnum + settings.swap_interval;
+        while (c.itnum < stop && c.itnum <= settings.max_iterations) {
+          Step(gr, c, advice_paired, advice_pacbio, settings, kmer);
         }
       }
-      accept = true;
-    } else if (was_break) {
-      double prob = exp((new_prob - cur_prob) / T);
+    });
+
+    // swap temperatures of pairs (k, k+1), pairs alternate between rounds
+    for (int k = run.round % 2; k + 1 < num_chains; k += 2) {
+      Chain& a = chains[k];
+      Chain& b = chains[k+1];
+      double delta = (b.cur_prob - a.cur_prob) * (1 / a.T - 1 / b.T);
       uniform_real_distribution<double> dist(0.0, 1.0);
-      double samp = dist(generator);
-      if (samp < prob) {
-        accept = true;
+      run.swap_tries++;
+      if (delta >= 0 || dist(run.gen) < exp(delta)) {
+        swap(a.temp_scale, b.temp_scale);
+        swap(a.T, b.T);
+        run.swaps++;
       }
     }
-    if (accept) {
-      printf("accept\n");
-      cur_prob = new_prob;
-      paths = new_paths;
+
+    printf("tempering round %d swaps %d/%d\n", run.round, run.swaps, run.swap_tries);
+    for (auto &c: chains) {
+      printf("chain %d itnum %d temp %lf accept %d/%d cur %lf best %lf\n",
+             c.id, c.itnum, c.T, c.accepted, c.proposed, c.cur_prob, c.best_prob);
+      best_prob = max(best_prob, c.best_prob);
     }
-    if (new_prob > best_prob || force_best) {
-      best_prob = new_prob;
-      best_paths = new_paths;
+    printf("tempering best %lf\n", best_prob);
+    run.round++;
+    CheckpointIfDue(gr, run, writer, settings);
+    const char* reason = StopReason(run, settings);
+    if (reason != NULL) {
+      printf("stopping at round %d: %s\n", run.round, reason);
+      break;
     }
-    time_t rawtime;
-    struct tm * timeinfo;
-    char buffer [80];
+  }
 
-    time (&rawtime);
-    timeinfo = localtime (&rawtime);
+  Chain* best = &chains[0];
+  for (auto &c: chains) {
+    if (c.best_prob > best->best_prob) {
+      best = &c;
+    }
+  }
+  MergeReachOverrides(gr, *best);
+  printf("cur best %lf: ", best->best_prob);
+  OutputPathsToFile(best->best_paths.ToVectors(), gr, kmer, threshold, settings.output_prefix);
+  printf("\n");
+}
 
-    // Output debug info
-    strftime (buffer,80,"%H:%M:%S",timeinfo);
-    printf("itnum %d temp %lf time %s new prob %lf %lf %lf len %d paths %d low prob reads ",
-           itnum, T,
-           buffer, new_prob,
-           cur_prob, best_prob,
-           total_len, new_paths.size());
-    for (auto &e: zeros) {
-      printf("%d/%d ", e.first, e.second);
+// Core of optimalization procedure
+void Optimize(Graph& gr, ProbCalculator& prob_calc, PathSet paths,
+    vector<pair<ReadSet*, ReadSet*>>& advice_paired,
+    vector<PacbioReadSet*>& advice_pacbio,
+    int longest_read, AssemblySettings& settings) {
+  auto start = chrono::steady_clock::now();
+  int threshold = settings.threshold;
+  int max_dist = 2*longest_read;
+  if (!settings.reach_file.empty() &&
+      gr.LoadReachability(settings.reach_file, threshold, max_dist)) {
+    // nothing to compute
+  } else if (settings.lazy_reach) {
+    gr.CalcReachability();
+    gr.SetLazyReachability(threshold, max_dist, settings.reach_cache_size);
+    if (settings.reach_prefetch) {
+      PrefetchPathEnds(gr, paths);
+    }
+  } else {
+    gr.CalcReachability();
+    gr.CalcReachabilityBig(threshold);
+    gr.CalcReachabilityLimit(max_dist);
+    if (!settings.reach_file.empty()) {
+      gr.SaveReachability(settings.reach_file, threshold, max_dist);
     }
+  }
+
+  int total_len;
+  int kmer = 47;
+
+  vector<pair<int, int>> zeros;
+  double cur_prob = prob_calc.CalcProb(paths, zeros, total_len);
+  printf("start prob %lf len %d low prob reads", cur_prob, total_len);
+  for (auto &e: zeros) {
+    printf("%d/%d ", e.first, e.second);
+  }
+  printf("\n");
+  // a resumed run keeps the output of the interrupted one
+  if (settings.resume.empty()) {
+    OutputPathsToFile(paths.ToVectors(), gr, kmer, threshold, settings.output_prefix);
+    printf("\n");
+  }
+
+  PathSet best_paths = paths;
+  int local_p = -1;
+  PathSet removed, added;
+  RemoveLoneRepeatedNodes(PathSet(), PathIndex(), paths, false, local_p, removed, added);
+
+  unique_ptr<CheckpointWriter> writer;
+  if (!settings.checkpoint.empty()) {
+    writer.reset(new CheckpointWriter(settings.checkpoint));
+  }
+  unique_ptr<Telemetry> telemetry;
+  if (!settings.telemetry.empty()) {
+    telemetry.reset(new Telemetry);
+    if (!telemetry->Open(settings.telemetry, settings.telemetry_format,
+                         !settings.resume.empty())) {
+      telemetry.reset();
+    }
+  }
+
+  if (settings.chains > 1) {
+    OptimizeTempering(gr, prob_calc, paths, advice_paired, advice_pacbio, settings, kmer,
+                      writer.get(), telemetry.get(), start);
+    return;
+  }
+
+  RunState run;
+  run.start = start;
+  run.chains.resize(1);
+  Chain& chain = run.chains[0];
+  chain.prob_calc = &prob_calc;
+  chain.gen.seed(kRandomSeed);
+  chain.paths = paths;
+  chain.best_paths = best_paths;
+  chain.cur_prob = cur_prob;
+  chain.best_prob = cur_prob;
+  chain.total_len = total_len;
+  chain.zeros = zeros;
+  chain.long_nodes = LongNodes(gr, threshold);
+  chain.index.Init(gr, threshold, chain.paths);
+  chain.moves.Init(settings, advice_paired.size() + advice_pacbio.size() > 0);
+  chain.telemetry = telemetry.get();
+  run.calcs.push_back(&prob_calc);
+  bool speculate = settings.speculate > 1 && !settings.do_postprocess;
+  vector<ProbCalculator> calcs(speculate ? settings.speculate : 0, prob_calc);
+  for (auto &c: calcs) {
+    run.calcs.push_back(&c);
+  }
+  if (!settings.resume.empty() && LoadCheckpoint(settings.resume, gr, run, threshold)) {
+    printf("cur best %lf: ", chain.best_prob);
+    OutputPathsToFile(chain.best_paths.ToVectors(), gr, kmer, threshold, settings.output_prefix);
     printf("\n");
   }
-  printf("cur best %lf: ", best_prob);
-  OutputPathsToFile(best_paths, gr, kmer, threshold, settings.output_prefix);
+  if (telemetry) {
+    telemetry->SetStart(run.start);
+  }
+  run.next_checkpoint = NextCheckpoint(chain.itnum, settings.checkpoint_interval);
+  while (chain.itnum <= settings.max_iterations) {
+    if (speculate) {
+      SpeculativeStep(gr, chain, calcs, advice_paired, advice_pacbio, settings, kmer);
+    } else {
+      Step(gr, chain, advice_paired, advice_pacbio, settings, kmer);
+    }
+    CheckpointIfDue(gr, run, writer.get(), settings);
+    const char* reason = StopReason(run, settings);
+    if (reason != NULL) {
+      printf("stopping at itnum %d: %s\n", chain.itnum, reason);
+      break;
+    }
+  }
+  MergeReachOverrides(gr, chain);
+  printf("cur best %lf: ", chain.best_prob);
+  OutputPathsToFile(chain.best_paths.ToVectors(), gr, kmer, threshold, settings.output_prefix);
   printf("\n");
 }
 
@@ -823,6 +1752,13 @@ void PrepareReadSetFromConfig(
       } else {
         PacbioReadSet* rs = new PacbioReadSet(cache_prefix, filename, match_prob,
                                               mismatch_prob);
+        if (e.second.count("diagnostics_file")) {
+          rs->SetDiagnostics(e.second["diagnostics_file"],
+                             ExtractInt("diagnostics_interval", e.second, 100));
+        }
+        if (e.second.count("stream_reads")) {
+          rs->SetStreamReads(true);
+        }
         pacbio_reads.push_back(make_pair(cfg, rs));
       }
     } else if (e.second["type"] == "paired") {
@@ -957,15 +1893,22 @@ int main(int argc, char** argv) {
   PrepareReadSetFromConfig(read_set_configs, single_reads,
                            paired_reads, pacbio_reads);
 
+  // settings first, they set the thread count used when loading
+  AssemblySettings settings(configs);
   Graph gr;
   if (configs.count("graph")) {
-    if (!LoadGraph(configs["graph"], gr)) {
-      printf("Load graph failed\n");
-      return 1;
+    const string& snapshot = settings.graph_snapshot;
+    if (snapshot.empty() || !LoadGraphSnapshot(snapshot, configs["graph"], gr)) {
+      if (!LoadGraph(configs["graph"], gr)) {
+        printf("Load graph failed\n");
+        return 1;
+      }
+      if (!snapshot.empty()) {
+        SaveGraphSnapshot(snapshot, configs["graph"], gr);
+      }
     }
   }
   vector<vector<int>> starting_paths;
-  AssemblySettings settings(configs);
 
   if (configs.count("starting_assembly")) {
     if (configs.count("graph")) {
@@ -1019,7 +1962,10 @@ int main(int argc, char** argv) {
 
   //TODO: configure optimazation 
 
-  Optimize(gr, pc, starting_paths, advice_paired, advice_pacbio, longest_read, settings); 
+  Optimize(gr, pc, PathSet(starting_paths), advice_paired, advice_pacbio, longest_read, settings); 
+  for (auto &e: pacbio_reads) {
+    e.second->CloseDiagnostics();
+  }
 }
 
 
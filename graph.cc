@@ -1,5 +1,6 @@
 #include "graph.h"
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <cassert>
@@ -15,8 +16,10 @@
 #include <ctime>
 #include <chrono>
 #include <sys/timeb.h>
+#include <sys/stat.h>
 #include "unordered_map.hpp"
 #include "utility.h"
+#include "parallel.h"
 
 using namespace std;
 using namespace boost;
@@ -27,17 +30,22 @@ const double kSmooth = 1;
 const int kMinSubpathLength = 300;
 const char kThreads[] = "-p 4";
 const char kThreadsBlasr[] = "-nproc 16";
+// alignments blasr reports per read by default (its -bestn)
+const int kBlasrBestn = 10;
+// Most subpaths aligned by one batched blasr run. A run reports up to
+// kBlasrBestn alignments per subpath, so -bestn stays within -nCandidates 50.
+const int kMaxBlasrBatch = 5;
 const char kContigSeparator = '\n';
 const int kMinAnchorLen = 80;
 const int kBorderLen = 60;
 const int kIndexKmer = 15;
+const int kMaxStoredPlacements = 256;
 
 extern string gBowtiePath;
 extern string gBlasrPath;
 
 unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
 //default_random_engine generator(seed1);
-default_random_engine generator(47);
 
 int getMilliCount(){
   static int last = 0;
@@ -49,182 +57,572 @@ int getMilliCount(){
   return ret;
 }
 
+namespace {
+// Hand parsing of LastGraph text inside a mapping, pointers never go past end.
+const char* LineEnd(const char* p, const char* end) {
+  const char* e = (const char*)memchr(p, '\n', end - p);
+  return e == NULL ? end : e;
+}
+
+const char* NextLine(const char* p, const char* end) {
+  p = LineEnd(p, end);
+  return p == end ? end : p + 1;
+}
+
+bool StartsWith(const char* p, const char* end, const char* prefix, int len) {
+  return end - p >= len && memcmp(p, prefix, len) == 0;
+}
+
+const char* ParseInt(const char* p, const char* end, int& x) {
+  while (p != end && (*p == ' ' || *p == '\t')) p++;
+  bool neg = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+  long long v = 0;
+  while (p != end && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  x = neg ? -v : v;
+  return p;
+}
+
+// What one thread found in its part of the file.
+struct GraphChunk {
+  GraphChunk() : nodes(0), bad(false) {}
+  vector<pair<int, int> > arcs;
+  int nodes;
+  bool bad;
+};
+
+const long long kGraphChunkSize = 1 << 22;
+}
+
 bool LoadGraph(const string& filename, Graph& gr) {
   printf("load graph start\n");
-  ifstream f(filename.c_str());
-  if (!f.is_open()) {
+  auto start = chrono::steady_clock::now();
+  MappedFile f;
+  if (!f.Open(filename)) {
     return false;
   }
-
-  string l;
-  getline(f, l);
-
-  vector<string> fl;
-  split(fl, l, is_any_of("\t"));
-
-  int n = StringToInt(fl[0]);
-  gr.nodes.resize(2*n);
-
-  for (int i = 0; i < n; i++) {
-    // TODO: check this line
-    getline(f, l);
-    Node *n1 = new Node;
-    Node *n2 = new Node;
-    n1->id = 2*i;
-    n2->id = 2*i+1;
-/*    n1->inv = n2;
-    n2->inv = n1;*/
-    getline(f, n1->s);
-    getline(f, n2->s);
-    gr.nodes[2*i] = n1;
-    gr.nodes[2*i+1] = n2;
+  const char* end = f.data() + f.size();
+  int n = 0;
+  ParseInt(f.data(), end, n);
+  if (n < 0) {
+    return false;
   }
-  printf("nodes done\n");
-  int narcs = 0;
-  while (getline(f, l)) {
-    if (l.substr(0, 3) == "ARC") {
-      vector<string> al;
-      split(al, l, is_any_of("\t"));
-      int source = ConvertNodeId(StringToInt(al[1]));
-      int dest = ConvertNodeId(StringToInt(al[2]));
-      gr[source]->next.push_back(gr[dest]);
-      gr[source]->next_prob.push_back(kSmooth);
-      gr[InvertNode(dest)]->next.push_back(gr[InvertNode(source)]);
-      gr[InvertNode(dest)]->next_prob.push_back(kSmooth);
-      narcs++;
+  const char* body = NextLine(f.data(), end);
+
+  // nodes are in one block, sequences are the only per node allocation; the
+  // graph takes it once loading succeeded
+  unique_ptr<Node[]> pool(new Node[2*n]);
+  for (int i = 0; i < 2*n; i++) {
+    pool[i].id = i;
+  }
+
+  // A chunk handles records whose NODE or ARC line starts inside it, the
+  // sequence lines of a node may run into the next chunk, which skips them.
+  long long body_size = end - body;
+  int num_chunks = max(1LL, min((long long)NumThreads() * 4,
+                                (body_size + kGraphChunkSize - 1) / kGraphChunkSize));
+  vector<GraphChunk> chunks(num_chunks);
+  vector<char> found(n, 0);
+  ParallelFor(0, num_chunks, 1, [&](int t, int c) {
+    GraphChunk& ch = chunks[c];
+    const char* p = body + body_size * c / num_chunks;
+    const char* ce = body + body_size * (c + 1) / num_chunks;
+    if (p != body && p[-1] != '\n') {
+      p = NextLine(p, end);
+    }
+    while (p < ce) {
+      if (StartsWith(p, end, "NODE\t", 5)) {
+        int id;
+        ParseInt(p + 5, end, id);
+        if (id < 1 || id > n) {
+          ch.bad = true;
+          return;
+        }
+        const char* s1 = NextLine(p, end);
+        const char* s2 = NextLine(s1, end);
+        pool[2*(id-1)].s.assign(s1, LineEnd(s1, end));
+        pool[2*(id-1)+1].s.assign(s2, LineEnd(s2, end));
+        found[id-1] = 1;
+        ch.nodes++;
+        p = NextLine(s2, end);
+      } else {
+        if (StartsWith(p, end, "ARC\t", 4)) {
+          int a, b;
+          ParseInt(ParseInt(p + 4, end, a), end, b);
+          a = ConvertNodeId(a);
+          b = ConvertNodeId(b);
+          if (a < 0 || a >= 2*n || b < 0 || b >= 2*n) {
+            ch.bad = true;
+            return;
+          }
+          ch.arcs.push_back(make_pair(a, b));
+        }
+        p = NextLine(p, end);
+      }
+    }
+  });
+  int num_nodes = 0;
+  long long narcs = 0;
+  for (auto &ch: chunks) {
+    if (ch.bad) {
+      printf("bad record in %s\n", filename.c_str());
+      return false;
     }
+    num_nodes += ch.nodes;
+    narcs += ch.arcs.size();
   }
+  if (num_nodes != n || count(found.begin(), found.end(), 1) != n) {
+    printf("expected %d nodes in %s, found %d\n", n, filename.c_str(), num_nodes);
+    return false;
+  }
+  printf("nodes done\n");
 
-  f.close();
+  // edges in file order, same as adding them line by line
+  vector<int> degree(2*n, 0);
+  for (auto &ch: chunks) {
+    for (auto &arc: ch.arcs) {
+      degree[arc.first]++;
+      degree[InvertNode(arc.second)]++;
+    }
+  }
+  for (int i = 0; i < 2*n; i++) {
+    pool[i].next.reserve(degree[i]);
+    pool[i].next_prob.reserve(degree[i]);
+  }
+  for (auto &ch: chunks) {
+    for (auto &arc: ch.arcs) {
+      int source = arc.first, dest = arc.second;
+      pool[source].next.push_back(&pool[dest]);
+      pool[source].next_prob.push_back(kSmooth);
+      pool[InvertNode(dest)].next.push_back(&pool[InvertNode(source)]);
+      pool[InvertNode(dest)].next_prob.push_back(kSmooth);
+    }
+    vector<pair<int, int> >().swap(ch.arcs);
+  }
 
   printf("arcs done\n");
+  gr.TakeNodes(std::move(pool), 2*n);
+  gr.BuildCompact();
   gr.CalcProbSums();
   gr.CalcNormalizeMap();
-  printf("Loaded %d nodes %d arcs\n", n, narcs);
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("Loaded %d nodes %lld arcs\n", n, narcs);
   printf("nodes %d\n", gr.nodes.size());
+  printf("graph %.1f MB in %.2f s, %.1f MB/s\n", f.size() / 1e6, secs,
+         f.size() / 1e6 / max(secs, 1e-6));
   return true;
 }
 
-void Graph::CalcReachabilityLimit(int max_dist) {
-  printf("reach limit start\n");
-  reach_limit_.resize(nodes.size());
-  for (int i = 0; i < nodes.size(); i++) {
-    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> fr;
-    fr.push(make_pair(0, i));
-    vector<int> final_dist(nodes.size(), -1);
-    vector<int> tmp_dist(nodes.size(), 2*max_dist);
-    vector<int> prev(nodes.size(), -1);
-    tmp_dist[i] = 0;
-    prev[i] = -2;
-    while (!fr.empty()) {
-      int d = fr.top().first;
-      int x = fr.top().second;
-      fr.pop();
-      if (final_dist[x] != -1) {
-        continue;
-      }
-      final_dist[x] = d;
-      int nd = d;
-      if (x != i) {
-        vector<int> pp;
-        int cur = prev[x];
-        while (cur != i) {
-          pp.push_back(cur);
-          cur = prev[cur];
-        }
-        reverse(pp.begin(), pp.end());
-        reach_limit_[i][x] = pp;
+namespace {
+const char kSnapshotMagic[8] = {'G', 'A', 'M', 'L', 'G', 'R', 'P', 'H'};
+const int kSnapshotVersion = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  int version;
+  int num_nodes;
+  long long source_size;
+  long long source_mtime;
+  // of everything after the header
+  unsigned long long checksum;
+};
+
+bool SourceStat(const string& filename, long long& size, long long& mtime) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) return false;
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
 
-        nd += nodes[x]->s.length();
-      }
-      for (int j = 0; j < nodes[x]->next.size(); j++) {
-        int nx = nodes[x]->next[j]->id;
-        if (tmp_dist[nx] > nd && nd <= max_dist) {
-          tmp_dist[nx] = nd;
-          prev[nx] = x;
-          fr.push(make_pair(nd, nx));
-        }
+// FNV-1a style mixing over 8 byte words.
+unsigned long long SnapshotChecksum(const char* data, size_t size) {
+  unsigned long long h = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    unsigned long long w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 1099511628211ULL;
+  }
+  for (; i < size; i++) {
+    h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+}
+
+bool SaveGraphSnapshot(const string& filename, const string& source, const Graph& gr) {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.version = kSnapshotVersion;
+  header.num_nodes = gr.nodes.size();
+  if (!SourceStat(source, header.source_size, header.source_mtime)) return false;
+  FILE* f = fopen(filename.c_str(), "wb+");
+  if (f == NULL) return false;
+  // checksum is filled in once the rest is written
+  fwrite(&header, sizeof(header), 1, f);
+  gr.compact_.Write(f);
+  vector<int> norm(gr.normalize_map);
+  norm.resize(gr.nodes.size() + gr.nodes.size() % 2);
+  fwrite(norm.data(), sizeof(int), norm.size(), f);
+  bool ok = fflush(f) == 0 && !ferror(f);
+  if (ok) {
+    MappedFile written;
+    ok = written.Open(filename);
+    if (ok) {
+      header.checksum = SnapshotChecksum(written.data() + sizeof(header),
+                                         written.size() - sizeof(header));
+      fseek(f, 0, SEEK_SET);
+      fwrite(&header, sizeof(header), 1, f);
+      ok = !ferror(f);
+    }
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (ok) {
+    printf("saved graph snapshot to %s\n", filename.c_str());
+  }
+  return ok;
+}
+
+bool LoadGraphSnapshot(const string& filename, const string& source, Graph& gr) {
+  auto start = chrono::steady_clock::now();
+  std::shared_ptr<MappedFile> mapped(new MappedFile);
+  if (!mapped->Open(filename)) return false;
+  const MappedFile& f = *mapped;
+  SnapshotHeader header;
+  long long source_size, source_mtime;
+  if (f.size() < sizeof(header) || !SourceStat(source, source_size, source_mtime)) {
+    return false;
+  }
+  memcpy(&header, f.data(), sizeof(header));
+  if (memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+      header.version != kSnapshotVersion || header.source_size != source_size ||
+      header.source_mtime != source_mtime) {
+    printf("graph snapshot %s is not for %s\n", filename.c_str(), source.c_str());
+    return false;
+  }
+  const char* data = f.data() + sizeof(header);
+  size_t size = f.size() - sizeof(header);
+  if (SnapshotChecksum(data, size) != header.checksum) {
+    printf("graph snapshot %s is damaged\n", filename.c_str());
+    return false;
+  }
+  CompactGraph& cg = gr.compact_;
+  long long used = cg.Map(data, size, mapped);
+  int n = header.num_nodes;
+  if (used < 0 || cg.NumNodes() != n ||
+      used + (n + n % 2) * sizeof(int) > size) {
+    printf("graph snapshot %s is damaged\n", filename.c_str());
+    return false;
+  }
+  const int* norm = (const int*)(data + used);
+  gr.normalize_map.assign(norm, norm + n);
+
+  unique_ptr<Node[]> pool(new Node[n]);
+  ParallelFor(0, n, 1024, [&](int t, int i) {
+    Node& x = pool[i];
+    x.id = i;
+    x.s.assign(cg.NodeSeq(i), cg.NodeLen(i));
+    const int* next = cg.Next(i);
+    const double* weights = cg.NextWeights(i);
+    x.next.resize(cg.OutDegree(i));
+    x.next_prob.assign(weights, weights + cg.OutDegree(i));
+    for (int j = 0; j < cg.OutDegree(i); j++) {
+      x.next[j] = &pool[next[j]];
+    }
+    x.next_sum = cg.WeightSum(i);
+  });
+  gr.TakeNodes(std::move(pool), n);
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("loaded graph snapshot %s, %d nodes in %.2f s\n", filename.c_str(), n, secs);
+  return true;
+}
+
+void Graph::RecalculateProbsByPath(const vector<int>& path) {
+  if (!probs_by_path_) {
+    for (auto &x: nodes) {
+      x->InitProbs();
+    }
+    for (int i = 1; i < path.size(); i++) {
+      AddJump(path[i-1], path[i], 1);
+      AddJump(InvertNode(path[i]), InvertNode(path[i-1]), 1);
+    }
+    CalcProbSums();
+    probs_by_path_ = true;
+    probs_path_ = path;
+    return;
+  }
+  // take back jumps of the previous path and add those of the new one
+  vector<int> changed;
+  for (int i = 1; i < probs_path_.size(); i++) {
+    AddJump(probs_path_[i-1], probs_path_[i], -1);
+    AddJump(InvertNode(probs_path_[i]), InvertNode(probs_path_[i-1]), -1);
+    changed.push_back(probs_path_[i-1]);
+    changed.push_back(InvertNode(probs_path_[i]));
+  }
+  for (int i = 1; i < path.size(); i++) {
+    AddJump(path[i-1], path[i], 1);
+    AddJump(InvertNode(path[i]), InvertNode(path[i-1]), 1);
+    changed.push_back(path[i-1]);
+    changed.push_back(InvertNode(path[i]));
+  }
+  sort(changed.begin(), changed.end());
+  changed.erase(unique(changed.begin(), changed.end()), changed.end());
+  for (auto x: changed) {
+    nodes[x]->CalcProbSums();
+  }
+  compact_.UpdateWeights(nodes, changed);
+  probs_path_ = path;
+}
+
+void Graph::SearchLimit(int i, int max_dist, SearchScratch& sc,
+                        vector<ReachEntry>& out) const {
+  sc.Next(nodes.size());
+  sc.seen[i] = sc.epoch;
+  sc.dist[i] = 0;
+  sc.prev[i] = -2;
+  sc.fr.push(make_pair(0, i));
+  while (!sc.fr.empty()) {
+    int d = sc.fr.top().first;
+    int x = sc.fr.top().second;
+    sc.fr.pop();
+    if (sc.done[x] == sc.epoch) {
+      continue;
+    }
+    sc.done[x] = sc.epoch;
+    int nd = d;
+    if (x != i) {
+      out.push_back(ReachEntry(x, sc.prev[x], d, true));
+      nd += NodeLen(x);
+    }
+    const int* next = NextNodes(x);
+    for (int j = 0; j < OutDegree(x); j++) {
+      int nx = next[j];
+      int td = sc.seen[nx] == sc.epoch ? sc.dist[nx] : 2*max_dist;
+      if (td > nd && nd <= max_dist) {
+        sc.seen[nx] = sc.epoch;
+        sc.dist[nx] = nd;
+        sc.prev[nx] = x;
+        sc.fr.push(make_pair(nd, nx));
       }
     }
-//    printf("r %d %d\n", i, reach_limit_[i].size());
   }
-  printf("reach limit end\n");
+}
+
+void Graph::SearchBig(int i, int threshold, SearchScratch& sc,
+                      vector<ReachEntry>& out) const {
+  // BFS from a long node which stops at other long nodes. Short nodes
+  // passed on the way are kept as non-target entries to rebuild the paths.
+  if (NodeLen(i) <= threshold) return;
+  sc.Next(nodes.size());
+  vector<int>& fr = sc.order;
+  sc.seen[i] = sc.epoch;
+  int head = 0, tail = 0;
+  fr[tail++] = i;
+  while (head < tail) {
+    int x = fr[head++];
+    bool big = NodeLen(x) > threshold;
+    if (x != i) {
+      out.push_back(ReachEntry(x, sc.prev[x], 0, big));
+      if (big) continue;
+    }
+    const int* next = NextNodes(x);
+    for (int j = 0; j < OutDegree(x); j++) {
+      int ni = next[j];
+      if (sc.seen[ni] == sc.epoch) continue;
+      sc.seen[ni] = sc.epoch;
+      sc.prev[ni] = x;
+      fr[tail++] = ni;
+    }
+  }
+}
+
+void Graph::CalcReachabilityLimit(int max_dist) {
+  printf("reach limit start\n");
+  vector<vector<ReachEntry> > per_source(nodes.size());
+  vector<SearchScratch> scratch(NumThreads());
+  ParallelFor(0, nodes.size(), 64, [&](int t, int i) {
+    SearchLimit(i, max_dist, scratch[t], per_source[i]);
+  });
+  reach_limit_.Build(per_source);
+  printf("reach limit end %lld\n", reach_limit_.NumTargets());
 }
 
 void Graph::CalcReachabilityBig(int threshold) {
   printf("reach big start\n");
-//  reach_sets_.resize(nodes.size());
-  reach_big_.resize(nodes.size());
-  int big = 0;
+  vector<vector<ReachEntry> > per_source(nodes.size());
+  vector<SearchScratch> scratch(NumThreads());
+  ParallelFor(0, nodes.size(), 16, [&](int t, int i) {
+    SearchBig(i, threshold, scratch[t], per_source[i]);
+  });
+  reach_big_.Build(per_source);
+  printf("reach end %lld\n", reach_big_.NumTargets());
+}
+
+void Graph::SetLazyReachability(int threshold, int max_dist, int cache_size) {
+  printf("lazy reachability, cache %d\n", cache_size);
+  reach_big_.SetLazy(nodes.size(), [this, threshold](int s, vector<ReachEntry>& out,
+                                                      SearchScratch& sc) {
+    SearchBig(s, threshold, sc, out);
+  }, cache_size);
+  reach_limit_.SetLazy(nodes.size(), [this, max_dist](int s, vector<ReachEntry>& out,
+                                                      SearchScratch& sc) {
+    SearchLimit(s, max_dist, sc, out);
+  }, cache_size);
+}
+
+void Graph::PrefetchReachability(const vector<int>& sources) {
+  reach_big_.Prefetch(sources);
+  reach_limit_.Prefetch(sources);
+}
+
+namespace {
+const char kReachMagic[8] = {'G', 'A', 'M', 'L', 'R', 'E', 'A', 'C'};
+const int kReachVersion = 2;
+// Longest self loop (in nodes) found by CalcReachability.
+const int kMaxSelfLoop = 4;
+
+struct ReachFileHeader {
+  char magic[8];
+  int version;
+  int entry_size;
+  unsigned long long fingerprint;
+  int threshold;
+  int max_dist;
+  int num_nodes;
+  int padding;
+};
+
+void FnvAdd(unsigned long long& h, const void* data, size_t len) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+}
+}
+
+unsigned long long Graph::Fingerprint() const {
+  unsigned long long h = 14695981039346656037ULL;
+  int n = nodes.size();
+  FnvAdd(h, &n, sizeof(n));
   for (int i = 0; i < nodes.size(); i++) {
-    if (nodes[i]->s.length() <= threshold) continue;
-    big++;
-//    printf("r %d/%d %d\n", i, nodes.size(), big);
-    queue<int> fr;
-    // TODO: usama je chudak a alokuje velke veci casto
-//    vector<bool> visited(nodes.size());
-    set<int> visited;
-//    vector<int> prev(nodes.size(), -1);
-    map<int, int> prev;
-//    visited[i] = true;
-    visited.insert(i);
-    fr.push(i);
-    while (!fr.empty()) {
-      int x = fr.front();
-      fr.pop();
-//      reach_sets_[x].insert(i);
-      if (nodes[x]->s.length() > threshold && nodes[i]->s.length() > threshold && x != i) {
-        vector<int> pp;
-        int cur = prev[x];
-        while (cur != i) {
-          pp.push_back(cur);
-          cur = prev[cur];
-        }
-        reverse(pp.begin(), pp.end());
-        reach_big_[i][x] = pp;
-      }
-      if (nodes[x]->s.length() > threshold && x != i) continue;
-      for (int j = 0; j < nodes[x]->next.size(); j++) {
-        int ni = nodes[x]->next[j]->id;
-        if (visited.count(ni)) continue;
-        visited.insert(ni);
-        prev[ni] = x;
-        fr.push(ni);
-      }
+    int len = nodes[i]->s.length();
+    FnvAdd(h, &len, sizeof(len));
+    FnvAdd(h, nodes[i]->s.data(), len);
+    for (auto &e: nodes[i]->next) {
+      FnvAdd(h, &e->id, sizeof(e->id));
     }
-    printf("d %d\n", reach_big_[i].size());
+    FnvAdd(h, "|", 1);
+  }
+  return h;
+}
+
+bool Graph::SaveReachability(const string& filename, int threshold, int max_dist) const {
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (f == NULL) return false;
+  ReachFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kReachMagic, sizeof(kReachMagic));
+  header.version = kReachVersion;
+  header.entry_size = sizeof(ReachEntry);
+  header.fingerprint = Fingerprint();
+  header.threshold = threshold;
+  header.max_dist = max_dist;
+  header.num_nodes = nodes.size();
+  fwrite(&header, sizeof(header), 1, f);
+  reach_big_.Write(f);
+  reach_limit_.Write(f);
+  reach_self_.Write(f);
+  bool ok = !ferror(f);
+  ok = (fclose(f) == 0) && ok;
+  printf("saved reachability to %s\n", filename.c_str());
+  return ok;
+}
+
+bool Graph::LoadReachability(const string& filename, int threshold, int max_dist) {
+  std::shared_ptr<MappedFile> mapped(new MappedFile);
+  if (!mapped->Open(filename)) return false;
+  const char* data = mapped->data();
+  size_t size = mapped->size();
+  ReachFileHeader header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, kReachMagic, sizeof(kReachMagic)) != 0 ||
+      header.version != kReachVersion || header.entry_size != sizeof(ReachEntry) ||
+      header.threshold != threshold || header.max_dist != max_dist ||
+      header.num_nodes != nodes.size() || header.fingerprint != Fingerprint()) {
+    printf("reachability cache %s does not match the graph or parameters\n", filename.c_str());
+    return false;
+  }
+  size_t pos = sizeof(header);
+  long long used = reach_big_.Map(data + pos, size - pos, mapped);
+  if (used >= 0) {
+    pos += used;
+    used = reach_limit_.Map(data + pos, size - pos, mapped);
   }
-  printf("reach end\n");
+  if (used >= 0) {
+    pos += used;
+    used = reach_self_.Map(data + pos, size - pos, mapped);
+  }
+  if (used < 0 || reach_self_.NumNodes() != nodes.size()) {
+    vector<vector<ReachEntry> > empty;
+    reach_big_.Build(empty);
+    reach_limit_.Build(empty);
+    return false;
+  }
+  printf("loaded reachability from %s\n", filename.c_str());
+  return true;
 }
 
 void Graph::CalcReachability() {
   printf("reach self start\n");
-  int num_self_find = 0;
-  reach_self_.resize(nodes.size());
-  for (int i = 0; i < nodes.size(); i++) {
-    vector<vector<int> > cands({vector<int>({i})});
-    for (int s = 0; s < 4; s++) {
-      vector<vector<int> > cands2;
-      for (auto &c: cands) {
-        for (int j = 0; j < nodes[c.back()]->next.size(); j++) {
-          if (nodes[c.back()]->next[j]->id == i) {
-/*            printf("add %d ", i);
-            for (auto &cc: c)
-              printf("%d ", cc);
-            printf("\n");*/
-            reach_self_[i].push_back(c);
-            num_self_find++;
-          } else {
-            vector<int> p(c);
-            p.push_back(nodes[c.back()]->next[j]->id);
-            cands2.push_back(p);
-          }
-        }
+  // Loops of node i per thread as (length, nodes...) records, one bucket per
+  // length so shorter loops come first.
+  struct LoopScratch {
+    vector<int> path;
+    vector<int> next_edge;
+    vector<int> by_len[kMaxSelfLoop];
+  };
+  vector<LoopScratch> scratch(NumThreads());
+  vector<vector<int> > loops(nodes.size());
+  ParallelFor(0, nodes.size(), 64, [&](int t, int i) {
+    LoopScratch& sc = scratch[t];
+    for (auto &b: sc.by_len) b.clear();
+    // depth first over walks from i, path and next_edge form the stack
+    sc.path.assign(1, i);
+    sc.next_edge.assign(1, 0);
+    while (!sc.path.empty()) {
+      int cur = sc.path.back();
+      int& j = sc.next_edge.back();
+      if (j == OutDegree(cur)) {
+        sc.path.pop_back();
+        sc.next_edge.pop_back();
+        continue;
+      }
+      int n = NextNodes(cur)[j++];
+      if (n == i) {
+        vector<int>& b = sc.by_len[sc.path.size() - 1];
+        b.push_back(sc.path.size());
+        b.insert(b.end(), sc.path.begin(), sc.path.end());
+      } else if (sc.path.size() < kMaxSelfLoop) {
+        sc.path.push_back(n);
+        sc.next_edge.push_back(0);
       }
-      cands = cands2;
     }
-  }
-  printf("reach self done %d\n", num_self_find);
+    for (auto &b: sc.by_len) {
+      loops[i].insert(loops[i].end(), b.begin(), b.end());
+    }
+  });
+  reach_self_.Build(loops);
+  printf("reach self done %lld\n", reach_self_.NumLoopsTotal());
 }
 
 void Graph::OutputPath(const vector<int>& path, int kmer) {
@@ -313,14 +711,16 @@ void Graph::OutputPathA(const vector<int>& path, int kmer, string filename, int
   fclose(f);
 }
 
-void ReadSet::ClearPositions() {
-  positions_.resize(reads_num_);
-  for (int i = 0; i < positions_.size(); i++) {
-    positions_[i].clear();
+void ReadSet::ClearPositions(PositionsScratch& sc) const {
+  for (auto r: sc.touched_reads) {
+    sc.positions[r].clear();
   }
+  sc.touched_reads.clear();
+  sc.positions.resize(reads_num_);
 }
 
 void ReadSet::BuildAdviceIndex(const Graph& gr, int threshold) {
+  lock_guard<mutex> g(advice_lock_);
   if (advice_index_build_) return;
   advice_index_build_ = true;
 
@@ -342,7 +742,7 @@ void ReadSet::BuildAdviceIndex(const Graph& gr, int threshold) {
 }
 
 vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositionsSlow(
-    const Graph& gr, const vector<int>& path, int& total_len) {
+    const Graph& gr, const vector<int>& path, int& total_len, PositionsScratch& sc) {
   char tmpname1[L_tmpnam+6], tmpname2[L_tmpnam], tmpname3[L_tmpnam],
        tmpname4[L_tmpnam+8];
   tmpnam(tmpname1);
@@ -365,9 +765,8 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositionsSlow(
   }
   fprintf(f, "\n");
   fclose(f);
-  for (int i = 0; i < positions_.size(); i++) {
-    positions_[i].clear();
-  }
+  ClearPositions(sc);
+  vector<vector<pair<int, pair<int, int> > > >& positions = sc.positions;
   
   string reads_filename = filename_;
 
@@ -426,10 +825,13 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositionsSlow(
     }
     if (edit_dist != -1) {
       int pos = StringToInt(parts[3]);
-      if (read_id >= positions_.size()) {
-        positions_.resize(read_id+1);
+      if (read_id >= positions.size()) {
+        positions.resize(read_id+1);
+      }
+      if (positions[read_id].empty()) {
+        sc.touched_reads.push_back(read_id);
       }
-      positions_[read_id].push_back(make_pair(pos, make_pair(edit_dist, orientation)));
+      positions[read_id].push_back(make_pair(pos, make_pair(edit_dist, orientation)));
     }
   }
 
@@ -437,59 +839,82 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositionsSlow(
   remove(tmpname2);
   remove(tmpname3);
 
-  return positions_;
-}
-
-vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositions() {
-  return positions_;
+  return positions;
 }
 
-void ReadSet::PrecomputeAlignmentForPaths(const vector<vector<int>>& paths, const Graph& gr) {
-  unordered_set<vector<int>> subpaths_precomp;
+void ReadSet::GetMassPrecompSubpaths(const vector<int>& path, const Graph& gr,
+                                     unordered_set<vector<int>>& subpaths_precomp) {
   int last_end = -1;
-  for (auto &path: paths) {
-    for (int i = 0; i < path.size(); i++) {
-      if (path[i] < 0) continue;
-      int cur_len = 0;
-      cur_len = gr.nodes[path[i]]->s.length();
-      int cur_seq_len = 0;
-      vector<int> cur_seq, cur_seq2({-1});
-      cur_seq.push_back(path[i]);
-      cur_seq2.push_back(path[i]);
-      int cur_end = i;
-      for (int j = i+1; j < path.size(); j++) {
-        if (path[j] < 0) break;
-        cur_seq_len += gr.nodes[path[j]]->s.length();
-        cur_seq.push_back(path[j]);
-        cur_seq2.push_back(path[j]);
-        cur_end = j;
-        if (cur_seq_len > kMinSubpathLength) {
-          break;
-        }
+  for (int i = 0; i < path.size(); i++) {
+    if (path[i] < 0) continue;
+    int cur_len = 0;
+    cur_len = gr.nodes[path[i]]->s.length();
+    int cur_seq_len = 0;
+    vector<int> cur_seq, cur_seq2({-1});
+    cur_seq.push_back(path[i]);
+    cur_seq2.push_back(path[i]);
+    int cur_end = i;
+    for (int j = i+1; j < path.size(); j++) {
+      if (path[j] < 0) break;
+      cur_seq_len += gr.nodes[path[j]]->s.length();
+      cur_seq.push_back(path[j]);
+      cur_seq2.push_back(path[j]);
+      cur_end = j;
+      if (cur_seq_len > kMinSubpathLength) {
+        break;
       }
+    }
 
-      if (aligment_cache_.count(cur_seq) == 0 && 
-          (last_end != cur_end || (cur_seq.size() == 1 && gr.nodes[cur_seq[0]]->s.length() > 150))) {
+    if (aligment_cache_.count(cur_seq) == 0 && 
+        (last_end != cur_end || (cur_seq.size() == 1 && gr.nodes[cur_seq[0]]->s.length() > 150))) {
 //        printf("add %d %d %d %d\n", i, cur_seq.size(), cur_seq[0], cur_seq.back());
-        subpaths_precomp.insert(cur_seq);
-        subpaths_precomp.insert(InvertPath(cur_seq));
+      subpaths_precomp.insert(cur_seq);
+      subpaths_precomp.insert(InvertPath(cur_seq));
+    }
+    if (gr.nodes[path[i]]->s.length() > kMinSubpathLength) {
+      if (aligment_cache_.count(vector<int>({path[i]})) == 0) {
+        subpaths_precomp.insert(vector<int>({path[i]}));
+        subpaths_precomp.insert(vector<int>({path[i]^1}));
       }
-      if (gr.nodes[path[i]]->s.length() > kMinSubpathLength) {
-        if (aligment_cache_.count(vector<int>({path[i]})) == 0) {
-          subpaths_precomp.insert(vector<int>({path[i]}));
-          subpaths_precomp.insert(vector<int>({path[i]^1}));
+    }
+    last_end = cur_end;
+//    if (aligment_cache_.count(cur_seq2) == 0) {
+//      subpaths_precomp.insert(cur_seq2);
+//    }
+  }
+}
+
+void ReadSet::PrecomputeAlignmentForScoring(const vector<vector<int>>& paths, const Graph& gr) {
+  PrecomputeAlignmentForPaths(paths, gr);
+  // contigs of scaffolds one by one, as CalcScoreForPathInc asks for them
+  unordered_set<vector<int>> subpaths_precomp;
+  {
+    SharedLock l(cache_lock_);
+    for (auto &path: paths) {
+      int last = 0;
+      for (int i = 0; i <= path.size(); i++) {
+        if (i == path.size() || path[i] < 0) {
+          GetSubpathsFromPath(vector<int>(path.begin()+last, path.begin()+i), gr,
+                              subpaths_precomp);
+          last = i+1;
         }
       }
-      last_end = cur_end;
-  //    if (aligment_cache_.count(cur_seq2) == 0) {
-  //      subpaths_precomp.insert(cur_seq2);
-  //    }
     }
   }
-  if (!subpaths_precomp.empty()) {
-    printf("mass precomp start\n");
-    PrecomputeAligmentForSubpaths(gr, USetToVector(subpaths_precomp));
+  AlignMissing(gr, subpaths_precomp);
+}
+
+void ReadSet::AlignMissing(const Graph& gr, const unordered_set<vector<int> >& subpaths) {
+  if (subpaths.empty()) return;
+  lock_guard<SharedMutex> g(cache_lock_);
+  // another thread may have aligned some of them in the meantime
+  vector<vector<int> > missing;
+  for (auto &s: subpaths) {
+    if (aligment_cache_.count(s) == 0) {
+      missing.push_back(s);
+    }
   }
+  PrecomputeAligmentForSubpaths(gr, missing);
 }
 
 void ReadSet::GetSubpathsFromPath(
@@ -536,11 +961,13 @@ void ReadSet::GetPositionsOnlyPath(
     const Graph& gr, const vector<int>& path, int st,
     unordered_map<int, vector<Aligment>>& current_aligments) {
   unordered_set<vector<int> > subpaths_precomp;
-  GetSubpathsFromPath(path, gr, subpaths_precomp);
-  if (!subpaths_precomp.empty()) {
-    PrecomputeAligmentForSubpaths(gr, USetToVector(subpaths_precomp));
+  {
+    SharedLock l(cache_lock_);
+    GetSubpathsFromPath(path, gr, subpaths_precomp);
   }
+  AlignMissing(gr, subpaths_precomp);
  
+  SharedLock l(cache_lock_);
   int cur_pos = st;
   int max_pos = 0;
 //  total_len = 0;
@@ -599,15 +1026,18 @@ void ReadSet::GetPositionsOnlyPath(
 
 vector<vector<pair<int, pair<int, int> > > >& ReadSet::AddPositions(
     const Graph& gr, const vector<int>& path,
-    int& total_len, int st) {
+    int& total_len, int st, PositionsScratch& sc) {
 //  printf("calc score\n");
   // Precomputation at once
   unordered_set<vector<int> > subpaths_precomp;
-  GetSubpathsFromPath(path, gr, subpaths_precomp);
-  if (!subpaths_precomp.empty()) {
-    PrecomputeAligmentForSubpaths(gr, USetToVector(subpaths_precomp));
+  {
+    SharedLock l(cache_lock_);
+    GetSubpathsFromPath(path, gr, subpaths_precomp);
   }
+  AlignMissing(gr, subpaths_precomp);
  
+  SharedLock l(cache_lock_);
+  vector<vector<pair<int, pair<int, int> > > >& positions = sc.positions;
   int cur_pos = st;
 //  total_len = 0;
   for (int i = 0; i < path.size(); i++) {
@@ -632,25 +1062,28 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::AddPositions(
     for (auto& al: align) {
       bool found = false;
       // TODO: optimize this (maybe)
-      for (int j = 0; j < positions_[al.read_id].size(); j++) {
-        if (positions_[al.read_id][j].first == al.position + cur_pos) {
-          positions_[al.read_id][j].second = make_pair(al.edit_dist, al.orientation);
+      for (int j = 0; j < positions[al.read_id].size(); j++) {
+        if (positions[al.read_id][j].first == al.position + cur_pos) {
+          positions[al.read_id][j].second = make_pair(al.edit_dist, al.orientation);
           found = true;
           break;
         }
       }
       if (found) continue;
-      positions_[al.read_id].push_back(
+      if (positions[al.read_id].empty()) {
+        sc.touched_reads.push_back(al.read_id);
+      }
+      positions[al.read_id].push_back(
           make_pair(al.position + cur_pos, make_pair(al.edit_dist, al.orientation)));
     }
     cur_pos += gr.nodes[path[i]]->s.length();
   }
-  return positions_;
+  return positions;
 }
 
 vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositions(
     const Graph& gr, const vector<int>& path,
-    int& total_len) {
+    int& total_len, PositionsScratch& sc) {
 //  printf("gp start ");
 /*  for (auto &e: path) {
     if (e >= 0)
@@ -659,18 +1092,19 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositions(
       printf("%d ", e);
   }
   printf("\n");*/
-  positions_.resize(reads_num_);
-  for (int i = 0; i < reads_num_; i++)
-    positions_[i].clear();
+  ClearPositions(sc);
+  vector<vector<pair<int, pair<int, int> > > >& positions = sc.positions;
 //  printf("calc score\n");
   // Precomputation at once
   unordered_set<vector<int> > subpaths_precomp;
-  GetSubpathsFromPath(path, gr, subpaths_precomp);
-//  printf("xxx\n");
-  if (!subpaths_precomp.empty()) {
-    PrecomputeAligmentForSubpaths(gr, USetToVector(subpaths_precomp));
+  {
+    SharedLock l(cache_lock_);
+    GetSubpathsFromPath(path, gr, subpaths_precomp);
   }
+//  printf("xxx\n");
+  AlignMissing(gr, subpaths_precomp);
 //  printf("aaa\n"); 
+  SharedLock l(cache_lock_);
   int cur_pos = 0;
   total_len = 0;
   for (int i = 0; i < path.size(); i++) {
@@ -708,15 +1142,18 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositions(
       for (auto& al: align) {
         bool found = false;
         // TODO: optimize this (maybe)
-        for (int j = 0; j < positions_[al.read_id].size(); j++) {
-          if (positions_[al.read_id][j].first == al.position + cur_pos) {
-            positions_[al.read_id][j].second = make_pair(al.edit_dist, al.orientation);
+        for (int j = 0; j < positions[al.read_id].size(); j++) {
+          if (positions[al.read_id][j].first == al.position + cur_pos) {
+            positions[al.read_id][j].second = make_pair(al.edit_dist, al.orientation);
             found = true;
             break;
           }
         }
         if (found) continue;
-        positions_[al.read_id].push_back(
+        if (positions[al.read_id].empty()) {
+          sc.touched_reads.push_back(al.read_id);
+        }
+        positions[al.read_id].push_back(
             make_pair(al.position + cur_pos, make_pair(al.edit_dist, al.orientation)));
       }
     }
@@ -724,7 +1161,7 @@ vector<vector<pair<int, pair<int, int> > > >& ReadSet::GetPositions(
     cur_pos += gr.nodes[path[i]]->s.length();
   }
 //  printf("gp end\n");
-  return positions_;
+  return positions;
 }
 
 inline void PushIfNotVisited(
@@ -750,11 +1187,12 @@ inline void PushFrontIfNotVisited(
 }
 
 // Errors, genome begin, genome end
+// (search state is per thread, read sets align on several threads at once)
 pair<int, pair<int, int>> ProcessHit(int genome_pos, int read_pos, const string& read, const string& genome) {
-  static deque<pair<int, pair<int, int>>> fr;
-  static int iteration = 0;
+  thread_local deque<pair<int, pair<int, int>>> fr;
+  thread_local int iteration = 0;
   iteration++;
-  static vector<vector<int>> visited(read.size() + 47, vector<int>(read.size() + 47));
+  thread_local vector<vector<int>> visited(read.size() + 47, vector<int>(read.size() + 47));
   assert(read.substr(read_pos, kIndexKmer) == genome.substr(genome_pos, kIndexKmer));
   int error_limit = 3;
   // Forward
@@ -914,6 +1352,7 @@ void ReadSet::PrecomputeAligmentForSubpaths(
   for (auto &subpath: subpaths) {
     aligment_cache_[subpath] = vector<Aligment>();
   }
+  save_changes_++;
   printf("ss size %d\n", subpaths.size());
 
   if (!external_aligner_) {
@@ -1033,20 +1472,33 @@ void ReadSet::PrecomputeAligmentForSubpaths(
 }
 
 void ReadSet::SaveAligments(bool force) {
-  return;
-  save_changes_++;
-  printf("save ch %d\n", save_changes_);
-  if (save_changes_ == 50 || force) {
-    ofstream ofs(name_);
+  // writing the whole cache after precomputations was too slow, it is only
+  // written when forced (with checkpoints) and changed since the last time
+  if (!force) return;
+  PinAligments();
+  SavePinnedAligments();
+}
+
+void ReadSet::SavePinnedAligments() {
+  // fills wait, scoring goes on
+  if (save_changes_ == 0) {
+    cache_lock_.unlock_shared();
+    return;
+  }
+  string tmpname = name_ + ".tmp";
+  {
+    ofstream ofs(tmpname);
     boost::archive::binary_oarchive oa(ofs);
     oa << aligment_cache_;
     oa << read_lens_;
     oa << reads_num_;
     oa << read_map_;
     oa << read_map_inv_;
-    printf("saved %d cached members\n", (int)aligment_cache_.size());
-    save_changes_ = 0;
   }
+  rename(tmpname.c_str(), name_.c_str());
+  printf("saved %d cached members\n", (int)aligment_cache_.size());
+  save_changes_ = 0;
+  cache_lock_.unlock_shared();
 }
 
 void ReadSet::LoadAligments() {
@@ -1099,6 +1551,54 @@ void PacbioReadSet::LoadAligments() {
   }
 }
 
+void PacbioReadSet::SetDiagnostics(const string& filename, int interval) {
+  diag_filename_ = filename;
+  diag_interval_ = max(interval, 1);
+  diag_calls_ = 0;
+}
+
+void PacbioReadSet::WriteDiagnostics(const vector<logdouble>& read_probs) {
+  lock_guard<mutex> g(diag_lock_);
+  if (diag_interval_ == 0) return;
+  if (diag_calls_++ % diag_interval_ != 0) return;
+
+  if (diag_file_ == NULL) {
+    diag_file_ = fopen(diag_filename_.c_str(), "wb");
+    if (diag_file_ == NULL) {
+      printf("cannot open diagnostics file %s\n", diag_filename_.c_str());
+      diag_interval_ = 0;
+      return;
+    }
+    setvbuf(diag_file_, NULL, _IOFBF, 1 << 20);
+    // Read names go to a text sidecar once, records only carry read ids.
+    FILE *fn = fopen((diag_filename_ + ".names").c_str(), "w");
+    if (fn != NULL) {
+      for (int i = 0; i < reads_num_; i++) {
+        fprintf(fn, "%d %s\n", i, GetReadName(i).c_str());
+      }
+      fclose(fn);
+    }
+  }
+
+  // Record: evaluation number, number of reads, logprob per read.
+  int header[2] = {diag_calls_ - 1, (int)read_probs.size()};
+  fwrite(header, sizeof(int), 2, diag_file_);
+  diag_buffer_.resize(read_probs.size());
+  for (int i = 0; i < read_probs.size(); i++) {
+    diag_buffer_[i] = read_probs[i].logval;
+  }
+  fwrite(diag_buffer_.data(), sizeof(double), diag_buffer_.size(), diag_file_);
+}
+
+void PacbioReadSet::CloseDiagnostics() {
+  lock_guard<mutex> g(diag_lock_);
+  if (diag_file_ != NULL) {
+    fclose(diag_file_);
+    diag_file_ = NULL;
+  }
+  diag_interval_ = 0;
+}
+
 void PacbioReadSet::NormalizeCache(const Graph& gr) {
   printf("normalize start\n");
   unordered_set<vector<int> > keys;
@@ -1415,11 +1915,26 @@ void ReadSet::PreprocessReads() {
 }
 
 void PacbioReadSet::PreprocessReads() {
-  if (load_success_)
+  string store_name = name_ + ".reads";
+  if (stream_reads_) {
+    if (load_success_ && read_store_.Open(store_name, filename_, reads_num_)) {
+      printf("streaming reads from %s\n", store_name.c_str());
+      vector<string>().swap(read_seq_);
       return;
+    }
+  } else if (load_success_ && read_seq_.size() == reads_num_) {
+    return;
+  }
+  // Sequences are missing from the cache when it was saved with streaming.
   printf("preprocessing reads pacbio %s\n", filename_.c_str());
   ifstream ifs(filename_);
   assert(ifs);
+  PackedReadWriter writer;
+  if (stream_reads_) {
+    bool ok = writer.Open(store_name, filename_);
+    assert(ok);
+  }
+  read_seq_.resize(reads_num_);
   string l;
   while (getline(ifs, l)) {
     string nameline = l.substr(1);
@@ -1430,11 +1945,22 @@ void PacbioReadSet::PreprocessReads() {
     string seq;
     getline(ifs, seq);
     int read_len = seq.length();
-    read_seq_[read_id] = seq;
+    if (stream_reads_) {
+      writer.Add(read_id, seq);
+    } else {
+      read_seq_[read_id] = seq;
+    }
     read_lens_[read_id] = read_len;
     getline(ifs, l);
     getline(ifs, l);
   }
+  if (stream_reads_) {
+    bool ok = writer.Close(reads_num_) &&
+              read_store_.Open(store_name, filename_, reads_num_);
+    assert(ok);
+    printf("streaming reads from %s\n", store_name.c_str());
+    vector<string>().swap(read_seq_);
+  }
   CalcMaxReadLen();
   printf("preprocess done %d %d\n", (int)read_lens_.size(), max_read_len_);
   load_success_ = true;
@@ -1462,8 +1988,9 @@ void PacbioReadSet::CalcMaxReadLen() {
 
 bool ReadSet::GetAligmentForSubpath(
     const Graph& gr, const vector<int>& subpath, vector<Aligment>& align) {
-  if (aligment_cache_.count(subpath)) {
-    align = aligment_cache_[subpath];
+  auto it = aligment_cache_.find(subpath);
+  if (it != aligment_cache_.end()) {
+    align = it->second;
     return true;
   }
   align.clear();
@@ -1472,10 +1999,12 @@ bool ReadSet::GetAligmentForSubpath(
 
 const vector<Aligment>& ReadSet::GetAligmentForSubpath(
     const Graph& gr, const vector<int>& subpath) {
-  if (aligment_cache_.count(subpath)) {
-    return aligment_cache_[subpath];
+  auto it = aligment_cache_.find(subpath);
+  if (it != aligment_cache_.end()) {
+    return it->second;
   }
-  return vector<Aligment>();
+  static const vector<Aligment> empty;
+  return empty;
 //  assert(false);
 }
 
@@ -1578,9 +2107,10 @@ double GetTotalProb(const vector<double>& read_probs, int total_len, int& zero_r
 double CalcScoreForPath(const Graph& gr, const vector<int>& path, int kmer,
                         ReadSet& read_set, bool use_caching) {
   int total_len;
+  PositionsScratch sc;
   vector<vector<pair<int, pair<int, int> > > >& positions = 
-      use_caching ? read_set.GetPositions(gr, path, total_len) :
-      read_set.GetPositionsSlow(gr, path, total_len);
+      use_caching ? read_set.GetPositions(gr, path, total_len, sc) :
+      read_set.GetPositionsSlow(gr, path, total_len, sc);
   vector<double> read_probs;
   PositionsToReadProbs(read_set.GetNumberOfReads(), positions, read_set, read_probs);
 
@@ -1603,12 +2133,13 @@ double CalcScoreForPath(const Graph& gr, const vector<int>& path, int kmer,
                         bool use_caching) {
   assert(read_set1.GetNumberOfReads() == read_set2.GetNumberOfReads());
   int total_len1, total_len2;
+  PositionsScratch sc1, sc2;
   vector<vector<pair<int, pair<int, int> > > >& positions1 = 
-      use_caching ? read_set1.GetPositions(gr, path, total_len1) :
-      read_set1.GetPositionsSlow(gr, path, total_len1);
+      use_caching ? read_set1.GetPositions(gr, path, total_len1, sc1) :
+      read_set1.GetPositionsSlow(gr, path, total_len1, sc1);
   vector<vector<pair<int, pair<int, int> > > >& positions2 = 
-      use_caching ? read_set2.GetPositions(gr, path, total_len2) :
-      read_set2.GetPositionsSlow(gr, path, total_len2);
+      use_caching ? read_set2.GetPositions(gr, path, total_len2, sc2) :
+      read_set2.GetPositionsSlow(gr, path, total_len2, sc2);
 
   assert(total_len1 == total_len2);
 
@@ -1656,7 +2187,8 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
 //  printf("calc score\n");
   int total_len1 = 0;
   vector<double> read_probs(read_set1.GetNumberOfReads());
-  read_set1.ClearPositions();
+  PositionsScratch sc1;
+  read_set1.ClearPositions(sc1);
   int st = 0;
   // (position, type)
   // type: 3 - begin, 4 - end, 1 - start path, 2 - end path
@@ -1680,12 +2212,11 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
         total_len1 += gaps[i-1];
         events.push_back(make_pair(st + total_len1, 1));
       }
-      read_set1.AddPositions(gr, ctgs[i], total_len1, st + total_len1);
+      read_set1.AddPositions(gr, ctgs[i], total_len1, st + total_len1, sc1);
     }
     st += 1000000;
   }
-  vector<vector<pair<int, pair<int, int> > > >& positions1 = 
-      read_set1.GetPositions();
+  vector<vector<pair<int, pair<int, int> > > >& positions1 = sc1.positions;
 
   for (int i = 0; i < read_set1.GetNumberOfReads(); i++) {
     for (auto &x: positions1[i]) {
@@ -1742,28 +2273,91 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
   return total_prob - bad_bases*no_cov_penalty;
 }
 
-void GetChanges(const vector<vector<int>>& new_paths, const vector<vector<int>>& old_paths,
-                vector<vector<int>>& erased, vector<vector<int>>& added) {
-  unordered_multiset<vector<int>> old_paths_index(old_paths.begin(), old_paths.end());
-  vector<vector<int>> not_found;
-  for (auto &e: new_paths) {
-    auto f = old_paths_index.find(e);
-    auto fr = old_paths_index.find(InvertPath(e)); 
-    if (f == old_paths_index.end()/* && fr == old_paths_index.end()*/) {
-      added.push_back(e);
-    } else {
-      if (f != old_paths_index.end()) {
-        old_paths_index.erase(f);
-      }/* else {
-        old_paths_index.erase(fr);
-      }*/
+template<class T>
+void AddPathScore(const PathScore<T>& score, vector<T>& read_probs) {
+  for (auto &e: score.probs) {
+    read_probs[e.first] += e.second;
+  }
+}
+
+// Drops scores of paths which are not in paths once the cache holds many
+// more than that.
+template<class T>
+void PrunePathScores(const PathSet& paths, PathScoreCache<T>& cache) {
+  if (cache.scores.size() <= 2 * paths.size() + 16) return;
+  unordered_map<vector<int>, std::shared_ptr<const PathScore<T>>> keep;
+  for (auto &p: paths) {
+    auto it = cache.scores.find(p);
+    if (it != cache.scores.end()) {
+      keep[p] = std::move(it->second);
+    }
+  }
+  cache.scores.swap(keep);
+}
+
+// Score of one path for single reads. Positions are relative to the path
+// start, which gives the same sums as in CalcScoreForPaths. Only reads placed
+// on the path are visited, in increasing order.
+void ScoreSinglePath(const Graph& gr, const vector<int>& path, ReadSet& read_set1,
+                     PositionsScratch& sc, PathScore<double>& score) {
+  read_set1.ClearPositions(sc);
+  vector<vector<int>> ctgs;
+  vector<int> gaps;
+  int last = 0;
+  for (int i = 0; i < path.size(); i++) {
+    if (path[i] < 0) {
+      gaps.push_back(-path[i]);
+      ctgs.push_back(vector<int>(path.begin()+last, path.begin()+i));
+      last = i+1;
+    }
+  }
+  ctgs.push_back(vector<int>(path.begin()+last, path.end()));
+  int total_len1 = 0;
+  for (int i = 0; i < ctgs.size(); i++) {
+    if (i > 0) {
+      total_len1 += gaps[i-1];
+    }
+    read_set1.AddPositions(gr, ctgs[i], total_len1, total_len1, sc);
+  }
+  vector<vector<pair<int, pair<int, int> > > >& positions1 = sc.positions;
+  sort(sc.touched_reads.begin(), sc.touched_reads.end());
+  for (auto i: sc.touched_reads) {
+    for (auto &x: positions1[i]) {
+      double p1 = read_set1.mismatch_probs_[x.second.first] *
+                  read_set1.match_probs_[read_set1.GetReadLen(i) - x.second.first];
+      score.probs.push_back(make_pair(i, p1));
     }
   }
+  score.total_len = total_len1;
+}
 
-  erased.insert(erased.end(), old_paths_index.begin(), old_paths_index.end());
+double CalcScoreForPathsNew(const Graph& gr, const PathSet& paths,
+                            vector<std::shared_ptr<const PathScore<double>>>& scores,
+                            ReadSet& read_set1,
+                            int& zero_reads, int& total_len,
+                            PathScoreCache<double>& cache, PositionsScratch& scratch,
+                            double min_prob_per_base, double min_prob_start) {
+  vector<double> read_probs(read_set1.GetNumberOfReads());
+  total_len = 0;
+  for (int i = 0; i < paths.size(); i++) {
+    if (!scores[i]) {
+      auto it = cache.scores.find(paths[i]);
+      if (it == cache.scores.end()) {
+        auto score = std::make_shared<PathScore<double>>();
+        ScoreSinglePath(gr, paths[i], read_set1, scratch, *score);
+        it = cache.scores.insert(make_pair(paths[i], score)).first;
+      }
+      scores[i] = it->second;
+    }
+    AddPathScore(*scores[i], read_probs);
+    total_len += scores[i]->total_len;
+  }
+  PrunePathScores(paths, cache);
+  return GetTotalProb(read_probs, total_len, zero_reads,
+                      min_prob_per_base, min_prob_start, read_set1);
 }
 
-int GetPathLen(const Graph& gr, const vector<int>& p) {\
+int GetPathLen(const Graph& gr, const vector<int>& p) {
   int total = 0;
   for (auto &e: p) {
     if (e < 0) total += -e;
@@ -1772,7 +2366,7 @@ int GetPathLen(const Graph& gr, const vector<int>& p) {\
   return total;
 }
 
-int GetTotalLen(const Graph& gr, const vector<vector<int>>& paths) {
+int GetTotalLen(const Graph& gr, const PathSet& paths) {
   int total = 0;
   for (auto &p: paths) {
     total += GetPathLen(gr, p);
@@ -1919,53 +2513,166 @@ void CalcScoreForPathInc(const Graph& gr, const vector<int>& path,
   }
 }
 
-void CalcScoreForPathsInc(const Graph& gr, const vector<vector<int>>& paths,
-                          ReadSet& read_set1, ReadSet& read_set2,
-                          double insert_mean, double insert_std,
-                          double exp_cov_move, bool use_all_to_cov,
-                          double min_prob_per_base, double min_prob_start,
-                          int &bad_bases, 
-                          vector<pair<int, double>>& changes) {
-  for (auto &path: paths) {
-    CalcScoreForPathInc(gr, path, read_set1, read_set2, insert_mean, insert_std,
-                        exp_cov_move, use_all_to_cov, min_prob_per_base,
-                        min_prob_start, bad_bases, changes);
+void GetGapSpanningPairs(const Graph& gr, const vector<int>& left, const vector<int>& right,
+                         ReadSet& read_set1, ReadSet& read_set2,
+                         double min_prob_per_base, double min_prob_start,
+                         GapPairs& pairs) {
+  int left_len = GetPathLen(gr, left);
+  unordered_map<int, vector<Aligment>> left1, left2, right1, right2;
+  read_set1.GetPositionsOnlyPath(gr, left, 0, left1);
+  read_set2.GetPositionsOnlyPath(gr, left, 0, left2);
+  read_set1.GetPositionsOnlyPath(gr, right, 0, right1);
+  read_set2.GetPositionsOnlyPath(gr, right, 0, right2);
+
+  auto align_prob = [](ReadSet& rs, int read_id, const Aligment& al) {
+    return rs.mismatch_probs_[al.edit_dist] *
+           rs.match_probs_[rs.GetReadLen(read_id) - al.edit_dist];
+  };
+  unordered_map<int, vector<pair<int, double>>> by_read;
+  // forward read a in left, reverse read b in right
+  auto add = [&](unordered_map<int, vector<Aligment>>& la, ReadSet& rsa,
+                 unordered_map<int, vector<Aligment>>& rb, ReadSet& rsb) {
+    for (auto &e: la) {
+      auto it = rb.find(e.first);
+      if (it == rb.end()) continue;
+      for (auto &a: e.second) {
+        if (a.orientation != 0) continue;
+        for (auto &b: it->second) {
+          if (b.orientation != 1) continue;
+          int dist = left_len - a.position + b.position + rsb.GetReadLen(e.first);
+          by_read[e.first].push_back(make_pair(
+              dist, align_prob(rsa, e.first, a) * align_prob(rsb, e.first, b)));
+        }
+      }
+    }
+  };
+  add(left1, read_set1, right2, read_set2);
+  add(left2, read_set2, right1, read_set1);
+  for (auto &e: by_read) {
+    pairs.placements.push_back(e.second);
+    pairs.floors.push_back(exp(min_prob_start + min_prob_per_base *
+                               (read_set1.GetReadLen(e.first) +
+                                read_set2.GetReadLen(e.first))));
   }
 }
 
+int EstimateGapLength(const vector<GapPairs>& libs) {
+  auto score = [&](int gap) {
+    double ret = 0;
+    for (auto &lib: libs) {
+      for (int i = 0; i < lib.placements.size(); i++) {
+        double sum = 0;
+        for (auto &p: lib.placements[i]) {
+          sum += p.second * GetInsertProbability(p.first + gap, lib.insert_mean,
+                                                 lib.insert_std);
+        }
+        ret += lib.weight * log(max(sum, lib.floors[i]));
+      }
+    }
+    return ret;
+  };
+  // Candidates are the gaps which put the most likely placement of a pair
+  // exactly at the insert mean, then the best one is refined.
+  vector<int> cands;
+  double step = 1;
+  for (auto &lib: libs) {
+    step = max(step, lib.insert_std / 2);
+    for (auto &pl: lib.placements) {
+      int best = 0;
+      for (int j = 1; j < pl.size(); j++) {
+        if (pl[j].second > pl[best].second) best = j;
+      }
+      cands.push_back(max(1, (int)(lib.insert_mean - pl[best].first + 0.5)));
+    }
+  }
+  if (cands.empty()) return -1;
+  sort(cands.begin(), cands.end());
+  cands.erase(unique(cands.begin(), cands.end()), cands.end());
+  const int kMaxCands = 64;
+  int gap = cands[0];
+  double best_score = score(gap);
+  for (int i = 0; i < kMaxCands && i < cands.size(); i++) {
+    int c = cands[(long long)i * cands.size() / min((int)cands.size(), kMaxCands)];
+    double sc = score(c);
+    if (sc > best_score) {
+      best_score = sc;
+      gap = c;
+    }
+  }
+  for (int st = (int)step; st >= 1; st /= 2) {
+    while (true) {
+      bool moved = false;
+      for (int c: {gap - st, gap + st}) {
+        if (c < 1) continue;
+        double sc = score(c);
+        if (sc > best_score) {
+          best_score = sc;
+          gap = c;
+          moved = true;
+        }
+      }
+      if (!moved) break;
+    }
+  }
+  return gap;
+}
+
+void CalcScoreForPathsInc(const Graph& gr, const vector<vector<int>>& paths,
+                          ReadSet& read_set1, ReadSet& read_set2,
+                          double insert_mean, double insert_std,
+                          double exp_cov_move, bool use_all_to_cov,
+                          double min_prob_per_base, double min_prob_start,
+                          int &bad_bases, 
+                          vector<pair<int, double>>& changes) {
+  for (auto &path: paths) {
+    CalcScoreForPathInc(gr, path, read_set1, read_set2, insert_mean, insert_std,
+                        exp_cov_move, use_all_to_cov, min_prob_per_base,
+                        min_prob_start, bad_bases, changes);
+  }
+}
+
+// Old values of changed probs go to undo when it is given.
 void EraseFromScoringState(const vector<pair<int, double>>& changes_erased, 
-                           int bad_bases_erased, ScoringState& scoring_state) {
+                           int bad_bases_erased, ScoringState& scoring_state,
+                           vector<pair<int, double>>* undo) {
   scoring_state.bad_bases -= bad_bases_erased;
   for (auto &e: changes_erased) {
+    if (undo) {
+      undo->push_back(make_pair(e.first, scoring_state.probs[e.first]));
+    }
     scoring_state.probs[e.first] -= e.second;
   }
 }
 
 void AddToScoringState(const vector<pair<int, double>>& changes_added, 
-                       int bad_bases_added, ScoringState& scoring_state) {
+                       int bad_bases_added, ScoringState& scoring_state,
+                       vector<pair<int, double>>* undo) {
   scoring_state.bad_bases += bad_bases_added;
   for (auto &e: changes_added) {
+    if (undo) {
+      undo->push_back(make_pair(e.first, scoring_state.probs[e.first]));
+    }
     scoring_state.probs[e.first] += e.second;
   }
 }
 
-double CalcScoreForPathsNew(const Graph& gr, const vector<vector<int>>& paths, 
+double CalcScoreForPathsNew(const Graph& gr, const PathSet& paths,
+                            const vector<vector<int>>& erased,
+                            const vector<vector<int>>& added, int total_len,
                             ReadSet& read_set1, ReadSet& read_set2, 
                             double insert_mean, double insert_std,
-                            int &zero_reads, int &total_len,
-                            ScoringState& scoring_state,
+                            int &zero_reads, ScoringState& scoring_state,
+                            bool commit, vector<pair<int, double>>* log,
                             bool use_caching, double no_cov_penalty,
                             double exp_cov_move, bool use_all_to_cov,
                             double min_prob_per_base, double min_prob_start) {
-  vector<vector<int>> erased, added;
-  GetChanges(paths, scoring_state.old_paths, erased, added);
   assert(read_set1.GetNumberOfReads() == read_set2.GetNumberOfReads());
   if (scoring_state.probs.size() == 0) {
     scoring_state.probs.resize(read_set1.GetNumberOfReads());
   }
-  total_len = GetTotalLen(gr, paths);
-  read_set1.PrecomputeAlignmentForPaths(paths, gr);
-  read_set2.PrecomputeAlignmentForPaths(paths, gr);
+  // paths kept were aligned when they were added
+  read_set1.PrecomputeAlignmentForPaths(added, gr);
+  read_set2.PrecomputeAlignmentForPaths(added, gr);
 
   int bad_bases_erased = 0, bad_bases_added = 0;
   vector<pair<int, double>> changes_erased, changes_added;
@@ -1977,15 +2684,28 @@ double CalcScoreForPathsNew(const Graph& gr, const vector<vector<int>>& paths,
                        exp_cov_move, use_all_to_cov, min_prob_per_base,
                        min_prob_start, bad_bases_added, changes_added);
 
-  EraseFromScoringState(changes_erased, bad_bases_erased, scoring_state);
-  AddToScoringState(changes_added, bad_bases_added, scoring_state);
+  // Without commit old values are put back newest first, so probs end up
+  // bit for bit as they were.
+  vector<pair<int, double>> undo;
+  vector<pair<int, double>>* changed = commit ? log : &undo;
+  int old_bad_bases = scoring_state.bad_bases;
+  EraseFromScoringState(changes_erased, bad_bases_erased, scoring_state, changed);
+  AddToScoringState(changes_added, bad_bases_added, scoring_state, changed);
   
   double tp = GetTotalProb(scoring_state.probs, total_len, zero_reads,
                            min_prob_per_base, min_prob_start, read_set1, read_set2);
-
-  scoring_state.old_paths = paths;
 //  printf("bb %lf %d %lf\n", insert_mean, scoring_state.bad_bases, exp_cov_move);
-  return tp - scoring_state.bad_bases * no_cov_penalty;
+  double score = tp - scoring_state.bad_bases * no_cov_penalty;
+
+  if (commit) {
+    scoring_state.old_paths = paths;
+  } else {
+    for (auto it = undo.rbegin(); it != undo.rend(); it++) {
+      scoring_state.probs[it->first] = it->second;
+    }
+    scoring_state.bad_bases = old_bad_bases;
+  }
+  return score;
 }
 
 double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths, 
@@ -1999,8 +2719,9 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
   assert(read_set1.GetNumberOfReads() == read_set2.GetNumberOfReads());
   int total_len1 = 0, total_len2 = 0;
   vector<double> read_probs(read_set1.GetNumberOfReads());
-  read_set1.ClearPositions();
-  read_set2.ClearPositions();
+  PositionsScratch sc1, sc2;
+  read_set1.ClearPositions(sc1);
+  read_set2.ClearPositions(sc2);
   read_set1.PrecomputeAlignmentForPaths(paths, gr);
   read_set2.PrecomputeAlignmentForPaths(paths, gr);
   int st = 0;
@@ -2035,17 +2756,15 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
         int e = st + total_len1 + insert_mean + insert_std;
         events.push_back(make_pair(st + total_len1, 1));
       }
-      read_set1.AddPositions(gr, ctgs[i], total_len1, st + total_len1);
-      read_set2.AddPositions(gr, ctgs[i], total_len2, st + total_len2);
+      read_set1.AddPositions(gr, ctgs[i], total_len1, st + total_len1, sc1);
+      read_set2.AddPositions(gr, ctgs[i], total_len2, st + total_len2, sc2);
     }
     assert(total_len1 == total_len2);
     st += 1000000;
   }
   printf("overins %lf %d\n", insert_mean, overins);
-  vector<vector<pair<int, pair<int, int> > > >& positions1 = 
-      read_set1.GetPositions();
-  vector<vector<pair<int, pair<int, int> > > >& positions2 = 
-      read_set2.GetPositions();
+  vector<vector<pair<int, pair<int, int> > > >& positions1 = sc1.positions;
+  vector<vector<pair<int, pair<int, int> > > >& positions2 = sc2.positions;
 
   vector<double> insert_probs((int)(insert_mean + 5*insert_std));
   for (int i = 0; i < insert_probs.size(); i++) {
@@ -2323,6 +3042,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetExactReadProbabilities
   vector<vector<int> > subpaths_inds;
 //  bool missing = false;
   vector<pair<int, int> > missing;
+  cache_lock_.lock_shared();
   for (int i = 0; i < path.size(); i++) {
     vector<int> subpath, subpathind;
     for (int j = i; j < path.size(); j++) {
@@ -2340,31 +3060,15 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetExactReadProbabilities
       }
     }
   }
+  cache_lock_.unlock_shared();
   if (!missing.empty()) {
-    int lastmissend = -47;
-    int lastmissbegin = -47; 
-    sort(missing.begin(), missing.end());
-    for (int i = 0; i < missing.size(); i++) {
-      if (missing[i].first > lastmissend) {
-        if (lastmissend != -47) {
-          int tl;
-          GetReadProbabilitiesSlow(
-              gr, vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1),
-              tl);
-        }
-        lastmissbegin = missing[i].first;
-        lastmissend = missing[i].second;
-      }
-      lastmissend = max(lastmissend, missing[i].second);
-    }
-    if (lastmissend != -47) {
-      int tl;
-      GetReadProbabilitiesSlow(
-          gr, vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1),
-          tl);
-    }
+    unordered_set<vector<int> > queued;
+    QueueMissing(path, missing, queued);
+    AlignQueued(gr, queued);
   }
 
+  // positions_ is shared by all callers
+  lock_guard<SharedMutex> g(cache_lock_);
 //  printf("subpaths size %d\n", subpaths.size());
   int aa = 0;
   set<int> rr;
@@ -2407,112 +3111,222 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetExactReadProbabilities
   return positions_;
 }
 
-vector<vector<pair<pair<int, int>, logdouble> > >& PacbioReadSet::GetReadProbabilities(
-    const Graph& gr, const vector<int>& path, int& total_len) {
-  string seq = gr.nodes[path[0]]->s;
-  vector<int> pathnodesposes, pathnodesposesb;
-  pathnodesposes.push_back(seq.length());
-  pathnodesposesb.push_back(0);
-/*  printf("path: ");
+void PacbioReadSet::GetSubpathBounds(const Graph& gr, const vector<int>& path,
+                                     vector<int>& begins, vector<int>& last) const {
+  begins.resize(path.size() + 1);
+  begins[0] = 0;
   for (int i = 0; i < path.size(); i++) {
-    printf("%d ", path[i]);
+    begins[i+1] = begins[i] + (path[i] < 0 ? -path[i] : gr.nodes[path[i]]->s.length());
   }
-  printf("\n");*/
-  for (int i = 1; i < path.size(); i++) {
-    pathnodesposesb.push_back(seq.length());
-    if (path[i] < 0) {
-      for (int j = 0; j < -path[i]; j++)
-        seq += "N";
-    } else {
-      seq += gr.nodes[path[i]]->s;
+  // subpaths starting at i end with the first node j for which
+  // end(j) - end(i) > max_read_len_ (or with the last node)
+  last.resize(path.size());
+  int j = 0;
+  for (int i = 0; i < path.size(); i++) {
+    j = max(j, i);
+    while (j + 1 < path.size() && begins[j+1] - begins[i+1] <= max_read_len_) {
+      j++;
     }
-    pathnodesposes.push_back(seq.length());
+    last[i] = j;
   }
-  total_len = seq.length();
-//  printf("total len %d\n", total_len);
+}
 
-  vector<vector<int> > subpaths;
-  vector<vector<int> > subpaths_inds;
-//  bool missing = false;
-  vector<pair<int, int> > missing;
+int PacbioReadSet::FindReusablePlacements(const vector<int>& path,
+                                          const vector<int>& last,
+                                          vector<int>& reuse, const Scratch& sc) const {
+  reuse.assign(path.size(), -1);
+  if (path.empty()) return -1;
+  vector<int> cands;
+  auto it = sc.placements_by_first.find(path[0]);
+  if (it != sc.placements_by_first.end()) {
+    cands.insert(cands.end(), it->second.begin(), it->second.end());
+  }
+  it = sc.placements_by_last.find(path.back());
+  if (it != sc.placements_by_last.end()) {
+    cands.insert(cands.end(), it->second.begin(), it->second.end());
+  }
+
+  int n = path.size();
+  int best = -1, best_count = 0;
+  vector<int> cur;
+  for (auto c: cands) {
+    const PathPlacements& pp = sc.placements[c];
+    int m = pp.path.size();
+    int prefix = 0;
+    while (prefix < min(n, m) && path[prefix] == pp.path[prefix]) prefix++;
+    int suffix = 0;
+    while (suffix < min(n, m) && path[n-1-suffix] == pp.path[m-1-suffix]) suffix++;
+    cur.assign(n, -1);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      if (last[i] < prefix && pp.last[i] == last[i]) {
+        cur[i] = i;
+      } else if (i >= n - suffix && pp.last[i+m-n] == last[i]+m-n) {
+        cur[i] = i+m-n;
+      } else {
+        continue;
+      }
+      count++;
+    }
+    if (count > best_count) {
+      best_count = count;
+      best = c;
+      reuse.swap(cur);
+      if (count == n) break;
+    }
+  }
+  return best;
+}
+
+void PacbioReadSet::FindMissingSubpaths(const vector<int>& path,
+                                        const vector<int>& last,
+                                        const vector<int>& reuse,
+                                        vector<pair<int, int> >& missing) const {
   for (int i = 0; i < path.size(); i++) {
-    vector<int> subpath, subpathind;
-    for (int j = i; j < path.size(); j++) {
+    if (reuse[i] != -1) continue;
+    vector<int> subpath;
+    for (int j = i; j <= last[i]; j++) {
       subpath.push_back(path[j]);
-      subpathind.push_back(j);
-      int subpath_length = pathnodesposes[j] - pathnodesposesb[i]; 
-      int first_length = pathnodesposes[i] - pathnodesposesb[i];
       if (aligment_cache_.count(subpath) == 0) {
-        missing.push_back(make_pair(subpathind[0], subpathind.back()));
-      }
-      subpaths.push_back(subpath);
-      subpaths_inds.push_back(subpathind);
-      if (subpath_length - first_length > max_read_len_) {
-        break;
+        missing.push_back(make_pair(i, j));
       }
     }
   }
-  if (!missing.empty()) {
-    int lastmissend = -47;
-    int lastmissbegin = -47; 
-    sort(missing.begin(), missing.end());
-    for (int i = 0; i < missing.size(); i++) {
-      if (missing[i].first > lastmissend) {
-        if (lastmissend != -47) {
-          int tl;
-          GetReadProbabilitiesSlow(
-              gr, vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1),
-              tl);
-        }
-        lastmissbegin = missing[i].first;
-        lastmissend = missing[i].second;
+}
+
+int PacbioReadSet::StorePlacements(const vector<int>& path, const vector<int>& last,
+                                   const vector<int>& reuse, int source,
+                                   Scratch& sc) const {
+  vector<PathPlacements>& stored = sc.placements;
+  sc.placements_stamp++;
+  if (source != -1 && stored[source].path == path) {
+    stored[source].stamp = sc.placements_stamp;
+    return source;
+  }
+  PathPlacements np;
+  np.path = path;
+  np.last = last;
+  np.stamp = sc.placements_stamp;
+  np.offsets.push_back(0);
+  for (int i = 0; i < path.size(); i++) {
+    if (reuse[i] != -1) {
+      const PathPlacements& pp = stored[source];
+      np.placements.insert(np.placements.end(),
+                           pp.placements.begin() + pp.offsets[reuse[i]],
+                           pp.placements.begin() + pp.offsets[reuse[i]+1]);
+    } else {
+      vector<int> subpath;
+      for (int j = i; j <= last[i]; j++) {
+        subpath.push_back(path[j]);
+        auto it = aligment_cache_.find(subpath);
+        assert(it != aligment_cache_.end());
+        np.placements.insert(np.placements.end(), it->second.begin(), it->second.end());
       }
-      lastmissend = max(lastmissend, missing[i].second);
     }
-    if (lastmissend != -47) {
-      int tl;
-      GetReadProbabilitiesSlow(
-          gr, vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1),
-          tl);
+    np.offsets.push_back(np.placements.size());
+  }
+
+  int ind = stored.size();
+  if (ind < kMaxStoredPlacements) {
+    stored.push_back(PathPlacements());
+  } else {
+    ind = 0;
+    for (int i = 1; i < stored.size(); i++) {
+      if (stored[i].stamp < stored[ind].stamp) {
+        ind = i;
+      }
     }
+    vector<int>& by_first = sc.placements_by_first[stored[ind].path[0]];
+    by_first.erase(find(by_first.begin(), by_first.end(), ind));
+    vector<int>& by_last = sc.placements_by_last[stored[ind].path.back()];
+    by_last.erase(find(by_last.begin(), by_last.end(), ind));
+  }
+  stored[ind].path.swap(np.path);
+  stored[ind].last.swap(np.last);
+  stored[ind].offsets.swap(np.offsets);
+  stored[ind].placements.swap(np.placements);
+  stored[ind].stamp = np.stamp;
+  sc.placements_by_first[path[0]].push_back(ind);
+  sc.placements_by_last[path.back()].push_back(ind);
+  return ind;
+}
+
+vector<vector<pair<pair<int, int>, logdouble> > >& PacbioReadSet::GetReadProbabilities(
+    const Graph& gr, const vector<int>& path, int& total_len, Scratch& sc) {
+  vector<vector<pair<pair<int, int>, logdouble> > >& positions = sc.positions;
+  for (auto r: sc.touched_reads) {
+    positions[r].clear();
+  }
+  sc.touched_reads.clear();
+  positions.resize(reads_num_);
+  total_len = 0;
+  if (path.empty()) {
+    return positions;
   }
 
-//  printf("subpaths size %d\n", subpaths.size());
-  int aa = 0;
-  set<int> rr;
-  for (int i = 0; i < positions2_.size(); i++) {
-    positions2_[i].clear();
+  vector<int> begins, last, reuse;
+  GetSubpathBounds(gr, path, begins, last);
+  total_len = begins.back();
+
+  // Only subpaths which are not shared with a stored path are looked up.
+  int source = FindReusablePlacements(path, last, reuse, sc);
+  vector<pair<int, int> > missing;
+  {
+    SharedLock l(cache_lock_);
+    FindMissingSubpaths(path, last, reuse, missing);
   }
-  positions2_.resize(reads_num_);
-  for (int i = 0; i < subpaths.size(); i++) {
-/*    assert(subpaths[i].size() > 0);
-    assert(subpaths[i][0] >= 0);
-    assert(subpaths[i][0] < pathnodesposesb.size());*/
-    int pos_begin = pathnodesposesb[subpaths_inds[i][0]];
-    assert(aligment_cache_.count(subpaths[i]));
-    for (int j = 0; j < aligment_cache_[subpaths[i]].size(); j++) {
-      aa++;
-      PacbioAligment &al = aligment_cache_[subpaths[i]][j];
-      rr.insert(al.read_id);
-      positions2_[al.read_id].push_back(make_pair(make_pair(pos_begin + al.position,
+  if (!missing.empty()) {
+    QueueMissing(path, missing, sc.queued_subpaths);
+    AlignQueued(gr, sc.queued_subpaths);
+  }
+  int ind;
+  {
+    SharedLock l(cache_lock_);
+    ind = StorePlacements(path, last, reuse, source, sc);
+  }
+
+  const PathPlacements& pp = sc.placements[ind];
+  for (int i = 0; i < path.size(); i++) {
+    int pos_begin = begins[i];
+    for (int j = pp.offsets[i]; j < pp.offsets[i+1]; j++) {
+      const PacbioAligment &al = pp.placements[j];
+      if (positions[al.read_id].empty()) {
+        sc.touched_reads.push_back(al.read_id);
+      }
+      positions[al.read_id].push_back(make_pair(make_pair(pos_begin + al.position,
                   pos_begin + al.position_end), al.prob));
     }
   }
 
-  return positions2_;
+  return positions;
 }
 
 void PacbioReadSet::ComputeAnchors(const Graph& gr) {
+  string indexname = name_ + ".anchors.csr";
   string anchorsname = name_ + ".anchors";
-  printf("loading anchors from %s\n", anchorsname.c_str());
+  printf("loading anchors from %s\n", indexname.c_str());
+  if (anchors_.Load(indexname)) {
+    printf("loaded %d anchors\n", anchors_.NumNodesWithAnchors());
+    return;
+  }
+  vector<AnchorHit> hits;
   ifstream ifs(anchorsname);
   if (ifs.is_open()) {
+    // anchors saved by older versions
+    unordered_map<int, unordered_set<int> > anchors_all, anchors_begin, anchors_end;
     boost::archive::binary_iarchive ia(ifs);
-    ia >> anchors_cache_;
-    ia >> anchors_begin_;
-    ia >> anchors_end_;
-    printf("loaded %d anchors\n", (int)anchors_cache_.size());
+    ia >> anchors_all;
+    ia >> anchors_begin;
+    ia >> anchors_end;
     ifs.close();
+    for (auto &e: anchors_all) {
+      for (auto &r: e.second) {
+        hits.push_back(AnchorHit(e.first, r, anchors_begin[e.first].count(r) > 0,
+                                 anchors_end[e.first].count(r) > 0));
+      }
+    }
+    printf("converting %d anchors from %s\n", (int)anchors_all.size(),
+           anchorsname.c_str());
   } else {
     char tmpname1[L_tmpnam+6], tmpname2[L_tmpnam];
     tmpnam(tmpname1);
@@ -2552,26 +3366,18 @@ void PacbioReadSet::ComputeAnchors(const Graph& gr) {
       string name = parts[0].substr(0, lastsep);
       int start = atoi(parts[6].c_str());
       int end = atoi(parts[7].c_str());
-      anchors_cache_[node_id].insert(GetReadId(name));
-      if (start <= 10) {
-        anchors_begin_[node_id].insert(GetReadId(name));
-      }
-      if (end >= gr.nodes[node_id]->s.length() - 10) {
-        anchors_end_[node_id].insert(GetReadId(name));
-      }
+      hits.push_back(AnchorHit(node_id, GetReadId(name), start <= 10,
+                               end >= gr.nodes[node_id]->s.length() - 10));
     }
-
-    ofstream ofs(anchorsname);
-    boost::archive::binary_oarchive oa(ofs);
-    oa << anchors_cache_;
-    oa << anchors_begin_;
-    oa << anchors_end_;
-    printf("saved %d anchors\n", (int)anchors_cache_.size());
+    remove(tmpname1);
+    remove(tmpname2);
   }
-  for (auto &e: anchors_begin_) {
-    for (auto &x: e.second) {
-      anchors_reverse_[x].insert(e.first);
-    }
+
+  anchors_.Build(gr.nodes.size(), hits);
+  if (anchors_.Save(indexname)) {
+    printf("saved %d anchors\n", anchors_.NumNodesWithAnchors());
+  } else {
+    printf("failed to save anchors to %s\n", indexname.c_str());
   }
 }
 
@@ -2647,6 +3453,229 @@ int PacbioReadSet::GetGap(const Graph& gr, int first, int second, int read_id) {
          second_align.sstart - first_align.send;
 }
 
+void PacbioReadSet::QueueMissing(const vector<int>& path,
+                                 vector<pair<int, int> >& missing,
+                                 unordered_set<vector<int> >& queued) {
+  int lastmissend = -47;
+  int lastmissbegin = -47;
+  sort(missing.begin(), missing.end());
+  for (int i = 0; i < missing.size(); i++) {
+    if (missing[i].first > lastmissend) {
+      if (lastmissend != -47) {
+        queued.insert(
+            vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1));
+      }
+      lastmissbegin = missing[i].first;
+      lastmissend = missing[i].second;
+    }
+    lastmissend = max(lastmissend, missing[i].second);
+  }
+  if (lastmissend != -47) {
+    queued.insert(
+        vector<int>(path.begin()+lastmissbegin, path.begin()+lastmissend+1));
+  }
+}
+
+void PacbioReadSet::QueueMissingSubpaths(const Graph& gr, const vector<int>& path,
+                                         Scratch& sc) {
+  if (path.empty()) return;
+  vector<int> begins, last, reuse;
+  GetSubpathBounds(gr, path, begins, last);
+  FindReusablePlacements(path, last, reuse, sc);
+  vector<pair<int, int> > missing;
+  {
+    SharedLock l(cache_lock_);
+    FindMissingSubpaths(path, last, reuse, missing);
+  }
+  if (!missing.empty()) {
+    QueueMissing(path, missing, sc.queued_subpaths);
+  }
+}
+
+void PacbioReadSet::AlignQueuedSubpaths(const Graph& gr, Scratch& sc) {
+  AlignQueued(gr, sc.queued_subpaths);
+}
+
+void PacbioReadSet::AlignQueued(const Graph& gr, unordered_set<vector<int> >& queued) {
+  if (queued.empty()) return;
+  lock_guard<SharedMutex> g(cache_lock_);
+  // another thread may have aligned some of them in the meantime
+  vector<vector<int> > paths;
+  for (auto &q: queued) {
+    vector<int> begins, last, reuse(q.size(), -1);
+    vector<pair<int, int> > missing;
+    GetSubpathBounds(gr, q, begins, last);
+    FindMissingSubpaths(q, last, reuse, missing);
+    if (!missing.empty()) {
+      paths.push_back(q);
+    }
+  }
+  queued.clear();
+  for (int b = 0; b < paths.size(); b += kMaxBlasrBatch) {
+    int e = min((int)paths.size(), b + kMaxBlasrBatch);
+    if (e - b == 1) {
+      int tl;
+      GetReadProbabilitiesSlow(gr, paths[b], tl);
+    } else {
+      AlignSubpathsBatch(gr, vector<vector<int> >(paths.begin() + b, paths.begin() + e));
+    }
+  }
+}
+
+void PacbioReadSet::AlignSubpathsBatch(const Graph& gr, const vector<vector<int> >& paths) {
+  char tmpname1[L_tmpnam+6], tmpname2[L_tmpnam+6], tmpname3[L_tmpnam];
+  tmpnam(tmpname1);
+  strcat(tmpname1, ".fas");
+  tmpnam(tmpname2);
+  strcat(tmpname2, ".fq");
+  tmpnam(tmpname3);
+  printf("pb batch files %s %s %s %d\n", tmpname1, tmpname2, tmpname3, (int)paths.size());
+
+  // Every subpath goes to the reference file as record b<index>.
+  vector<string> seqalls(paths.size());
+  vector<vector<int> > poses(paths.size());
+  vector<unordered_map<vector<int>, int> > subpath_starts(paths.size());
+  vector<unordered_set<vector<int> > > dont_save(paths.size());
+  vector<unordered_set<int> > path_filters(paths.size());
+  unordered_set<int> read_filter;
+  bool use_filter = true;
+  FILE *f = fopen(tmpname1, "w");
+  for (int k = 0; k < paths.size(); k++) {
+    const vector<int>& path = paths[k];
+    string seq;
+    vector<int>& pathnodesposes = poses[k];
+    vector<int> pathnodesposesb;
+    for (int i = 0; i < path.size(); i++) {
+      pathnodesposesb.push_back(seq.length());
+      if (path[i] < 0) {
+        seq += string(-path[i], 'N');
+      } else {
+        seq += gr.nodes[path[i]]->s;
+      }
+      pathnodesposes.push_back(seq.length());
+    }
+    fprintf(f, ">b%d\n%s\n", k, seq.c_str());
+    seqalls[k] = seq + kContigSeparator + ReverseSeq(seq);
+
+    unordered_set<int>& path_filter = path_filters[k];
+    for (int i = 0; i < path.size(); i++) {
+      if (path[i] >= 0) {
+        for (auto &e: anchors_.NodeReads(path[i])) {
+          path_filter.insert(e);
+        }
+      }
+    }
+    // A subpath without anchors is aligned against all reads, like in the
+    // single subpath version.
+    if (path_filter.empty()) {
+      use_filter = false;
+    }
+    read_filter.insert(path_filter.begin(), path_filter.end());
+
+    for (int i = 0; i < path.size(); i++) {
+      vector<int> subpath;
+      for (int j = i; j < path.size(); j++) {
+        subpath.push_back(path[j]);
+        int subpath_length = pathnodesposes[j] - pathnodesposesb[i]; 
+        int first_length = pathnodesposes[i] - pathnodesposesb[i];
+        if (aligment_cache_.count(subpath))
+          dont_save[k].insert(subpath);
+        else
+          aligment_cache_[subpath].clear();
+        subpath_starts[k][subpath] = i;
+        if (subpath_length - first_length > max_read_len_) {
+          break;
+        }
+      }
+    }
+  }
+  fclose(f);
+
+  string reads_filename = filename_;
+  printf("read filter %d/%d\n", use_filter ? (int)read_filter.size() : GetNumberOfReads(),
+         GetNumberOfReads());
+  if (use_filter && !read_filter.empty()) {
+    FilterReads(tmpname2, read_filter);
+    reads_filename = tmpname2;
+  }
+
+  // -bestn limits alignments of a read over all references, a separate run
+  // per subpath would report up to kBlasrBestn for each of them
+  assert(paths.size() <= kMaxBlasrBatch);
+  int bestn = kBlasrBestn * paths.size();
+  string cmd = gBlasrPath + "/blasr ";
+  cmd += reads_filename;
+  cmd += " ";
+  cmd += tmpname1;
+  cmd += " -sam -sdpTupleSize 8 -guidedAlignBandSize 100 ";
+  cmd += "-bestn " + to_string(bestn) + " -nCandidates 50 ";
+  cmd += "-minMatch 11 ";
+  cmd += kThreadsBlasr;
+  cmd += " >";
+  cmd += tmpname3;
+  printf("command %s\n", cmd.c_str());
+  system(cmd.c_str());
+
+  ifstream fi(tmpname3);
+  string l;
+  set<int> rr;
+  string read_buf;
+  while (getline(fi, l)) {
+    if (l[0] == '@') {
+      continue;
+    }
+    int tab1 = l.find('\t');
+    int tab2 = l.find('\t', tab1 + 1);
+    int tab3 = l.find('\t', tab2 + 1);
+    int k = atoi(l.c_str() + tab2 + 2);
+    assert(l[tab2 + 1] == 'b' && k >= 0 && k < paths.size() && tab3 > tab2);
+    const vector<int>& path = paths[k];
+    const vector<int>& pathnodesposes = poses[k];
+    int seq_len = pathnodesposes.back();
+
+    PacbioAligmentData align = ParseAligment(l, seqalls[k].length());
+    assert(read_map_.count(align.name) > 0);
+    int read_id = read_map_[align.name];
+    // Reads outside of the subpath's own filter would not have been aligned
+    // to it by a separate run.
+    if (!path_filters[k].empty() && path_filters[k].count(read_id) == 0) {
+      continue;
+    }
+    logdouble prob = AligmentProbability(seqalls[k], GetReadSeq(read_id, read_buf),
+                                         align, 2);
+
+    int it_begin = lower_bound(pathnodesposes.begin(), pathnodesposes.end(), 
+                               max(0, align.tstart - 5)) -
+                   pathnodesposes.begin();
+    int it_end = lower_bound(pathnodesposes.begin(), pathnodesposes.end(), 
+                             min(align.tstart + align.len + 5, seq_len)) -
+                 pathnodesposes.begin();
+    assert(it_begin < path.size());
+    assert(it_begin >= 0);
+    assert(it_end < path.size());
+    assert(it_end >= 0);
+    vector<int> subpath(path.begin()+it_begin, path.begin()+it_end+1);
+    int pos_begin = 0;
+    if (it_begin > 0) {
+      pos_begin = pathnodesposes[it_begin-1];
+    }
+    auto st = subpath_starts[k].find(subpath);
+    if (st != subpath_starts[k].end() && st->second == it_begin &&
+        dont_save[k].count(subpath) == 0) {
+      aligment_cache_[subpath].push_back(PacbioAligment(align.tstart - pos_begin, 
+                                                        align.tend - pos_begin,
+                                                        read_id,
+                                                        prob));
+    }
+    rr.insert(read_id);
+  }
+  printf("rr %d\n", (int)rr.size());
+
+  remove(tmpname1);
+  remove(tmpname3);
+  SaveAligments();
+}
+
 vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesSlow(
     const Graph& gr, const vector<int>& path, int& total_len, bool save_to_cache) {
   char tmpname1[L_tmpnam+6], tmpname2[L_tmpnam+6], tmpname3[L_tmpnam];
@@ -2691,7 +3720,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesSlow(
   unordered_set<int> read_filter;
   for (int i = 0; i < path.size(); i++) {
     if (path[i] >= 0) {
-      for (auto &e: anchors_cache_[path[i]]) {
+      for (auto &e: anchors_.NodeReads(path[i])) {
         read_filter.insert(e);
       }
     }
@@ -2743,6 +3772,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesSlow(
   }
   set<int> rr;
   int good_out = 0, bad_out = 0, in_ok = 0, in_bad = 0;
+  string read_buf;
   while (getline(fi, l)) {
     if (l[0] == '@') {
       continue;
@@ -2753,7 +3783,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesSlow(
     int aligned_length = align.send - align.sstart;
     logdouble prob;
     for (int i = 2; i < 3; i++) {
-      prob = AligmentProbability(seqall, read_seq_[read_id], align, i);
+      prob = AligmentProbability(seqall, GetReadSeq(read_id, read_buf), align, i);
     }
     if (prob > GetMinReadProb(read_id) || true) {
       positions_[read_id].push_back(make_pair(align.tstart, prob));
@@ -2849,8 +3879,9 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesAncho
   string seqrev = ReverseSeq(seq);
   string seqall = seq + kContigSeparator + seqrev;
   string reads_filename = filename_;
-  if (anchors_cache_.count(path[anchor])) {
-    FilterReads(tmpname2, anchors_cache_[path[anchor]]);
+  IdRange anchor_reads = anchors_.NodeReads(path[anchor]);
+  if (!anchor_reads.empty()) {
+    FilterReads(tmpname2, unordered_set<int>(anchor_reads.begin(), anchor_reads.end()));
     reads_filename = tmpname2;
   }
 
@@ -2889,6 +3920,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesAncho
     }
   }
   set<int> rr;
+  string read_buf;
   while (getline(fi, l)) {
     if (l[0] == '@') {
       continue;
@@ -2899,7 +3931,7 @@ vector<vector<pair<int, logdouble> > >& PacbioReadSet::GetReadProbabilitiesAncho
 
     logdouble prob;
     for (int i = 2; i < 3; i++) {
-      prob = AligmentProbability(seqall, read_seq_[read_id], align, i);
+      prob = AligmentProbability(seqall, GetReadSeq(read_id, read_buf), align, i);
     }
     if (prob > GetMinReadProb(read_id) || true) {
       positions_[read_id].push_back(make_pair(align.tstart, prob));
@@ -3068,10 +4100,8 @@ double GetTotalProbPacbio(const vector<logdouble>& read_probs, int total_len,
     total_len = 1;
   }
   zero_reads = 0;
-  FILE *f = fopen("rp.dat", "w");
   for (int i = 0; i < read_probs.size(); i++) {
     logdouble prob = read_probs[i];
-    fprintf(f, "%s %lf\n", read_set.GetReadName(i).c_str(), prob.logval);
     logdouble mrp = logdouble(exp(min_prob_start)) *
                     (logdouble(exp(min_prob_per_base)) ^ read_set.GetReadLen(i));
     if (prob < mrp) {
@@ -3083,7 +4113,6 @@ double GetTotalProbPacbio(const vector<logdouble>& read_probs, int total_len,
     total_prob *= prob;
     total_c++;
   }
-  fclose(f);
   return total_prob.logval / total_c - log(2*total_len);
 }
 
@@ -3096,11 +4125,9 @@ double GetTotalProbPacbio(const vector<logdouble>& read_probs, int total_len,
     total_len = 1;
   }
   zero_reads = 0;
-  FILE *f = fopen("rp.dat", "w");
   non_zero_len = 0;
   for (int i = 0; i < read_probs.size(); i++) {
     logdouble prob = read_probs[i];
-    fprintf(f, "%s %lf\n", read_set.GetReadName(i).c_str(), prob.logval);
     logdouble mrp = read_set.GetMinReadProb(i);
     if (prob < mrp) {
       zero_reads++;
@@ -3112,7 +4139,6 @@ double GetTotalProbPacbio(const vector<logdouble>& read_probs, int total_len,
     total_prob *= prob;
     total_c++;
   }
-  fclose(f);
   return total_prob.logval / total_c - log(2*total_len);
 }
 
@@ -3168,6 +4194,81 @@ void InitReadProbs(int num_reads, vector<logdouble>& read_probs) {
   read_probs.resize(num_reads);
 }
 
+// Score of one (normalized) path, reads are added up in the same order as
+// by AddPositionsToReadProbsPacbio. pn is the path number for messages.
+void ScorePacbioPath(const Graph& gr, const vector<int>& path, PacbioReadSet& read_set,
+                     PacbioReadSet::Scratch& sc, int pn, double exp_cov_move,
+                     PathScore<logdouble>& score) {
+  vector<vector<int>> ctgs;
+  vector<int> gaps;
+  int last = 0;
+  for (int i = 0; i < path.size(); i++) {
+/*      if (path[i] < 0) {
+      gaps.push_back(-path[i]);
+      ctgs.push_back(vector<int>(path.begin()+last, path.begin()+i));
+      last = i+1;
+    }*/
+  }
+  ctgs.push_back(vector<int>(path.begin()+last, path.end()));
+  for (int i = 0; i < ctgs.size(); i++) {
+    vector<pair<int, int> > events;
+    events.push_back(make_pair(-1000, 1));
+    events.push_back(make_pair(2000, -3000));
+    int tl;
+    int pp = 0;
+    for (int j = 0; j < ctgs[i].size(); j++) {
+      if (ctgs[i][j] >= 0) {
+        events.push_back(make_pair(pp, 1));
+        int cl = gr.nodes[ctgs[i][j]]->s.length();
+        events.push_back(make_pair(pp+cl, -cl));
+        pp += cl;
+      } else {
+        pp += -ctgs[i][j];
+      }
+    }
+    vector<vector<pair<pair<int, int>, logdouble> > >& positions =
+        read_set.GetReadProbabilities(gr, ctgs[i], tl, sc);
+    sort(sc.touched_reads.begin(), sc.touched_reads.end());
+    for (auto i: sc.touched_reads) {
+      for (auto &p: positions[i]) {
+        score.probs.push_back(make_pair(i, p.second));
+        if (p.second < read_set.GetMinReadProb(i)) continue;
+        events.push_back(make_pair(p.first.first,
+                                   1));
+        events.push_back(make_pair(p.first.second,
+                                   p.first.first - p.first.second));
+      }
+    }
+    score.total_len += tl;
+
+    sort(events.begin(), events.end());
+    multiset<int> inters;
+    for (int j = 0; j < events.size(); j++) {
+      if (events[j].second == 1) {
+        inters.insert(events[j].first);
+      }
+      if (events[j].second != 1) {
+        auto it = inters.find(events[j].first + events[j].second);
+        inters.erase(it);
+      }
+      int good_start = tl-250;
+      if (!inters.empty()) {
+        int mm = *inters.begin();
+        good_start = mm + exp_cov_move;
+      }
+      if (j + 1 < events.size()) {
+        good_start = min(events[j+1].first, good_start);
+      }
+      good_start = min(good_start, tl - 250);
+      if (good_start > max(2500, events[j].first)) {
+        printf("ctg %d error %d-%d\n", pn, events[j].first, good_start);
+        score.bad_bases += good_start - max(2500, events[j].first);
+      }
+       
+    }
+  }
+}
+
 double CalcScoreForPacbio(const Graph& gr, vector<vector<int> > paths,
                           PacbioReadSet& read_set, int& zero_reads, int& total_len, 
                           bool use_caching, double no_cov_penalty,
@@ -3180,81 +4281,77 @@ double CalcScoreForPacbio(const Graph& gr, vector<vector<int> > paths,
   int bad_bases = 0;
   int bad_gaps = 0;
   int pn = 0;
+  PacbioReadSet::Scratch sc;
+  // Align everything missing for all paths in one aligner run.
   for (auto& path: paths) {
     gr.NormalizePath(path);
-    vector<vector<int>> ctgs;
-    vector<int> gaps;
-    int last = 0;
-    for (int i = 0; i < path.size(); i++) {
-/*      if (path[i] < 0) {
-        gaps.push_back(-path[i]);
-        ctgs.push_back(vector<int>(path.begin()+last, path.begin()+i));
-        last = i+1;
-      }*/
-    }
-    ctgs.push_back(vector<int>(path.begin()+last, path.end()));
-    for (int i = 0; i < ctgs.size(); i++) {
-      vector<pair<int, int> > events;
-      events.push_back(make_pair(-1000, 1));
-      events.push_back(make_pair(2000, -3000));
-      int tl;
-      int pp = 0;
-      for (int j = 0; j < ctgs[i].size(); j++) {
-        if (ctgs[i][j] >= 0) {
-          events.push_back(make_pair(pp, 1));
-          int cl = gr.nodes[ctgs[i][j]]->s.length();
-          events.push_back(make_pair(pp+cl, -cl));
-          pp += cl;
-        } else {
-          pp += -ctgs[i][j];
-        }
-      }
-      vector<vector<pair<pair<int, int>, logdouble> > >& positions =
-          read_set.GetReadProbabilities(gr, ctgs[i], tl);
-      for (int i = 0; i < positions.size(); i++) {
-        for (auto &p: positions[i]) {
-          if (p.second < read_set.GetMinReadProb(i)) continue;
-          events.push_back(make_pair(p.first.first,
-                                     1));
-          events.push_back(make_pair(p.first.second,
-                                     p.first.first - p.first.second));
-        }
-      }
-      AddPositionsToReadProbsPacbio(positions, read_probs);
-      total_len += tl;
-
-      sort(events.begin(), events.end());
-      multiset<int> inters;
-      for (int j = 0; j < events.size(); j++) {
-        if (events[j].second == 1) {
-          inters.insert(events[j].first);
-        }
-        if (events[j].second != 1) {
-          auto it = inters.find(events[j].first + events[j].second);
-          inters.erase(it);
-        }
-        int good_start = tl-250;
-        if (!inters.empty()) {
-          int mm = *inters.begin();
-          good_start = mm + exp_cov_move;
-        }
-        if (j + 1 < events.size()) {
-          good_start = min(events[j+1].first, good_start);
-        }
-        good_start = min(good_start, tl - 250);
-        if (good_start > max(2500, events[j].first)) {
-          printf("ctg %d error %d-%d\n", pn, events[j].first, good_start);
-          bad_bases += good_start - max(2500, events[j].first);
-        }
-         
-      }
-    }
+    read_set.QueueMissingSubpaths(gr, path, sc);
+  }
+  read_set.AlignQueuedSubpaths(gr, sc);
+  for (auto& path: paths) {
+    PathScore<logdouble> score;
+    ScorePacbioPath(gr, path, read_set, sc, pn, exp_cov_move, score);
+    AddPathScore(score, read_probs);
+    total_len += score.total_len;
+    bad_bases += score.bad_bases;
     st += 1000000; pn++;
   }
   if (no_cov_penalty > 0) {
     printf("badp %d %d\n", bad_bases, bad_gaps);
   }
 
+  read_set.WriteDiagnostics(read_probs);
+  double total_prob = GetTotalProbPacbio(read_probs, total_len, read_set, zero_reads,
+                                         min_prob_per_base, min_prob_start);
+  return total_prob - bad_bases*no_cov_penalty;
+}
+
+double CalcScoreForPacbioNew(const Graph& gr, const PathSet& paths,
+                             vector<std::shared_ptr<const PathScore<logdouble>>>& scores,
+                             PacbioReadSet& read_set, int& zero_reads, int& total_len,
+                             PathScoreCache<logdouble>& cache,
+                             PacbioReadSet::Scratch& scratch,
+                             double no_cov_penalty, double exp_cov_move,
+                             double min_prob_per_base, double min_prob_start) {
+  vector<logdouble> read_probs;
+  InitReadProbs(read_set.GetNumberOfReads(), read_probs);
+  total_len = 0;
+  int bad_bases = 0;
+  // Align everything missing for new paths in one aligner run.
+  vector<pair<int, vector<int>>> added;
+  vector<std::shared_ptr<PathScore<logdouble>>> added_scores;
+  for (int i = 0; i < paths.size(); i++) {
+    if (scores[i]) continue;
+    auto it = cache.scores.find(paths[i]);
+    if (it != cache.scores.end()) {
+      scores[i] = it->second;
+      continue;
+    }
+    auto score = std::make_shared<PathScore<logdouble>>();
+    cache.scores[paths[i]] = score;
+    scores[i] = score;
+    vector<int> path = paths[i];
+    gr.NormalizePath(path);
+    read_set.QueueMissingSubpaths(gr, path, scratch);
+    added.push_back(make_pair(i, path));
+    added_scores.push_back(score);
+  }
+  read_set.AlignQueuedSubpaths(gr, scratch);
+  for (int k = 0; k < added.size(); k++) {
+    ScorePacbioPath(gr, added[k].second, read_set, scratch, added[k].first,
+                    exp_cov_move, *added_scores[k]);
+  }
+  for (auto &score: scores) {
+    AddPathScore(*score, read_probs);
+    total_len += score->total_len;
+    bad_bases += score->bad_bases;
+  }
+  PrunePathScores(paths, cache);
+  if (no_cov_penalty > 0) {
+    printf("badp %d %d\n", bad_bases, 0);
+  }
+
+  read_set.WriteDiagnostics(read_probs);
   double total_prob = GetTotalProbPacbio(read_probs, total_len, read_set, zero_reads,
                                          min_prob_per_base, min_prob_start);
   return total_prob - bad_bases*no_cov_penalty;
@@ -2,11 +2,19 @@
 #define GRAPH_H__
 
 #include <string>
+#include <cstdio>
 #include <boost/serialization/vector.hpp>
 #include "unordered_map.hpp"
 #include "unordered_set.hpp"
 #include "logdouble.hpp"
+#include "anchor_index.h"
+#include "read_store.h"
+#include "reach_table.h"
+#include "compact_graph.h"
+#include "parallel.h"
+#include "path_set.h"
 #include <algorithm>
+#include <memory>
 #include <random>
 #include <cassert>
 
@@ -14,7 +22,10 @@ using namespace std;
 
 extern const double kSmooth;
 extern const char kContigSeparator;
-extern default_random_engine generator;
+// Uniform integer from [0, n).
+inline int RandomInt(default_random_engine& gen, int n) {
+  return uniform_int_distribution<int>(0, n - 1)(gen);
+}
 
 typedef string Seq;
 
@@ -105,81 +116,6 @@ class Node {
     next_sum = accumulate(next_prob.begin(), next_prob.end(), 0);
   }
 
-  Node* SampleNext() const {
-    if (next_prob.size() == 0) return NULL;
-
-    uniform_real_distribution<double> dist(0.0, next_sum);
-    double samp = dist(generator);
-    double ss = 0;
-    for (int i = 0; i < next_prob.size(); i++) {
-      ss += next_prob[i];
-      if (ss > samp || i == next_prob.size() - 1) {
-        return next[i];
-      }
-    }
-  }
-
-  pair<Node*,double> SampleNextWithProb() const {
-    if (next_prob.size() == 0) return make_pair((Node*)NULL, 0);
-
-    uniform_real_distribution<double> dist(0.0, next_sum);
-    double samp = dist(generator);
-    double ss = 0;
-    for (int i = 0; i < next_prob.size(); i++) {
-      ss += next_prob[i];
-      if (ss > samp || i == next_prob.size() - 1) {
-        double prob = next_prob[i] / next_sum;
-        return make_pair(next[i], prob);
-      }
-    }
-  }
-
-  // Precond - next.size() >= 2
-  pair<Node*, double> SampleNextWithProbAndBan(int ban) const {
-    double next_sum_ban = 0;
-    for (int i = 0; i < next.size(); i++) {
-      if (next[i]->id == ban) continue;
-      next_sum_ban += next_prob[i];
-    }
-    uniform_real_distribution<double> dist(0.0, next_sum_ban);
-    double samp = dist(generator);
-    double ss = 0;
-    for (int i = 0; i < next_prob.size(); i++) {
-      if (next[i]->id == ban) continue;
-      ss += next_prob[i];
-      if (ss > samp || i == next_prob.size() - 1) {
-        double prob = next_prob[i] / next_sum_ban;
-        return make_pair(next[i], prob);
-      }
-    }
-  }
-
-  double GetNextProb(int next_id) const {
-    for (int i = 0; i < next.size(); i++) {
-      if (next[i]->id == next_id) {
-        return next_prob[i] / next_sum; 
-      }
-    }
-    assert(false);
-    return 0;
-  }
-
-  double GetNextProbBan(int next_id, int ban) const {
-    double next_sum_ban = 0;
-    for (int i = 0; i < next.size(); i++) {
-      if (next[i]->id == ban) continue;
-      next_sum_ban += next_prob[i];
-    }
-    for (int i = 0; i < next.size(); i++) {
-      if (next[i]->id == ban) continue;
-      if (next[i]->id == next_id) {
-        return next_prob[i] / next_sum_ban; 
-      }
-    }
-    assert(false);
-    return 0;
-  }
-
   void InitProbs() {
     next_prob.clear();
     for (auto &x: next) {
@@ -197,15 +133,6 @@ class Node {
     }
     assert(false);
   }
-
-  bool HasNext(int next_id) {
-    for (int i = 0; i < next.size(); i++) {
-      if (next[i]->id == next_id) {
-        return true;
-      }
-    }
-    return false;
-  }
 };
 
 struct Aligment {
@@ -230,6 +157,19 @@ struct Aligment {
   }
 };
 
+// Paths between nodes chosen by one chain (local changes it accepted), moves
+// of the chain use them before those stored in the reach tables of the graph.
+struct ReachOverrides {
+  PathOverrides big;
+  PathOverrides limit;
+
+  template<class Archive>
+  void serialize(Archive & ar, const unsigned int version) {
+    ar & big;
+    ar & limit;
+  }
+};
+
 class Graph {
  public:
   vector<Node*> nodes;
@@ -240,12 +180,16 @@ class Graph {
 
 //  vector<unordered_set<int> > reach_sets_;
   // from->to->path between
-  vector<unordered_map<int, vector<int> > > reach_big_;
-  vector<unordered_map<int, vector<int> > > reach_limit_;
-  vector<vector<vector<int>>> reach_self_;
+  ReachTable reach_big_;
+  ReachTable reach_limit_;
+  SelfLoops reach_self_;
+  // flat copy of nodes for walks, rebuilt by BuildCompact
+  CompactGraph compact_;
 
   vector<int> normalize_map;
 
+  Graph() : probs_by_path_(false) {}
+
   void CalcNormalizeMap() {
     unordered_map<string, int> small_strs;
     printf("norm map start %d\n", nodes.size());
@@ -272,28 +216,101 @@ class Graph {
     }
   }
 
+  // Nodes allocated in one block (pool[0..n)) become the nodes of the graph,
+  // which owns the block from now on.
+  void TakeNodes(unique_ptr<Node[]> pool, int n) {
+    nodes.resize(n);
+    for (int i = 0; i < n; i++) {
+      nodes[i] = &pool[i];
+    }
+    node_pool_ = std::move(pool);
+  }
+
+  // Has to be called after nodes or edges change.
+  void BuildCompact() {
+    compact_.Build(nodes);
+  }
+
+  int NodeLen(int i) const {
+    return compact_.NodeLen(i);
+  }
+
+  int OutDegree(int i) const {
+    return compact_.OutDegree(i);
+  }
+
+  const int* NextNodes(int i) const {
+    return compact_.Next(i);
+  }
+
+  bool HasEdge(int from, int to) const {
+    pair<const int*, const int*> r = compact_.FindEdges(from, to);
+    return r.first != r.second;
+  }
+
+  // Probability of taking the edge by its weight.
+  double GetNextProb(int from, int to) const {
+    pair<const int*, const int*> r = compact_.FindEdges(from, to);
+    assert(r.first != r.second);
+    return compact_.NextWeights(from)[*r.first] / compact_.WeightSum(from);
+  }
+
+  // Same with edges to ban left out.
+  double GetNextProbBan(int from, int to, int ban) const {
+    pair<const int*, const int*> r = compact_.FindEdges(from, to);
+    assert(r.first != r.second && to != ban);
+    const double* w = compact_.NextWeights(from);
+    double sum_ban = compact_.WeightSum(from);
+    pair<const int*, const int*> bans = compact_.FindEdges(from, ban);
+    for (const int* it = bans.first; it != bans.second; ++it) {
+      sum_ban -= w[*it];
+    }
+    return w[*r.first] / sum_ban;
+  }
+
+  // Next node by edge weights or -1.
+  int SampleNext(int i, default_random_engine& gen) const {
+    return compact_.SampleNext(i, gen);
+  }
+
+  pair<int, double> SampleNextWithProb(int i, default_random_engine& gen) const {
+    return compact_.SampleNextWithProb(i, gen);
+  }
+
+  // Never picks ban, (-1, 0) if there is nothing else.
+  pair<int, double> SampleNextWithBan(int i, int ban, default_random_engine& gen) const {
+    return compact_.SampleNextWithBan(i, ban, gen);
+  }
+
   void CalcReachability();
   void CalcReachabilityBig(int threshold);
   void CalcReachabilityLimit(int max_dist);
+  // Instead of the two above, searches run when a node is first queried and
+  // at most cache_size results per table are kept.
+  void SetLazyReachability(int threshold, int max_dist, int cache_size);
+  // Starts computing reachability of sources in background (lazy mode only).
+  void PrefetchReachability(const vector<int>& sources);
+  // Reachability tables (all three) cached in a file. Load fails when the
+  // file was made for a different graph or parameters.
+  bool SaveReachability(const string& filename, int threshold, int max_dist) const;
+  bool LoadReachability(const string& filename, int threshold, int max_dist);
+  unsigned long long Fingerprint() const;
+  void SearchLimit(int source, int max_dist, SearchScratch& sc,
+                   vector<ReachEntry>& out) const;
+  void SearchBig(int source, int threshold, SearchScratch& sc,
+                 vector<ReachEntry>& out) const;
 
   void CalcProbSums() {
     for (auto &x: nodes) {
       x->CalcProbSums();
     }
+    compact_.UpdateWeights(nodes);
   }
 
-  void RecalculateProbsByPath(const vector<int>& path) {
-    for (auto &x: nodes) {
-      x->InitProbs();
-    }
-
-    for (int i = 1; i < path.size(); i++) {
-      nodes[path[i-1]]->AddJump(path[i]);
-      nodes[InvertNode(path[i])]->AddJump(InvertNode(path[i-1]));
-    }
-
-    CalcProbSums();
-  }
+  // Edge weights become kSmooth plus the number of times the path (or its
+  // inverse) uses the edge. After the first call only nodes on the old or
+  // new path are updated.
+  void RecalculateProbsByPath(const vector<int>& path);
 
   void OutputPath(const vector<int>& path, int kmer);
   void OutputPath(const vector<int>& path, int kmer, string filename);
@@ -301,9 +318,25 @@ class Graph {
   void OutputPathC(const vector<int>& path, int kmer, string filename, int cid);
   void OutputPathAT(const vector<int>& path, int kmer, string filename, int cid, int threshold);
  private:
+  // Adds delta to the weight of the first edge from -> to.
+  void AddJump(int from, int to, double delta) {
+    pair<const int*, const int*> r = compact_.FindEdges(from, to);
+    assert(r.first != r.second);
+    nodes[from]->next_prob[*r.first] += delta;
+  }
+
+  // block of nodes from TakeNodes
+  unique_ptr<Node[]> node_pool_;
+  // path of the last RecalculateProbsByPath
+  bool probs_by_path_;
+  vector<int> probs_path_;
 };
 
 bool LoadGraph(const string& filename, Graph& gr);
+// Binary copy of a loaded graph. Load fails when the snapshot is damaged or
+// source (the LastGraph it was made from) changed since.
+bool SaveGraphSnapshot(const string& filename, const string& source, const Graph& gr);
+bool LoadGraphSnapshot(const string& filename, const string& source, Graph& gr);
 
 class ReadIndexTrivial {
  public:
@@ -341,6 +374,18 @@ class ReadIndexMinHash {
   int read_len;
 };
 
+// Positions of reads on the paths added since the last ClearPositions,
+// read_id -> (position, (edit_dist, orientation)). Kept by the caller, so
+// several threads can score against one read set.
+struct PositionsScratch {
+  vector<vector<pair<int, pair<int, int> > > > positions;
+  // reads with nonempty positions, in the order they got the first one
+  vector<int> touched_reads;
+};
+
+// Aligments of subpaths are cached in the read set and shared by all its
+// users. The cache is only locked exclusively to fill in missing subpaths;
+// lookups take it shared, so scoring runs on several threads at once.
 class ReadSet {
  public:
   // TODO: Calculate readlens from reads_file not from aligments
@@ -355,23 +400,44 @@ class ReadSet {
 
   // positions: read_id -> (position -> edit_dist, orientation)
   vector<vector<pair<int, pair<int, int> > > >& GetPositionsSlow(
-      const Graph& gr, const vector<int>& path, int& total_len);
+      const Graph& gr, const vector<int>& path, int& total_len,
+      PositionsScratch& sc);
   // positions: read_id -> (position, (edit_dist, orientation))
   vector<vector<pair<int, pair<int, int> > > >& GetPositions(
-      const Graph& gr, const vector<int>& path, int& total_len);
+      const Graph& gr, const vector<int>& path, int& total_len,
+      PositionsScratch& sc);
   vector<vector<pair<int, pair<int, int> > > >& AddPositions(
-      const Graph& gr, const vector<int>& path, int& total_len, int st);
-  vector<vector<pair<int, pair<int, int> > > >& GetPositions();
+      const Graph& gr, const vector<int>& path, int& total_len, int st,
+      PositionsScratch& sc);
   void GetPositionsOnlyPath(
       const Graph& gr, const vector<int>& path, int st, unordered_map<int, vector<Aligment>>& current_aligments);
 
-  void PrecomputeAlignmentForPaths(const vector<vector<int>>& paths, const Graph& gr);
-
-  unordered_map<int, vector<int>>& GetAdviceIndex() { return advice_index_; }
-  unordered_map<int, vector<int>>& GetAdviceIndex1() { return advice_index1_; }
+  // Paths are a vector<vector<int>> or a PathSet.
+  template<class Paths>
+  void PrecomputeAlignmentForPaths(const Paths& paths, const Graph& gr) {
+    unordered_set<vector<int>> subpaths_precomp;
+    {
+      SharedLock l(cache_lock_);
+      for (auto &path: paths) {
+        GetMassPrecompSubpaths(path, gr, subpaths_precomp);
+      }
+    }
+    if (!subpaths_precomp.empty()) {
+      printf("mass precomp start\n");
+      AlignMissing(gr, subpaths_precomp);
+    }
+  }
+  // Aligns every subpath paired read scoring of paths can ask for. Scoring
+  // these paths afterwards only reads the cache and may run on several
+  // threads at once.
+  void PrecomputeAlignmentForScoring(const vector<vector<int>>& paths, const Graph& gr);
+
+  // Advice indexes are read-only once built.
+  const unordered_map<int, vector<int>>& GetAdviceIndex() const { return advice_index_; }
+  const unordered_map<int, vector<int>>& GetAdviceIndex1() const { return advice_index1_; }
   void BuildAdviceIndex(const Graph& gr, int threshold);
 
-  void ClearPositions();
+  void ClearPositions(PositionsScratch& sc) const;
 
   int GetNumberOfReads() const {
     return reads_num_;
@@ -386,6 +452,11 @@ class ReadSet {
 
   void LoadAligments();
   void SaveAligments(bool force=false);
+  // Saving in another thread: PinAligments takes a shared hold of the
+  // cache, so it stays as it is now, SavePinnedAligments writes it and lets
+  // go. They may be called from different threads.
+  void PinAligments() const { cache_lock_.lock_shared(); }
+  void SavePinnedAligments();
 
   const string& GetName() const { return name_; }
   
@@ -399,8 +470,11 @@ class ReadSet {
   bool GetAligmentForSubpath(
       const Graph& gr, const vector<int>& subpath, vector<Aligment>& align);
 
+  // Callers of both hold cache_lock_ exclusively.
   void PrecomputeAligmentForSubpaths(
       const Graph& gr, const vector<vector<int> >& subpaths);
+  // Locks the cache and aligns those of subpaths which are still missing.
+  void AlignMissing(const Graph& gr, const unordered_set<vector<int> >& subpaths);
 
   void AlignSubpathInternal(
       const Graph& gr, const vector<int>& path);
@@ -421,10 +495,15 @@ class ReadSet {
 
   void CalcMaxReadLen();
 
+  // Both add subpaths missing in the cache, callers hold cache_lock_.
   void GetSubpathsFromPath(const vector<int>& path, const Graph& gr, unordered_set<vector<int>>& subpaths_precomp);
+  void GetMassPrecompSubpaths(const vector<int>& path, const Graph& gr,
+                              unordered_set<vector<int>>& subpaths_precomp);
 
   int reads_num_;
+  // Entries are never changed once filled, so references to them stay valid.
   unordered_map<vector<int>, vector<Aligment> > aligment_cache_;
+  mutable SharedMutex cache_lock_;
   unordered_map<string, int> read_map_;
   unordered_map<int, string> read_map_inv_;
   unordered_map<int, string> read_seqs_;
@@ -433,11 +512,11 @@ class ReadSet {
   string name_;
   string filename_;
   bool load_success_;
-  vector<vector<pair<int, pair<int, int> > > > positions_;
   ReadIndexMinHash read_index_;
   //ReadIndexTrivial read_index_;
   bool external_aligner_;
   bool advice_index_build_;
+  mutex advice_lock_;
   unordered_map<int, vector<int>> advice_index_, advice_index1_;
 };
 
@@ -446,7 +525,12 @@ class PacbioReadSet {
   PacbioReadSet(const string& name, const string& filename, double match_prob, double mismatch_prob) : 
       save_changes_(0),
       reads_num_(0), name_(name), filename_(filename), match_prob_(match_prob),
-      mismatch_prob_(mismatch_prob), min_match_prob_(1-2*(1-match_prob)), load_success_(false) {}
+      mismatch_prob_(mismatch_prob), min_match_prob_(1-2*(1-match_prob)), load_success_(false),
+      stream_reads_(false), diag_interval_(0), diag_calls_(0), diag_file_(NULL) {}
+
+  ~PacbioReadSet() {
+    CloseDiagnostics();
+  }
 
   int GetNumberOfReads() const {
     return reads_num_;
@@ -456,6 +540,21 @@ class PacbioReadSet {
     return read_lens_[read_id];
   }
 
+  // With streaming the sequences are not kept in memory, they are read from
+  // a packed store (cache_prefix.reads) when a read must be realigned.
+  void SetStreamReads(bool stream_reads) {
+    stream_reads_ = stream_reads;
+  }
+
+  // Returns the sequence of read_id, buf is used when it is not in memory.
+  const string& GetReadSeq(int read_id, string& buf) const {
+    if (!stream_reads_) {
+      return read_seq_[read_id];
+    }
+    read_store_.GetSeq(read_id, buf);
+    return buf;
+  }
+
   void PreprocessReads();
   void ComputeAnchors(const Graph& gr);
 
@@ -468,8 +567,15 @@ class PacbioReadSet {
       const Graph& gr, const vector<int>& path, int& total_len,
       int anchor);
 
+  struct Scratch;
   vector<vector<pair<pair<int, int>, logdouble> > >& GetReadProbabilities(
-      const Graph& gr, const vector<int>& path, int& total_len);
+      const Graph& gr, const vector<int>& path, int& total_len, Scratch& sc);
+
+  // Missing subpaths of several paths can be queued and then aligned
+  // together by aligner runs of at most kMaxBlasrBatch subpaths
+  // (AlignQueuedSubpaths).
+  void QueueMissingSubpaths(const Graph& gr, const vector<int>& path, Scratch& sc);
+  void AlignQueuedSubpaths(const Graph& gr, Scratch& sc);
 
   vector<vector<pair<int, logdouble> > >& GetExactReadProbabilities(
       const Graph& gr, const vector<int>& path, int ps, int& total_len,
@@ -489,6 +595,13 @@ class PacbioReadSet {
   void SaveAligments();
   void NormalizeCache(const Graph& gr);
 
+  // Per-read probabilities of every interval-th evaluation are appended to
+  // filename in binary form (read names go to filename.names). Off by default.
+  void SetDiagnostics(const string& filename, int interval);
+  void WriteDiagnostics(const vector<logdouble>& read_probs);
+  // Writes out buffered records and closes the file.
+  void CloseDiagnostics();
+
   int GetMaxReadLen() const {
     return max_read_len_;
   }
@@ -536,6 +649,58 @@ class PacbioReadSet {
 
   void FilterReads(string out_filename, const unordered_set<int>& filter);
 
+  // missing: (begin, end) node intervals of path, overlapping ones are merged
+  void QueueMissing(const vector<int>& path, vector<pair<int, int> >& missing,
+                    unordered_set<vector<int> >& queued);
+  // Locks the cache and aligns those queued subpaths which still miss some
+  // of their subpaths.
+  void AlignQueued(const Graph& gr, unordered_set<vector<int> >& queued);
+  // Callers of both hold cache_lock_ exclusively.
+  void AlignSubpathsBatch(const Graph& gr, const vector<vector<int> >& paths);
+
+  // Alignments of all subpaths of one path grouped by the subpath start node.
+  // Positions are relative to the start node, so a group can be reused by
+  // another path which has the same nodes path[i..last[i]].
+  struct PathPlacements {
+    vector<int> path;
+    vector<int> last;
+    vector<int> offsets;
+    vector<PacbioAligment> placements;
+    int stamp;
+  };
+
+ public:
+  // Scratch of GetReadProbabilities with placements of recently scored
+  // paths. Kept by the caller, so several threads can score against one read
+  // set.
+  struct Scratch {
+    Scratch() : placements_stamp(0) {}
+    vector<vector<pair<pair<int, int>, logdouble> > > positions;
+    vector<int> touched_reads;
+    vector<PathPlacements> placements;
+    unordered_map<int, vector<int> > placements_by_first;
+    unordered_map<int, vector<int> > placements_by_last;
+    int placements_stamp;
+    unordered_set<vector<int> > queued_subpaths;
+  };
+
+ private:
+
+  // begins: node begin positions in path plus total length at the end,
+  // last[i]: last node of the subpaths starting at node i
+  void GetSubpathBounds(const Graph& gr, const vector<int>& path,
+                        vector<int>& begins, vector<int>& last) const;
+  // Finds the stored path sharing most subpath groups with path, reuse[i] is
+  // the group index in it or -1. Returns the stored path index or -1.
+  int FindReusablePlacements(const vector<int>& path, const vector<int>& last,
+                             vector<int>& reuse, const Scratch& sc) const;
+  void FindMissingSubpaths(const vector<int>& path, const vector<int>& last,
+                           const vector<int>& reuse,
+                           vector<pair<int, int> >& missing) const;
+  // Returns index of the stored placements.
+  int StorePlacements(const vector<int>& path, const vector<int>& last,
+                      const vector<int>& reuse, int source, Scratch& sc) const;
+
   int GetReadId(const string& read_name) {
     if (read_map_.count(read_name) == 0) {
       if (load_success_) {
@@ -581,15 +746,22 @@ class PacbioReadSet {
   int max_read_len_;
   unordered_map<string, int> read_map_;
   unordered_map<int, string> read_map_inv_;
+  // scratch of aligner runs, used under an exclusive cache_lock_
   vector<vector<pair<int, logdouble> > > positions_;
-  vector<vector<pair<pair<int, int>, logdouble> > > positions2_;
   vector<string> read_seq_;
+  bool stream_reads_;
+  PackedReadStore read_store_;
+  // Entries are never changed once filled, like in ReadSet.
   unordered_map<vector<int>, vector<PacbioAligment> > aligment_cache_;
+  mutable SharedMutex cache_lock_;
+  mutex diag_lock_;
+  string diag_filename_;
+  int diag_interval_;
+  int diag_calls_;
+  FILE* diag_file_;
+  vector<double> diag_buffer_;
  public:
-  unordered_map<int, unordered_set<int> > anchors_cache_;
-  unordered_map<int, unordered_set<int> > anchors_begin_;
-  unordered_map<int, unordered_set<int> > anchors_end_;
-  unordered_map<int, unordered_set<int> > anchors_reverse_;
+  AnchorIndex anchors_;
 };
 
 double CalcScoreForPath(const Graph& gr, const vector<int>& path, int kmer,
@@ -610,24 +782,64 @@ double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
                          double min_prob_per_base=-0.7, double min_prob_start=-10);
 
 struct ScoringState {
-  vector<vector<int>> old_paths;
+  // paths the probs are for
+  PathSet old_paths;
   int bad_bases;
   vector<double> probs;
 
   ScoringState() : bad_bases(0) {
   }
+  template<class Archive>
+  void serialize(Archive & ar, const unsigned int version) {
+    ar & old_paths;
+    ar & bad_bases;
+    ar & probs;
+  }
 };
 
-double CalcScoreForPathsNew(const Graph& gr, const vector<vector<int>>& paths,
+// Score of paths for paired reads, which are scoring_state.old_paths with
+// the paths erased taken out and the paths added put in. total_len is the
+// length of paths. With commit scoring_state moves to paths (probs changed
+// are appended to log with their old values when it is given), otherwise it
+// is left bit for bit as it was.
+double CalcScoreForPathsNew(const Graph& gr, const PathSet& paths,
+                            const vector<vector<int>>& erased,
+                            const vector<vector<int>>& added, int total_len,
                             ReadSet& read_set1, ReadSet& read_set2, 
                             double insert_mean, double insert_std,
-                            int& zero_reads, int& total_len,
-                            ScoringState& scoring_state, 
+                            int& zero_reads, ScoringState& scoring_state,
+                            bool commit, vector<pair<int, double>>* log,
                             bool use_caching = true,
                             double no_cov_penalty=0.0, double exp_cov_move=0.75,
                             bool use_all_to_cov=false,
                             double min_prob_per_base=-0.7, double min_prob_start=-10);
 
+int GetPathLen(const Graph& gr, const vector<int>& p);
+int GetTotalLen(const Graph& gr, const PathSet& paths);
+
+
+// Mate pairs of one library spanning a gap: for every read pair the insert
+// length it would have with an empty gap and the probability of both
+// alignments, one entry per placement.
+struct GapPairs {
+  double insert_mean;
+  double insert_std;
+  double weight;
+  vector<vector<pair<int, double>>> placements;
+  // probability a pair counts with at least
+  vector<double> floors;
+};
+
+// Pairs with the forward read in left and the reverse one in right, where
+// left is followed by the gap and right comes after it.
+void GetGapSpanningPairs(const Graph& gr, const vector<int>& left, const vector<int>& right,
+                         ReadSet& read_set1, ReadSet& read_set2,
+                         double min_prob_per_base, double min_prob_start,
+                         GapPairs& pairs);
+
+// Gap length (at least 1) maximizing the insert length likelihood of the
+// pairs, -1 when there are none.
+int EstimateGapLength(const vector<GapPairs>& libs);
 
 double CalcScoreForPaths(const Graph& gr, const vector<vector<int>>& paths,
                          ReadSet& read_set1, 
@@ -656,5 +868,44 @@ double CalcScoreForPacbio(const Graph& gr, vector<vector<int> > paths,
                           double no_cov_penalty=0.0, double exp_cov_move=0.75,
                           double min_prob_per_base=-0.7, double min_prob_start=-10);
 
+// Contribution of one path to the score of a read set: probabilities of
+// reads placed on it (in the order they are added up), its length and bases
+// without coverage.
+template<class T>
+struct PathScore {
+  PathScore() : total_len(0), bad_bases(0) {}
+  vector<pair<int, T>> probs;
+  int total_len;
+  int bad_bases;
+};
+
+// Scores of recently evaluated paths. A path set which differs from the last
+// one in a few paths only scores those, the rest is summed up from here.
+// Scores are never changed once made, so they are shared by copies of the
+// cache and by the per path scores callers keep.
+template<class T>
+struct PathScoreCache {
+  unordered_map<vector<int>, shared_ptr<const PathScore<T>>> scores;
+};
+
+// Score of paths for single reads. scores[i] is the score of paths[i] or
+// null when it is not known, then it is taken from cache (scored when
+// missing) and filled in.
+double CalcScoreForPathsNew(const Graph& gr, const PathSet& paths,
+                            vector<shared_ptr<const PathScore<double>>>& scores,
+                            ReadSet& read_set1,
+                            int& zero_reads, int& total_len,
+                            PathScoreCache<double>& cache, PositionsScratch& scratch,
+                            double min_prob_per_base=-0.7, double min_prob_start=-10);
+
+// Same for PacBio reads.
+double CalcScoreForPacbioNew(const Graph& gr, const PathSet& paths,
+                             vector<shared_ptr<const PathScore<logdouble>>>& scores,
+                             PacbioReadSet& read_set, int& zero_reads, int& total_len,
+                             PathScoreCache<logdouble>& cache,
+                             PacbioReadSet::Scratch& scratch,
+                             double no_cov_penalty=0.0, double exp_cov_move=0.75,
+                             double min_prob_per_base=-0.7, double min_prob_start=-10);
+
 
 #endif
@@ -320,6 +320,7 @@ void GetGraphFromAssembly(string filename, Graph& gr, vector<vector<int>>& paths
     assert(gr.nodes[renumber[e.second[0]]] == NULL);
     gr.nodes[renumber[e.second[0]]] = node;
   }
+  gr.BuildCompact();
   printf("gr done %d\n", gr.nodes.size());
   for (auto &s: scaffolds) {
     vector<int> path;
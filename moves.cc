@@ -1,14 +1,16 @@
 #include "moves.h"
+#include <map>
 #include <set>
 
-bool BreakPath(vector<vector<int> >&new_paths, Graph& gr, int threshold) {
+bool BreakPath(PathSet& new_paths, Graph& gr, int threshold,
+               default_random_engine& gen) {
   printf("break\n");
   vector<pair<int, pair<int, int> > > options;
   for (int i = 0; i < new_paths.size(); i++) {
     if (new_paths[i].size() <= 1) continue;
     int last = -1;
     for (int j = 0; j < new_paths[i].size(); j++) {
-      if (new_paths[i][j] >= 0 && gr.nodes[new_paths[i][j]]->s.length() > threshold) {
+      if (new_paths[i][j] >= 0 && gr.NodeLen(new_paths[i][j]) > threshold) {
         if (last != -1) {
           options.push_back(make_pair(i, make_pair(last, j)));
         }
@@ -20,7 +22,7 @@ bool BreakPath(vector<vector<int> >&new_paths, Graph& gr, int threshold) {
     return false;
   }
 
-  int opt = rand()%options.size();
+  int opt = RandomInt(gen, options.size());
   int path_id = options[opt].first;
   vector<int> path = new_paths[path_id];
   bool has_minus = false;
@@ -40,11 +42,12 @@ bool BreakPath(vector<vector<int> >&new_paths, Graph& gr, int threshold) {
   return true;
 }
 
-bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
-                  int path_id, int ps, int pt, ProbCalculator& prob_calc) {
+bool LocalChange2(PathSet& new_paths, Graph& gr, int threshold,
+                  int path_id, int ps, int pt, ProbCalculator& prob_calc,
+                  default_random_engine& gen) {
   vector<int> path = new_paths[path_id];
-  assert(gr.nodes[path[ps]]->s.length() > threshold);
-  assert(gr.nodes[path[pt]]->s.length() > threshold);
+  assert(gr.NodeLen(path[ps]) > threshold);
+  assert(gr.NodeLen(path[pt]) > threshold);
   int elength = threshold;
   bool gap = false;
   for (int i = ps+1; i < pt; i++) {
@@ -52,13 +55,20 @@ bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
       elength += -path[i];
       gap = true;
     } else {
-      elength += gr.nodes[path[i]]->s.length();
+      elength += gr.NodeLen(path[i]);
     }
   }
   printf("local 2 %d %d %d %d\n", ps, pt, path[ps], path[pt]);
   new_paths.erase(new_paths.begin() + path_id);
   new_paths.push_back(vector<int>(path.begin() + pt, path.end()));
   new_paths.push_back(vector<int>(path.begin(), path.begin() + ps + 1));
+  // on failure new_paths is put back as it was, so callers need no copy
+  auto rollback = [&]() {
+    new_paths.pop_back();
+    new_paths.pop_back();
+    new_paths.insert(new_paths.begin() + path_id, path);
+    return false;
+  };
 
   int expect = path[pt];
   int max_extend = (pt - ps)*2;
@@ -69,34 +79,34 @@ bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
     printf("lp %d ss %d me %d ta %d el %d exp %d\n", last_path.size(), start_size, max_extend, total_added,
         elength, expect);
     if ((last_path.size() > start_size + max_extend && gap == false) || total_added > 3*elength) {
-      return false;
+      return rollback();
     }
     vector<vector<int> > cand_ends;
     vector<int> cand_add;
     for (int i = 0; i < 2; i++) {
       vector<int> cp = last_path;
-      Node* next = NULL;
+      int next = -1;
       int added_l = 0;
       while (true) {
         int fails = 0;
         while (true) {
           if (fails >= 20)
-            return false;
-          next = gr.nodes[cp.back()]->SampleNext();
-          if (next == NULL) return false;
+            return rollback();
+          next = gr.SampleNext(cp.back(), gen);
+          if (next < 0) return rollback();
           fails++;
-          if (next->s.length() > 2*elength && next->id != expect) {
+          if (gr.NodeLen(next) > 2*elength && next != expect) {
             continue;
           }
-          if (gr.reach_limit_[next->id].count(expect) || next->id == expect) {
+          if (gr.reach_limit_.HasTarget(next, expect) || next == expect) {
             break;
           }
         }
-        cp.push_back(next->id);
-        if (next->id == expect) {
+        cp.push_back(next);
+        if (next == expect) {
           break;
         }
-        added_l += next->s.length();
+        added_l += gr.NodeLen(next);
         if (added_l > 200) {
           break;
         }
@@ -106,8 +116,9 @@ bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
     }
     vector<double> scores;
     for(int i = 0; i < cand_ends.size(); i++) {
-      new_paths[new_paths.size()-1] = cand_ends[i];
-      double score = prob_calc.CalcProb(new_paths);
+      PathEdit edit;
+      edit.Replace(new_paths.size()-1, cand_ends[i]);
+      double score = prob_calc.EvalEdit(new_paths, edit);
       printf("ev %d: %lf\n", i, score);
       scores.push_back(score);
     }
@@ -119,21 +130,22 @@ bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
     }
     last_path = cand_ends[best];
     total_added += cand_add[best];
-    new_paths[new_paths.size()-1] = last_path;
+    new_paths.Set(new_paths.size()-1, last_path);
   }
   assert(new_paths[new_paths.size()-1].back() == new_paths[new_paths.size()-2][0]);
   vector<int> op = new_paths.back();
   for (int i = 1; i < new_paths[new_paths.size()-2].size(); i++) {
     op.push_back(new_paths[new_paths.size()-2][i]);
   }
-  new_paths[new_paths.size()-2] = op;
+  new_paths.Set(new_paths.size()-2, op);
   new_paths.pop_back();
   return true;
 }
 
-bool FixMultiLocal(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
+bool FixMultiLocal(PathSet& new_paths, Graph& gr, int threshold,
+                   default_random_engine& gen) {
   printf("fix multi local\n");
-  int path_id = rand()%new_paths.size();
+  int path_id = RandomInt(gen, new_paths.size());
   vector<int> path = new_paths[path_id];
   unordered_map<int, vector<int> > poses;
   for (int i = 0; i < path.size(); i++) {
@@ -148,7 +160,7 @@ bool FixMultiLocal(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
     }
   }
   if (opts.size() == 0) return false;
-  pair<int, pair<int, int>> opt = opts[rand()%opts.size()];
+  pair<int, pair<int, int>> opt = opts[RandomInt(gen, opts.size())];
   vector<int> npath(path);
   int pp = opt.first;
   for (int i = opt.second.first; i < opt.second.second; i++, pp++) {
@@ -158,13 +170,14 @@ bool FixMultiLocal(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
     npath[pp] = path[i];
   }
   assert(pp == opt.second.second);
-  new_paths[path_id] = npath;
+  new_paths.Set(path_id, npath);
   return true;
 }
 
-bool FixRep(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
+bool FixRep(PathSet& new_paths, Graph& gr, int threshold,
+            default_random_engine& gen) {
   printf("fix rep\n");
-  int path_id = rand()%new_paths.size();
+  int path_id = RandomInt(gen, new_paths.size());
   vector<int> path = new_paths[path_id];
   unordered_map<int, vector<int> > poses;
   for (int i = 0; i < path.size(); i++) {
@@ -179,23 +192,23 @@ bool FixRep(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
     }
   }
   if (opts.size() == 0) return false;
-  pair<int, int> opt = opts[rand()%opts.size()];
-  if (rand() % 4 == 0) { // double
+  pair<int, int> opt = opts[RandomInt(gen, opts.size())];
+  if (RandomInt(gen, 4) == 0) { // double
     vector<int> path2(path.begin(), path.begin() + opt.second);
     path2.insert(path2.end(), path.begin() + opt.first, path.begin() + opt.second);
     path2.insert(path2.end(), path.begin() + opt.second, path.end());        
-    new_paths[path_id] = path2;
+    new_paths.Set(path_id, path2);
     return true;
   } else {  // remove
     vector<int> path2(path.begin(), path.begin() + opt.first);
     path2.insert(path2.end(), path.begin() + opt.second, path.end());
-    new_paths[path_id] = path2;
+    new_paths.Set(path_id, path2);
     return true;
   }
 }
 
-bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int &path_id,
-    int &xx, int &yy, ProbCalculator& prob_calc) {
+bool LocalChange(PathSet& new_paths, Graph& gr, int threshold, int &path_id,
+    int &xx, int &yy, ProbCalculator& prob_calc, default_random_engine& gen) {
 /*  int r = rand() % 6;
   if (r <= 1) {
     path_id = -1;
@@ -215,15 +228,15 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
     vector<pair<int, int>> lp;
     int pos = 0;
     for (int j = 0; j < new_paths[i].size(); j++) {
-      if (new_paths[i][j] >= 0 && gr.nodes[new_paths[i][j]]->s.length() > threshold) {
+      if (new_paths[i][j] >= 0 && gr.NodeLen(new_paths[i][j]) > threshold) {
         lp.push_back(make_pair(pos, j));
       }
       if (new_paths[i][j] < 0) pos += -new_paths[i][j];
-      else pos += gr.nodes[new_paths[i][j]]->s.length();
+      else pos += gr.NodeLen(new_paths[i][j]);
     }
 /*    int last = -1;
     for (int j = 0; j < new_paths[i].size(); j++) {
-      if (new_paths[i][j] >= 0 && gr.nodes[new_paths[i][j]]->s.length() > threshold) {
+      if (new_paths[i][j] >= 0 && gr.NodeLen(new_paths[i][j]) > threshold) {
         if (last != -1 && j - last > 1) {
           options.push_back(make_pair(i, make_pair(last, j)));
         }
@@ -245,7 +258,7 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
     return false;
   }
   bool has_gap = false;
-  int opt = rand() % options.size();
+  int opt = RandomInt(gen, options.size());
   printf("aaa %d %d %d %d\n", options[opt].first, options[opt].second.first,
          options[opt].second.second, new_paths.size());
   printf("%d\n", new_paths[options[opt].first].size());
@@ -253,25 +266,25 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
   printf("pick ");
   for (int i = options[opt].second.first; i <= options[opt].second.second; i++) {
     if (i > options[opt].second.first && new_paths[path_id][i-1] >= 0 && new_paths[path_id][i] >=0 ) {
-      if (!gr.nodes[new_paths[path_id][i-1]]->HasNext(new_paths[path_id][i])) {
+      if (!gr.HasEdge(new_paths[path_id][i-1], new_paths[path_id][i])) {
         printf("wtf %d %d: %d %d\n", path_id, i, new_paths[path_id][i-1], new_paths[path_id][i]);
       }
-      assert(gr.nodes[new_paths[path_id][i-1]]->HasNext(new_paths[path_id][i]));
+      assert(gr.HasEdge(new_paths[path_id][i-1], new_paths[path_id][i]));
     }
     printf("%d", new_paths[path_id][i]);
     if (new_paths[path_id][i] >= 0)
-      printf("(%d)", gr.nodes[new_paths[path_id][i]]->s.length());
+      printf("(%d)", gr.NodeLen(new_paths[path_id][i]));
     else
       has_gap = true;
     printf(" ");
   }
   printf("\n");
-  if ((options[opt].second.second - options[opt].second.first > 7 || has_gap) && rand() % 2 <= 1) {
+  if ((options[opt].second.second - options[opt].second.first > 7 || has_gap) && RandomInt(gen, 2) <= 1) {
     path_id = -1;
     return LocalChange2(
         new_paths, gr, threshold, options[opt].first,
         options[opt].second.first, options[opt].second.second,
-        prob_calc);
+        prob_calc, gen);
   }
   printf("local\n");
   vector<int> path = new_paths[path_id];
@@ -283,22 +296,22 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
   for (int extend = 0;
       extend < 2*(options[opt].second.second - options[opt].second.first + 1);
       extend++) {
-    Node *next = NULL;
+    int next = -1;
     int tries = 0;
     while (true) {
       tries++;
       if (tries > 100) return false;
-      next = gr.nodes[p2.back()]->SampleNext();
-      if (next == NULL) return false;
-      if (gr.reach_limit_[next->id].count(t) || next->id == t) {
+      next = gr.SampleNext(p2.back(), gen);
+      if (next < 0) return false;
+      if (gr.reach_limit_.HasTarget(next, t) || next == t) {
         break;
       }
     }
-    if (next->id == t) {
+    if (next == t) {
       found = true;
       break;
     }
-    p2.push_back(next->id);
+    p2.push_back(next);
   }
   if (!found) {
     return false;
@@ -307,14 +320,14 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
   for (int i = options[opt].second.second; i < path.size(); i++) {
     p2.push_back(path[i]);
   }
-  new_paths[path_id] = p2;
+  new_paths.Set(path_id, p2);
   printf("done ");
   for (int i = xx; i <= yy; i++) {
     if (i > xx)
-      assert(gr.nodes[new_paths[path_id][i-1]]->HasNext(new_paths[path_id][i]));
+      assert(gr.HasEdge(new_paths[path_id][i-1], new_paths[path_id][i]));
     printf("%d", new_paths[path_id][i]);
     if (new_paths[path_id][i] >= 0)
-      printf("(%d)", gr.nodes[new_paths[path_id][i]]->s.length());
+      printf("(%d)", gr.NodeLen(new_paths[path_id][i]));
     printf(" ");
   }
   printf("\n");
@@ -323,9 +336,10 @@ bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int
   return true;
 }
 
-bool FixSelfLoops(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
+bool FixSelfLoops(PathSet& new_paths, Graph& gr, int threshold,
+                  default_random_engine& gen) {
   printf("fix self\n");
-  int path_id = rand()%new_paths.size();
+  int path_id = RandomInt(gen, new_paths.size());
   vector<int> path = new_paths[path_id];
 /*  printf("path %d: ", path_id);
   for (auto &p: path)
@@ -334,36 +348,37 @@ bool FixSelfLoops(vector<vector<int> >& new_paths, Graph& gr, int threshold) {
   vector<int> opts;
   for (int i = 0; i < path.size(); i++) {
     if (path[i] < 0) continue;
-    if (gr.reach_self_[path[i]].size() > 0) {
+    if (gr.reach_self_.NumLoops(path[i]) > 0) {
 //      printf("push %d ", path[i]);
       opts.push_back(i);
     }
   }
 //  printf("\n");
   if (opts.size() == 0) return false;
-  int opt = opts[rand()%opts.size()];
+  int opt = opts[RandomInt(gen, opts.size())];
 //  printf("try %d\n", path[opt]);
   vector<int> path2(path.begin(), path.begin()+opt);
-  vector<int> ip = gr.reach_self_[path[opt]][rand()% gr.reach_self_[path[opt]].size()];
+  vector<int> ip = gr.reach_self_.GetLoop(path[opt], RandomInt(gen, gr.reach_self_.NumLoops(path[opt])));
   path2.insert(path2.end(), ip.begin(), ip.end());
   path2.insert(path2.end(), path.begin()+opt, path.end());
 /*  printf("new path %d: ", path_id);
   for (auto &p: path2)
     printf("%d ", p);
   printf("\n");*/
-  new_paths[path_id] = path2;
+  new_paths.Set(path_id, path2);
   return true;
 }
 
-bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
+bool ExtendPathsAlt(PathSet& paths, Graph& gr, int threshold,
+                    const ReachOverrides& reach, default_random_engine& gen) {
   for (int i = 0; i < paths.size(); i++) {
-    if (rand() % 2 == 0) {
-      ReversePath(paths[i]);
+    if (RandomInt(gen, 2) == 0) {
+      ReversePath(paths.Mutable(i));
     }
   }
 
-  int rp = rand()%paths.size();
-  int rev = rand()%2;
+  int rp = RandomInt(gen, paths.size());
+  int rev = RandomInt(gen, 2);
   vector<int> path = paths[rp];
   paths.erase(paths.begin()+rp);
   if (rev) {
@@ -375,7 +390,7 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
     path_ends[paths[i][0]].push_back(i+1);
     path_ends[paths[i].back()^1].push_back(-(i+1));
     for (int j = 1; j < paths[i].size() - 1; j++) {
-      if (paths[i][j] >= 0 && gr.nodes[paths[i][j]]->s.length() > threshold) {
+      if (paths[i][j] >= 0 && gr.NodeLen(paths[i][j]) > threshold) {
         path_poses[paths[i][j]].push_back(make_pair(i, j));
         path_poses[paths[i][j]^1].push_back(make_pair(i, j));
       }
@@ -384,40 +399,38 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
   bool found = false;
   int join = 0;
   if (path_ends.count(path.back()) && path.size() > 1) {
-    join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+    join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
     found = true;
   }
   if (!found) {
     int add_length = 0;
     while (true) {
-      vector<int> next_cand;                                                                    
-      for (auto &e: gr.reach_big_[path.back()]) {                                               
-        next_cand.push_back(e.first);                                                           
-      }                                                                                         
+      vector<int> next_cand = gr.reach_big_.GetTargets(path.back());
       if (next_cand.empty() && add_length == 0) { 
         return false;
       }
       if (next_cand.empty()) {
         break;
       }
-      int next = next_cand[rand()%next_cand.size()];
+      int next = next_cand[RandomInt(gen, next_cand.size())];
       int s = path.back();                                                                      
-      for (int i = 0; i < gr.reach_big_[s][next].size(); i++) { 
-        path.push_back(gr.reach_big_[s][next][i]);
-        add_length += gr.nodes[path.back()]->s.length();
-      }                                                                                         
+      vector<int> between = gr.reach_big_.GetPath(s, next, reach.big);
+      for (int i = 0; i < between.size(); i++) {
+        path.push_back(between[i]);
+        add_length += gr.NodeLen(path.back());
+      }
       path.push_back(next);  
-      add_length += gr.nodes[path.back()]->s.length();
+      add_length += gr.NodeLen(path.back());
       double p = exp(-add_length / 1000.0);
       uniform_real_distribution<double> dist(0.0, 1.0);
-      double samp = dist(generator);
+      double samp = dist(gen);
       if (samp > p) {
         break;
       }
     }
   }
   if (path_ends.count(path.back())) {
-    join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+    join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
     vector<int> join_path;
     int join_num;
     if (join < 0) {
@@ -445,7 +458,7 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
   if (path_poses[path.back()].empty()) {
     return false;
   }
-  pair<int, int> pp = path_poses[path.back()][rand()%path_poses[path.back()].size()];
+  pair<int, int> pp = path_poses[path.back()][RandomInt(gen, path_poses[path.back()].size())];
   if (paths[pp.first][pp.second] == path.back()) {
     vector<int> path2 = paths[pp.first];
     paths.erase(paths.begin() + pp.first);
@@ -458,7 +471,7 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
       path_ends[paths[i][0]].push_back(i+1);
       path_ends[paths[i].back()^1].push_back(-(i+1));
       for (int j = 1; j < paths[i].size() - 1; j++) {
-        if (paths[i][j] >= 0 && gr.nodes[paths[i][j]]->s.length() > threshold) {
+        if (paths[i][j] >= 0 && gr.NodeLen(paths[i][j]) > threshold) {
           path_poses[paths[i][j]].push_back(make_pair(i, j));
           path_poses[paths[i][j]^1].push_back(make_pair(i, j));
         }
@@ -470,7 +483,7 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
     found = false;
     int join = 0;
     if (path_ends.count(path.back()) && path.size() > 1) {
-      join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+      join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
       found = true;
     }
     if (!found) {
@@ -479,34 +492,32 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
       for (int tries = 0; tries < 5; tries++) {
         path = path_zal;
         while (true) {
-          vector<int> next_cand;                                                                    
-          for (auto &e: gr.reach_big_[path.back()]) {                                               
-            next_cand.push_back(e.first);                                                           
-          }                                                                                         
+          vector<int> next_cand = gr.reach_big_.GetTargets(path.back());
           if (next_cand.empty() && add_length == 0) { 
             return false;
           }
           if (next_cand.empty()) {
             break;
           }
-          int next = next_cand[rand()%next_cand.size()];
+          int next = next_cand[RandomInt(gen, next_cand.size())];
           int s = path.back();                                                                      
-          for (int i = 0; i < gr.reach_big_[s][next].size(); i++) { 
-            path.push_back(gr.reach_big_[s][next][i]);
-            add_length += gr.nodes[path.back()]->s.length();
-          }                                                                                         
+          vector<int> between = gr.reach_big_.GetPath(s, next, reach.big);
+          for (int i = 0; i < between.size(); i++) {
+            path.push_back(between[i]);
+            add_length += gr.NodeLen(path.back());
+          }
           path.push_back(next);  
-          add_length += gr.nodes[path.back()]->s.length();
+          add_length += gr.NodeLen(path.back());
           double p = exp(-add_length / 1000.0);
           uniform_real_distribution<double> dist(0.0, 1.0);
-          double samp = dist(generator);
+          double samp = dist(gen);
           if (samp > p) {
             break;
           }
         }
       }
       if (path_ends.count(path.back())) {
-        join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+        join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
         vector<int> join_path;
         int join_num;
         if (join < 0) {
@@ -540,12 +551,13 @@ bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold) {
   return false;
 }
 
-bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
-    ProbCalculator& prob_calc) {
-  if (rand() % 7 == 0) {
+bool ExtendPaths(PathSet& new_paths, Graph& gr, int threshold,
+    const ReachOverrides& reach, ProbCalculator& prob_calc,
+    default_random_engine& gen) {
+  if (RandomInt(gen, 7) == 0) {
     for (int i = 0; i < 5; i++) {
-      vector<vector<int> > pp = new_paths;
-      if (ExtendPathsAlt(pp, gr, threshold)) {
+      PathSet pp = new_paths;
+      if (ExtendPathsAlt(pp, gr, threshold, reach, gen)) {
         new_paths = pp;
         return true;
       }
@@ -554,8 +566,8 @@ bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
   }
   printf("extend normal\n");
   bool found = false;
-  int rp = rand()%new_paths.size();
-  int rev = rand()%2;
+  int rp = RandomInt(gen, new_paths.size());
+  int rev = RandomInt(gen, 2);
   vector<int> path = new_paths[rp];
   int ps = path.size() - 1;
   if (rev == 1) {
@@ -575,42 +587,40 @@ bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
   int join = 0;
   pair<int, int> inner_join(-1, -1);
   if (path_ends.count(path.back()) && new_paths[rp].size() > 1) {
-    join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+    join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
     found = true;
   }
   if (!found) {
     int add_length = 0;
     while (true) {
-      vector<int> next_cand;                                                                    
-      for (auto &e: gr.reach_big_[path.back()]) {                                               
-        next_cand.push_back(e.first);                                                           
-      }                                                                                         
+      vector<int> next_cand = gr.reach_big_.GetTargets(path.back());
       if (next_cand.empty() && add_length == 0) { 
         return false;
       }
       if (next_cand.empty()) {
         break;
       }
-      int next = next_cand[rand()%next_cand.size()];
+      int next = next_cand[RandomInt(gen, next_cand.size())];
       int s = path.back();                                                                      
-      for (int i = 0; i < gr.reach_big_[s][next].size(); i++) { 
-        path.push_back(gr.reach_big_[s][next][i]);
-        add_length += gr.nodes[path.back()]->s.length();
-      }                                                                                         
+      vector<int> between = gr.reach_big_.GetPath(s, next, reach.big);
+      for (int i = 0; i < between.size(); i++) {
+        path.push_back(between[i]);
+        add_length += gr.NodeLen(path.back());
+      }
       path.push_back(next);  
-      add_length += gr.nodes[path.back()]->s.length();
+      add_length += gr.NodeLen(path.back());
       double p = exp(-add_length / 1000.0);
       uniform_real_distribution<double> dist(0.0, 1.0);
-      double samp = dist(generator);
+      double samp = dist(gen);
       if (samp > p) {
         break;
       }
     }
     if (path_ends.count(path.back())) {
-      join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+      join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
       found = true;
     }
-    if (rand() % 5 == 0) {
+    if (RandomInt(gen, 5) == 0) {
       found = true;
     }
   }
@@ -655,9 +665,7 @@ bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
   if (!found) {
     return false;
   }
-  vector<vector<int>> paths2 = new_paths;
-  if (LocalChange2(paths2, gr, threshold, paths2.size() - 1, ps, pt, prob_calc)) {
-    new_paths = paths2;
+  if (LocalChange2(new_paths, gr, threshold, new_paths.size() - 1, ps, pt, prob_calc, gen)) {
     printf("local 2 ok\n");
   } else {
     printf("local 2 fail\n");
@@ -665,14 +673,14 @@ bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
   return true;
 }
 
-int SamplePathByLength(vector<vector<int> >& paths, Graph& gr) {
+int SamplePathByLength(PathSet& paths, Graph& gr, default_random_engine& gen) {
   vector<int> lens(paths.size());
   int ss = 0;
   for (int i = 0; i < paths.size(); i++) {
     for (int j = 0; j < paths[i].size(); j++) {
       if (paths[i][j] >= 0) {
-        lens[i] += gr.nodes[paths[i][j]]->s.length();
-//        ss += gr.nodes[paths[i][j]]->s.length();
+        lens[i] += gr.NodeLen(paths[i][j]);
+//        ss += gr.NodeLen(paths[i][j]);
       } else {
         lens[i] += -paths[i][j];
 //        ss += -paths[i][j];
@@ -681,7 +689,7 @@ int SamplePathByLength(vector<vector<int> >& paths, Graph& gr) {
     lens[i] = sqrt(lens[i]+10);
     ss += lens[i];
   }
-  int r = rand()%ss;
+  int r = RandomInt(gen, ss);
   ss = 0;
   for (int i = 0; i < lens.size(); i++) {
     ss += lens[i];
@@ -691,62 +699,142 @@ int SamplePathByLength(vector<vector<int> >& paths, Graph& gr) {
   return paths.size()-1;
 }
 
-void FixGapLength(vector<vector<int>>& paths, int path_id, int gap_pos,
-                  ProbCalculator& prob_calc, int lower, int upper) {
+// Scores of the path set with the gap at gap_pos set to various lengths.
+// Every length is scored once, asking again only sets the gap. Lengths are
+// scored as edits of the path, the other paths keep their scores.
+struct GapProbe {
+  GapProbe(PathSet& paths, int path_id, int gap_pos, ProbCalculator& prob_calc)
+      : paths(paths), base(paths), path_id(path_id), gap_pos(gap_pos),
+        prob_calc(prob_calc) {}
+
+  double Prob(int len) {
+    paths.Mutable(path_id)[gap_pos] = -len;
+    auto it = probs.find(len);
+    if (it != probs.end()) {
+      return it->second;
+    }
+    PathEdit edit;
+    edit.Replace(path_id, paths[path_id]);
+    return probs[len] = prob_calc.EvalEdit(base, edit);
+  }
+
+  PathSet& paths;
+  // paths as they were, the gap is changed by edits of them
+  const PathSet base;
+  int path_id;
+  int gap_pos;
+  ProbCalculator& prob_calc;
+  map<int, double> probs;
+};
+
+void FixGapLength(GapProbe& probe, int lower, int upper) {
   printf("fix inner %d %d\n", lower, upper);
   if (upper - lower <= 1) {
-    paths[path_id][gap_pos] = -lower;
+    probe.paths.Mutable(probe.path_id)[probe.gap_pos] = -lower;
     return;
   }
 
   if (upper - lower == 2) {
-    paths[path_id][gap_pos] = - ((upper+lower)/2);
-    paths[path_id][gap_pos] = -lower;
-    double low_p = prob_calc.CalcProb(paths);
-    double mid_p = prob_calc.CalcProb(paths);
-    if (mid_p > low_p) {
-      return;
-    } else {
-      paths[path_id][gap_pos] = -lower;
-      return;
+    double low_p = probe.Prob(lower);
+    double mid_p = probe.Prob((upper+lower)/2);
+    if (mid_p <= low_p) {
+      probe.Prob(lower);
     }
+    return;
   }
 
   int mid1 = lower + (upper - lower)/3;
   int mid2 = lower + (upper - lower)/3*2;
-  paths[path_id][gap_pos] = -mid1;
-  double mid1_p = prob_calc.CalcProb(paths);
-  paths[path_id][gap_pos] = -mid2;
-  double mid2_p = prob_calc.CalcProb(paths);
+  double mid1_p = probe.Prob(mid1);
+  double mid2_p = probe.Prob(mid2);
 
   if (mid1_p >= mid2_p) {
-    FixGapLength(paths, path_id, gap_pos, prob_calc, lower, mid2);
+    FixGapLength(probe, lower, mid2);
   } else {
-    FixGapLength(paths, path_id, gap_pos, prob_calc, mid1, upper);
+    FixGapLength(probe, mid1, upper);
   }
 }
 
-bool FixGapLength(vector<vector<int> >& paths, int path_id, int gap_pos,
+// Gap length from mate pairs spanning the gap at gap_pos, -1 when there are
+// none. Only the contigs next to the gap, up to the longest insert, are looked
+// at.
+int EstimateGapLength(PathSet& paths, int path_id, int gap_pos,
+                      ProbCalculator& prob_calc) {
+  const vector<int>& path = paths[path_id];
+  Graph& gr = prob_calc.gr;
+  int b = gap_pos, e = gap_pos + 1;
+  while (b > 0 && path[b-1] >= 0) b--;
+  while (e < path.size() && path[e] >= 0) e++;
+  if (b == gap_pos || e == gap_pos + 1) return -1;
+
+  vector<GapPairs> libs;
+  for (auto &lib: prob_calc.paired_reads) {
+    int reach = lib.first.insert_mean + 5*lib.first.insert_std;
+    int lb = gap_pos, re = gap_pos + 1;
+    for (int len = 0; lb > b && len < reach; lb--) {
+      len += gr.NodeLen(path[lb-1]);
+    }
+    for (int len = 0; re < e && len < reach; re++) {
+      len += gr.NodeLen(path[re]);
+    }
+    GapPairs pairs;
+    pairs.insert_mean = lib.first.insert_mean;
+    pairs.insert_std = lib.first.insert_std;
+    pairs.weight = lib.first.weight;
+    GetGapSpanningPairs(gr, vector<int>(path.begin() + lb, path.begin() + gap_pos),
+                        vector<int>(path.begin() + gap_pos + 1, path.begin() + re),
+                        *lib.second.first, *lib.second.second,
+                        lib.first.min_prob_per_base, lib.first.min_prob_start, pairs);
+    if (!pairs.placements.empty()) {
+      libs.push_back(pairs);
+    }
+  }
+  return EstimateGapLength(libs);
+}
+
+bool FixGapLength(PathSet& paths, int path_id, int gap_pos,
                   ProbCalculator& prob_calc, int prev_len) {
+  return FixGapLength(paths, path_id, gap_pos, prob_calc, prev_len, NAN);
+}
+
+bool FixGapLength(PathSet& paths, int path_id, int gap_pos,
+                  ProbCalculator& prob_calc, int prev_len, double cur_p) {
   // TRACTOOOOOOOOOOOOOOOOOOR
   int cur_length = -paths[path_id][gap_pos];
   printf("fix len %d %d %d\n", path_id, gap_pos, cur_length); 
   assert(cur_length > 0);
 
+  int est = EstimateGapLength(paths, path_id, gap_pos, prob_calc);
+  if (est == cur_length) {
+    return true;
+  }
+
+  GapProbe probe(paths, path_id, gap_pos, prob_calc);
+  if (isnan(cur_p)) {
+    cur_p = probe.Prob(cur_length);
+  } else {
+    probe.probs[cur_length] = cur_p;
+  }
+  if (est > 0) {
+    double est_p = probe.Prob(est);
+    printf("fix estimate %d %d %lf %lf\n", cur_length, est, cur_p, est_p);
+    if (est_p < cur_p) {
+      probe.Prob(cur_length);
+    }
+    return true;
+  }
+
   // 0 - minimum
   // 1 - go up
   // 2 - go down
   int state = 0;
-  double cur_p = prob_calc.CalcProb(paths);
-  paths[path_id][gap_pos] = -(cur_length + 1);
-  double up_p = prob_calc.CalcProb(paths);
+  double up_p = probe.Prob(cur_length + 1);
   if (cur_length == 1) {
     if (up_p > cur_p) {
       state = 1;
     }
   } else {
-    paths[path_id][gap_pos] = -(cur_length - 1);
-    double down_p = prob_calc.CalcProb(paths);
+    double down_p = probe.Prob(cur_length - 1);
     if (down_p > cur_p && cur_p > up_p) {
       state = 2;
     }
@@ -763,8 +851,7 @@ bool FixGapLength(vector<vector<int> >& paths, int path_id, int gap_pos,
     double last_p = cur_p;
     int upper_bound = cur_length * 2;
     while (true) {
-      paths[path_id][gap_pos] = -upper_bound;
-      double up_p = prob_calc.CalcProb(paths);
+      double up_p = probe.Prob(upper_bound);
       if (up_p < last_p) {
         break;
       }
@@ -772,10 +859,10 @@ bool FixGapLength(vector<vector<int> >& paths, int path_id, int gap_pos,
       upper_bound *= 2;
     }
     printf("fix upper bound %d %d\n", cur_length, upper_bound);
-    FixGapLength(paths, path_id, gap_pos, prob_calc, cur_length + 1, upper_bound);
+    FixGapLength(probe, cur_length + 1, upper_bound);
   }
   if (state == 2) {
-    FixGapLength(paths, path_id, gap_pos, prob_calc, 1, cur_length);
+    FixGapLength(probe, 1, cur_length);
   }
 
   /*int max_move = cur_length - 1;
@@ -784,31 +871,32 @@ bool FixGapLength(vector<vector<int> >& paths, int path_id, int gap_pos,
   }
   double cur_p = prob_calc.CalcProb(paths);
   for (int i = min(20, max_move); i >= 1; i--) {
-    paths[path_id][gap_pos] = -(cur_length - i);
+    paths.Mutable(path_id)[gap_pos] = -(cur_length - i);
     double minus_p = prob_calc.CalcProb(paths);
     if (minus_p > cur_p) {
       return FixGapLength(paths, path_id, gap_pos, prob_calc, cur_length);
     }
-    paths[path_id][gap_pos] = -(cur_length + i);
+    paths.Mutable(path_id)[gap_pos] = -(cur_length + i);
     double plus_p = prob_calc.CalcProb(paths);
     if (plus_p > cur_p) {
       return FixGapLength(paths, path_id, gap_pos, prob_calc, cur_length);
     }
-    paths[path_id][gap_pos] = -(cur_length);
+    paths.Mutable(path_id)[gap_pos] = -(cur_length);
   }*/
   return true;
 }
 
-bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
-                    PacbioReadSet& rs, int kmer, ProbCalculator& prob_calc) {
+bool ExtendPathsAdv(PathSet& paths, Graph&gr, int threshold,
+                    PacbioReadSet& rs, int kmer, const ReachOverrides& reach,
+                    ProbCalculator& prob_calc, default_random_engine& gen) {
   printf("extend adv\n");
-  int rp = SamplePathByLength(paths, gr);
+  int rp = SamplePathByLength(paths, gr, gen);
   printf("rp %d %d %d\n", rp, paths.size(), paths[rp].size());
   assert(rp < paths.size());
   vector<int> path = paths[rp];
   for (auto &e: path) printf("%d ", e);
   printf("\n");
-  int rev = rand()%2;
+  int rev = RandomInt(gen, 2);
   if (rev == 1) {
     for (int i = 0; i < path.size(); i++) {
       if (path[i] >= 0)
@@ -824,13 +912,13 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     path_v.insert(e^1);
   vector<pair<int, int> > cands;
   bool only_out = true;
-  if (rand() % 5 == 0) only_out = false;
+  if (RandomInt(gen, 5) == 0) only_out = false;
   bool allow_gaps = false;
-  if (rand() % 5 == 0) allow_gaps = true;
+  if (RandomInt(gen, 5) == 0) allow_gaps = true;
 
-  for (auto &r: rs.anchors_end_[path.back()]) {
-    for (auto &x: rs.anchors_reverse_[r]) {
-      if (gr.nodes[x]->s.length() > threshold)
+  for (auto &r: rs.anchors_.NodeReadsEnd(path.back())) {
+    for (auto &x: rs.anchors_.ReadNodesBegin(r)) {
+      if (gr.NodeLen(x) > threshold)
         cands.push_back(make_pair(x, r));
     }
   }
@@ -843,13 +931,13 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   }
 
   if (cands.empty()) return false;
-  pair<int, int> cand = cands[rand()%cands.size()];
+  pair<int, int> cand = cands[RandomInt(gen, cands.size())];
   int next = cand.first;
   bool gap = false;
   int gap_len = 0;
-  if (gr.reach_limit_[path.back()].count(next) == 0) {
+  if (!gr.reach_limit_.HasTarget(path.back(), next)) {
     gap = true;
-  } else if (allow_gaps && rand() % 2 == 0) {
+  } else if (allow_gaps && RandomInt(gen, 2) == 0) {
     gap = true;
   }
   if (gap) {
@@ -866,9 +954,8 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     path.push_back(-gap_len);
     path.push_back(next);
   } else {
-    for (int i = 0; i < gr.reach_limit_[s][next].size(); i++) { 
-      path.push_back(gr.reach_limit_[s][next][i]);
-    }                                                                                         
+    vector<int> between = gr.reach_limit_.GetPath(s, next, reach.limit);
+    path.insert(path.end(), between.begin(), between.end());
     path.push_back(next);
   }
   int pt = path.size() - 1;
@@ -876,10 +963,10 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   int join = 0;
   bool found = false;
   if (path_ends.count(path.back())) {
-    join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+    join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
     found = true;
   }
-  if (rand() % 5 == 0) {
+  if (RandomInt(gen, 5) == 0) {
     found = true;
   }
   if (!found) {
@@ -910,7 +997,6 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   } else {
     paths.push_back(path);
   }
-  vector<vector<int> > paths2 = paths;
   if (gap) {
     printf("adv done gap\n");
 /*    FixGapLength(paths, paths.size() - 1, gap_pos, prob_calc, -1);  
@@ -920,8 +1006,7 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     }*/
   } else {
     printf("adv done normal\n");
-    if (LocalChange2(paths2, gr, threshold, paths.size() - 1, ps, pt, prob_calc)) {
-      paths = paths2;
+    if (LocalChange2(paths, gr, threshold, paths.size() - 1, ps, pt, prob_calc, gen)) {
       printf("local 2 ok\n");
     } else {
       printf("local 2 fail\n");
@@ -930,12 +1015,13 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   return true;
 }
 
-bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
-                    ReadSet& rs1, ReadSet& rs2, int kmer, ProbCalculator& prob_calc) {
+bool ExtendPathsAdv(PathSet& paths, Graph&gr, int threshold,
+                    ReadSet& rs1, ReadSet& rs2, int kmer, const ReachOverrides& reach,
+                    ProbCalculator& prob_calc, default_random_engine& gen) {
   printf("extend adv\n");
-  int rp = SamplePathByLength(paths, gr);
+  int rp = SamplePathByLength(paths, gr, gen);
   vector<int> path = paths[rp];
-  int rev = rand()%2;
+  int rev = RandomInt(gen, 2);
   if (rev == 1) {
     for (int i = 0; i < path.size(); i++) {
       if (path[i] >= 0)
@@ -946,28 +1032,30 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   paths.erase(paths.begin()+rp);
 
   rs2.BuildAdviceIndex(gr, threshold);
-  unordered_map<int, vector<int> >& read_poses = rs2.GetAdviceIndex();
-  unordered_map<int, vector<int> >& read_poses_1 = rs2.GetAdviceIndex1();
+  const unordered_map<int, vector<int> >& read_poses_1 = rs2.GetAdviceIndex1();
 
   int tl1;
   unordered_set<int> path_v(path.begin(), path.end());
   for (auto &e: path)
     path_v.insert(e^1);
+  PositionsScratch sc;
   vector<vector<pair<int, pair<int, int> > > >& positions1 = 
-    rs1.GetPositions(gr, path, tl1);
+    rs1.GetPositions(gr, path, tl1, sc);
   vector<int> cands;
   bool only_out = true;
-  if (rand() % 5 == 0) only_out = false;
+  if (RandomInt(gen, 5) == 0) only_out = false;
   bool allow_gaps = false;
-  if (rand() % 5 == 0) allow_gaps = true;
+  if (RandomInt(gen, 5) == 0) allow_gaps = true;
 
   for (int i = 0; i < rs1.GetNumberOfReads(); i++) {
     if (positions1[i].empty()) continue;
     if (positions1[i][0].second.second != 0) continue;
-    for (int j = 0; j < read_poses_1[i].size(); j++) {
-      if (path_v.count(read_poses_1[i][j]) && only_out) continue;
-      if (gr.reach_limit_[path.back()].count(read_poses_1[i][j]) != 0 || allow_gaps) {
-        cands.push_back(read_poses_1[i][j]);
+    auto poses = read_poses_1.find(i);
+    if (poses == read_poses_1.end()) continue;
+    for (auto x: poses->second) {
+      if (path_v.count(x) && only_out) continue;
+      if (gr.reach_limit_.HasTarget(path.back(), x) || allow_gaps) {
+        cands.push_back(x);
       }
     } 
   }
@@ -977,10 +1065,12 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     for (int i = 0; i < rs1.GetNumberOfReads(); i++) {
       if (positions1[i].empty()) continue;
       if (positions1[i][0].second.second != 0) continue;
-      for (int j = 0; j < read_poses_1[i].size(); j++) {
-        if (path_v.count(read_poses_1[i][j]) && only_out) continue;
-        if (gr.reach_limit_[path.back()].count(read_poses_1[i][j]) != 0 || allow_gaps) {
-          cands.push_back(read_poses_1[i][j]);
+      auto poses = read_poses_1.find(i);
+      if (poses == read_poses_1.end()) continue;
+      for (auto x: poses->second) {
+        if (path_v.count(x) && only_out) continue;
+        if (gr.reach_limit_.HasTarget(path.back(), x) || allow_gaps) {
+          cands.push_back(x);
         }
       } 
     }
@@ -995,11 +1085,11 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   printf("cands len %d\n", cands.size());
 
   if (cands.empty()) return false;
-  int next = cands[rand()%cands.size()];
+  int next = cands[RandomInt(gen, cands.size())];
   bool gap = false;
-  if (gr.reach_limit_[path.back()].count(next) == 0) {
+  if (!gr.reach_limit_.HasTarget(path.back(), next)) {
     gap = true;
-  } else if (allow_gaps && rand() % 2 == 0) {
+  } else if (allow_gaps && RandomInt(gen, 2) == 0) {
     printf("force gap\n");
     gap = true;
   }
@@ -1012,9 +1102,8 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     path.push_back(-21);
     path.push_back(next);
   } else {
-    for (int i = 0; i < gr.reach_limit_[s][next].size(); i++) { 
-      path.push_back(gr.reach_limit_[s][next][i]);
-    }                                                                                         
+    vector<int> between = gr.reach_limit_.GetPath(s, next, reach.limit);
+    path.insert(path.end(), between.begin(), between.end());
     path.push_back(next);
   }
   int pt = path.size() - 1;
@@ -1022,7 +1111,7 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   int join = 0;
   bool found = false;
   if (path_ends.count(path.back())) {
-    join = path_ends[path.back()][rand()%path_ends[path.back()].size()];
+    join = path_ends[path.back()][RandomInt(gen, path_ends[path.back()].size())];
     found = true;
   }
 /*  if (rand() % 5 == 0) {
@@ -1057,7 +1146,6 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   } else {
     paths.push_back(path);
   }
-  vector<vector<int> > paths2 = paths;
   if (gap) {
     printf("adv done gap\n");
     FixGapLength(paths, paths.size() - 1, gap_pos, prob_calc, -1);  
@@ -1067,8 +1155,7 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
     }
   } else {
     printf("adv done normal\n");
-    if (LocalChange2(paths2, gr, threshold, paths.size() - 1, ps, pt, prob_calc)) {
-      paths = paths2;
+    if (LocalChange2(paths, gr, threshold, paths.size() - 1, ps, pt, prob_calc, gen)) {
       printf("local 2 ok\n");
     } else {
       printf("local 2 fail\n");
@@ -1077,7 +1164,8 @@ bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
   return true;
 }
 
-bool FixGapLength(vector<vector<int> >& paths, ProbCalculator& prob_calc) {
+bool FixGapLength(PathSet& paths, ProbCalculator& prob_calc, double cur_p,
+                  default_random_engine& gen) {
   vector<pair<int, int> > opts;
   for (int i = 0; i < paths.size(); i++) {
     for (int j = 0; j < paths[i].size(); j++) {
@@ -1087,8 +1175,8 @@ bool FixGapLength(vector<vector<int> >& paths, ProbCalculator& prob_calc) {
     }
   }
   if (opts.empty()) return false;
-  pair<int, int> opt = opts[rand()%opts.size()];
-  return FixGapLength(paths, opt.first, opt.second, prob_calc, -1);
+  pair<int, int> opt = opts[RandomInt(gen, opts.size())];
+  return FixGapLength(paths, opt.first, opt.second, prob_calc, -1, cur_p);
 }
 
 bool SplitOnNode(int node, vector<vector<int>>& paths) {
@@ -1126,8 +1214,13 @@ bool SplitOnNode(int node, vector<vector<int>>& paths) {
   paths = paths2;
 }
 
-void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
+void FixRepForNode2(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
                    int node, ProbCalculator& prob_calc) {
+  FixRepForNode2(paths, gr, threshold, disjoin_similar, node, prob_calc, NAN);
+}
+
+void FixRepForNode2(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
+                   int node, ProbCalculator& prob_calc, double cur_score) {
   vector<pair<int, int> > poses;
   vector<pair<int, pair<int, int>>> doubles;
   vector<pair<int, pair<int, int>>> pals;
@@ -1151,62 +1244,60 @@ void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
       }
     }
   }
-  bool better = false;
-  printf("fix rep node2 %d %d %d %d\n", node, gr.nodes[node]->s.length(), poses.size(), doubles.size());
-  double cur_score = prob_calc.CalcProb(paths);
-  set<pair<int, int> > disjoint;
+  printf("fix rep node2 %d %d %d %d\n", node, gr.NodeLen(node), poses.size(), doubles.size());
+  // candidates are scored as edits of paths, which have to be committed
+  if (isnan(cur_score)) {
+    cur_score = prob_calc.CalcProb(paths);
+  }
+  // candidates: (0, (i, j)) joins paths at poses i and j, (1, (i, j)) moves
+  // double j to pos i, (2, (k, 0)) reverses the part between pals[k]
+  vector<pair<int, pair<int, int>>> cands;
   for (int i = 0; i < poses.size(); i++) {
     for (int j = 0; j < i; j++) {
-      vector<vector<int>> paths2(paths);
       if (poses[i].first != poses[j].first) {
-        vector<int> p1 = paths[poses[i].first];
-        vector<int> p2 = paths[poses[j].first];
-        vector<int> pp1, pp2;
-        if (p1[poses[i].second] == p2[poses[j].second]) {
-          pp1 = vector<int>(p1.begin(), p1.begin()+poses[i].second);
-          pp1.insert(pp1.end(), p2.begin()+poses[j].second, p2.end());
-          pp2 = vector<int>(p2.begin(), p2.begin()+poses[j].second);
-          pp2.insert(pp2.end(), p1.begin()+poses[i].second, p1.end());
-        } else {
-          vector<int> s1(p1.begin(), p1.begin()+poses[i].second+1);
-          vector<int> e1(p1.begin()+poses[i].second+1, p1.end());
-          vector<int> s2(p2.begin(), p2.begin()+poses[j].second);
-          vector<int> e2(p2.begin()+poses[j].second, p2.end());
-          ReversePath(s2); ReversePath(e2);
-          pp1.insert(pp1.end(), s1.begin(), s1.end());
-          pp1.insert(pp1.end(), s2.begin(), s2.end());
-          pp2.insert(pp2.end(), e2.begin(), e2.end());
-          pp2.insert(pp2.end(), e1.begin(), e1.end());
-        }
-        paths2[poses[i].first] = pp1;
-        paths2[poses[j].first] = pp2;
-        if (paths2[max(poses[i].first, poses[j].first)].size() <= 1) {
-          paths2.erase(paths2.begin()+max(poses[i].first, poses[j].first));
-        }
-        if (paths2[min(poses[i].first, poses[j].first)].size() <= 1) {
-          paths2.erase(paths2.begin()+min(poses[i].first, poses[j].first));
-        }
-        double score = prob_calc.CalcProb(paths2);
-        printf("scr %lf %lf\n", score, cur_score);
-        if (fabs(score - cur_score) < 0.001) {
-          if (disjoin_similar) {
-            disjoint.insert(poses[i]);
-            disjoint.insert(poses[j]);
-          }
-        }
-        if (score > cur_score) {
-          paths = paths2;
-          FixRepForNode2(paths, gr, threshold, disjoin_similar, node, prob_calc);
-          return;
-        }
+        cands.push_back(make_pair(0, make_pair(i, j)));
       }
     }
   }
   for (int i = 0; i < poses.size(); i++) {
     for (int j = 0; j < doubles.size(); j++) {
-      vector<vector<int>> paths2(paths);
+      cands.push_back(make_pair(1, make_pair(i, j)));
+    }
+  }
+  for (int k = 0; k < pals.size(); k++) {
+    cands.push_back(make_pair(2, make_pair(k, 0)));
+  }
+  auto build = [&](int k, PathEdit& edit) {
+    int i = cands[k].second.first, j = cands[k].second.second;
+    if (cands[k].first == 0) {
+      const vector<int>& p1 = paths[poses[i].first];
+      const vector<int>& p2 = paths[poses[j].first];
+      vector<int> pp1, pp2;
+      if (p1[poses[i].second] == p2[poses[j].second]) {
+        pp1 = vector<int>(p1.begin(), p1.begin()+poses[i].second);
+        pp1.insert(pp1.end(), p2.begin()+poses[j].second, p2.end());
+        pp2 = vector<int>(p2.begin(), p2.begin()+poses[j].second);
+        pp2.insert(pp2.end(), p1.begin()+poses[i].second, p1.end());
+      } else {
+        vector<int> s1(p1.begin(), p1.begin()+poses[i].second+1);
+        vector<int> e1(p1.begin()+poses[i].second+1, p1.end());
+        vector<int> s2(p2.begin(), p2.begin()+poses[j].second);
+        vector<int> e2(p2.begin()+poses[j].second, p2.end());
+        ReversePath(s2); ReversePath(e2);
+        pp1.insert(pp1.end(), s1.begin(), s1.end());
+        pp1.insert(pp1.end(), s2.begin(), s2.end());
+        pp2.insert(pp2.end(), e2.begin(), e2.end());
+        pp2.insert(pp2.end(), e1.begin(), e1.end());
+      }
+      // paths of at most one node are dropped
+      if (pp1.size() <= 1) pp1.clear();
+      if (pp2.size() <= 1) pp2.clear();
+      edit.Replace(poses[i].first, pp1);
+      edit.Replace(poses[j].first, pp2);
+      return true;
+    }
+    if (cands[k].first == 1) {
       if (poses[i].first != doubles[j].first) {
-        printf("dj %d %d\n", poses[i].first, doubles[j].first);
         vector<int> p1(paths[poses[i].first].begin(), paths[poses[i].first].begin()+poses[i].second);
         vector<int> p2(paths[doubles[j].first].begin(), paths[doubles[j].first].begin()+doubles[j].second.first);
         p2.insert(p2.end(), paths[doubles[j].first].begin()+doubles[j].second.second,
@@ -1219,10 +1310,10 @@ void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
         p1.insert(p1.end(), pj.begin(), pj.end());
         p1.insert(p1.end(), paths[poses[i].first].begin()+poses[i].second+1,
             paths[poses[i].first].end());
-        paths2[poses[i].first] = p1;
-        paths2[doubles[j].first] = p2;
+        if (p2.size() <= 1) p2.clear();
+        edit.Replace(poses[i].first, p1);
+        edit.Replace(doubles[j].first, p2);
       } else {
-        printf("hdj %d\n", poses[i].first);
         vector<int> pj(paths[doubles[j].first].begin()+doubles[j].second.first,
                        paths[doubles[j].first].begin()+doubles[j].second.second);
         if (pj[0] != paths[poses[i].first][poses[i].second]) {
@@ -1236,72 +1327,68 @@ void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
                    p1.begin()+doubles[j].second.second);
           p1.insert(p1.begin()+poses[i].second,
                     pj.begin(), pj.end());
-          paths2[poses[i].first] = p1;
+          if (p1.size() <= 1) p1.clear();
+          edit.Replace(poses[i].first, p1);
         } else if (poses[i].second > doubles[j].second.second) {
           vector<int> p1(paths[poses[i].first]);
           p1.insert(p1.begin()+poses[i].second,
                     pj.begin(), pj.end());
           p1.erase(p1.begin()+doubles[j].second.first,
                    p1.begin()+doubles[j].second.second);
-          paths2[poses[i].first] = p1;
+          if (p1.size() <= 1) p1.clear();
+          edit.Replace(poses[i].first, p1);
         } else {
-          continue;
+          return false;
         }
       }
-/*        printf("before:");
-        printf("(");
-        for (int k = 0; k < paths[poses[i].first].size(); k++) printf("%d ", paths[poses[i].first][k]);
-        printf(") (");
-        for (int k = 0; k < paths[doubles[j].first].size(); k++) printf("%d ", paths[doubles[j].first][k]);
-        printf(")\nafter: (");
-        for (int k = 0; k < p1.size(); k++) printf("%d ", p1[k]);
-        printf(") (");
-        for (int k = 0; k < p2.size(); k++) printf("%d ", p2[k]);
-        printf(")\n\n");*/
-      if (paths2[doubles[j].first].size() <= 1) {
-        paths2.erase(paths2.begin()+doubles[j].first);
+      return true;
+    }
+    auto &pal = pals[i];
+    vector<int> p(paths[pal.first].begin()+pal.second.first,
+                  paths[pal.first].begin()+pal.second.second+1);
+    ReversePath(p);
+    vector<int> p2 = paths[pal.first];
+    for (int l = 0; l < p.size(); l++) {
+      p2[pal.second.first+l] = p[l];
+    }
+    edit.Replace(pal.first, p2);
+    return true;
+  };
+
+  // the best candidate is applied when it improves the score
+  vector<double> scores;
+  int best = prob_calc.CalcProbs(paths, cands.size(), build, scores);
+  set<pair<int, int> > disjoint;
+  for (int k = 0; k < cands.size(); k++) {
+    if (scores[k] == -numeric_limits<double>::infinity()) continue;
+    int i = cands[k].second.first, j = cands[k].second.second;
+    double score = scores[k];
+    printf("scr %lf %lf\n", score, cur_score);
+    if (cands[k].first == 0) {
+      if (fabs(score - cur_score) < 0.001 && disjoin_similar) {
+        disjoint.insert(poses[i]);
+        disjoint.insert(poses[j]);
       }
-      double score = prob_calc.CalcProb(paths2);
-      printf("scr %lf %lf %d %d\n", score, cur_score, (int)paths.size(),
-          (int)paths2.size());
-      if (fabs(score - cur_score) < 0.002) {
-        if (disjoin_similar) {
+    } else if (fabs(score - cur_score) < 0.002) {
+      if (disjoin_similar) {
+        if (cands[k].first == 1) {
           disjoint.insert(poses[i]);
           disjoint.insert(make_pair(doubles[j].first, doubles[j].second.first));
           disjoint.insert(make_pair(doubles[j].first, doubles[j].second.second));
+        } else {
+          disjoint.insert(make_pair(pals[i].first, pals[i].second.first));
+          disjoint.insert(make_pair(pals[i].first, pals[i].second.second));
         }
-        printf("similar\n");
-      }
-      if (score > cur_score) {
-        paths = paths2;
-        FixRepForNode2(paths, gr, threshold, disjoin_similar, node, prob_calc);
-        return;
-      }
-    }
-  }
-  for (auto &pal: pals) {
-    vector<vector<int>> paths2(paths);
-    vector<int> p(paths2[pal.first].begin()+pal.second.first,
-                  paths2[pal.first].begin()+pal.second.second+1);
-    ReversePath(p);
-    for (int i = 0; i < p.size(); i++) {
-      paths2[pal.first][pal.second.first+i] = p[i];
-    }
-    double score = prob_calc.CalcProb(paths2);
-    printf("scr %lf %lf %d %d\n", score, cur_score, (int)paths.size(),
-        (int)paths2.size());
-    if (fabs(score - cur_score) < 0.002) {
-      if (disjoin_similar) {
-        disjoint.insert(make_pair(pal.first, pal.second.first));
-        disjoint.insert(make_pair(pal.first, pal.second.second));
       }
       printf("similar\n");
     }
-    if (score > cur_score) {
-      paths = paths2;
-      FixRepForNode2(paths, gr, threshold, disjoin_similar, node, prob_calc);
-      return;
-    }
+  }
+  if (best != -1 && scores[best] > cur_score) {
+    PathEdit edit;
+    build(best, edit);
+    double score = prob_calc.Commit(paths, edit);
+    FixRepForNode2(paths, gr, threshold, disjoin_similar, node, prob_calc, score);
+    return;
   }
   if (disjoin_similar) {
     for (auto it = disjoint.rbegin(); it != disjoint.rend(); it++) {
@@ -1310,7 +1397,8 @@ void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
       for (int i = 0; i < paths[it->first].size(); i++) printf("%d ", paths[it->first][i]);
       printf("\n");
       paths.push_back(vector<int>(paths[it->first].begin()+it->second, paths[it->first].end()));
-      paths[it->first].erase(paths[it->first].begin()+it->second+1, paths[it->first].end());
+      vector<int>& p = paths.Mutable(it->first);
+      p.erase(p.begin()+it->second+1, p.end());
       printf("after: ");
       for (int i = 0; i < paths[it->first].size(); i++) printf("%d ", paths[it->first][i]);
       printf(" second: ");
@@ -1323,13 +1411,13 @@ void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
   }
 }
 
-bool FixBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
+bool FixBigReps(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
                 ProbCalculator& prob_calc) {
   unordered_map<int, int> counts;
   for (int i = 0; i < paths.size(); i++) {
     for (int j = 0; j < paths[i].size(); j++) {
       if (paths[i][j] < 0) continue;
-      if (gr.nodes[paths[i][j]]->s.length() > threshold) {
+      if (gr.NodeLen(paths[i][j]) > threshold) {
         counts[(paths[i][j]/2)*2]++;
       }
     }
@@ -1347,13 +1435,13 @@ bool FixBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoi
   return true;
 }
 
-bool FixSomeBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
-                ProbCalculator& prob_calc) {
+bool FixSomeBigReps(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
+                ProbCalculator& prob_calc, default_random_engine& gen) {
   unordered_map<int, int> counts;
   for (int i = 0; i < paths.size(); i++) {
     for (int j = 0; j < paths[i].size(); j++) {
       if (paths[i][j] < 0) continue;
-      if (gr.nodes[paths[i][j]]->s.length() > threshold) {
+      if (gr.NodeLen(paths[i][j]) > threshold) {
         counts[(paths[i][j]/2)*2]++;
       }
     }
@@ -1366,7 +1454,7 @@ bool FixSomeBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool di
     }
   }
   if (rr.empty()) return false;
-  int e = rr[rand()%rr.size()];
+  int e = rr[RandomInt(gen, rr.size())];
   FixRepForNode2(paths, gr, threshold, disjoin_similar, e, prob_calc); 
   return true;
 }
@@ -1387,7 +1475,7 @@ bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& g
     int nl = 0;
     for (int j = 0; j < paths2[i].size(); j++) {
       if (paths2[i][j] < 0) nl += -paths2[i][j];
-      else nl += gr.nodes[paths2[i][j]]->s.length();
+      else nl += gr.NodeLen(paths2[i][j]);
     }
     if (has_node) {
       fp.push_back(nl);
@@ -1397,7 +1485,7 @@ bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& g
     }
   }
 
-  printf("fix rep node %d %d\n", node, gr.nodes[node]->s.length());
+  printf("fix rep node %d %d\n", node, gr.NodeLen(node));
   vector<vector<int>> before;
   vector<vector<int>> after;
   for (int i = 0; i < paths_with_node.size(); i++) {
@@ -1453,7 +1541,7 @@ bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& g
     for (int i = 0; i < opts.size(); i++) {
       for (int j = (int)before[i].size()-1; j >= 0; j--) {
         if (before[i][j] < 0) continue;
-        if (gr.nodes[before[i][j]]->s.length() > threshold) {
+        if (gr.NodeLen(before[i][j]) > threshold) {
           printf(" %d(%d) ", before[i][j], bfp[i]);
           break;
         }
@@ -1464,7 +1552,7 @@ bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& g
       pp.insert(pp.end(), after[opts[i]].begin(), after[opts[i]].end());
       for (int j = 0; j < after[opts[i]].size(); j++) {
         if (after[opts[i]][j] < 0) continue;
-        if (gr.nodes[after[opts[i]][j]]->s.length() > threshold) {
+        if (gr.NodeLen(after[opts[i]][j]) > threshold) {
           printf("%d(%d)", after[opts[i]][j], afp[opts[i]]);
           break;
         }
@@ -1473,7 +1561,7 @@ bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& g
       if (pp.size() > 1)
         paths3.push_back(pp);
     }
-    double score = prob_calc.CalcProb(paths3);
+    double score = prob_calc.CalcProb(PathSet(paths3));
     printf("score %lf\n", score);
     if (score > best_score) {
       best_score = score;
@@ -4,33 +4,49 @@
 #include "graph.h"
 #include "prob_calculator.h"
 
-bool BreakPath(vector<vector<int> >&new_paths, Graph& gr, int threshold);
-bool LocalChange2(vector<vector<int> >& new_paths, Graph& gr, int threshold,
-                  int path_id, int ps, int pt, ProbCalculator& prob_calc);
-bool FixMultiLocal(vector<vector<int> >& new_paths, Graph& gr, int threshold);
-bool FixRep(vector<vector<int> >& new_paths, Graph& gr, int threshold);
-bool FixSelfLoops(vector<vector<int> >& new_paths, Graph& gr, int threshold);
-bool LocalChange(vector<vector<int> >& new_paths, Graph& gr, int threshold, int &path_id,
-    int &xx, int &yy, ProbCalculator& prob_calc);
+bool BreakPath(PathSet& new_paths, Graph& gr, int threshold,
+               default_random_engine& gen);
+bool LocalChange2(PathSet& new_paths, Graph& gr, int threshold,
+                  int path_id, int ps, int pt, ProbCalculator& prob_calc,
+                  default_random_engine& gen);
+bool FixMultiLocal(PathSet& new_paths, Graph& gr, int threshold,
+                   default_random_engine& gen);
+bool FixRep(PathSet& new_paths, Graph& gr, int threshold,
+            default_random_engine& gen);
+bool FixSelfLoops(PathSet& new_paths, Graph& gr, int threshold,
+                  default_random_engine& gen);
+bool LocalChange(PathSet& new_paths, Graph& gr, int threshold, int &path_id,
+    int &xx, int &yy, ProbCalculator& prob_calc, default_random_engine& gen);
 void ReversePath(vector<int>& path);
-bool ExtendPathsAlt(vector<vector<int> >& paths, Graph& gr, int threshold);
-bool ExtendPaths(vector<vector<int> >& new_paths, Graph& gr, int threshold,
-    ProbCalculator& prob_calc);
-int SamplePathByLength(vector<vector<int> >& paths, Graph& gr);
-bool FixGapLength(vector<vector<int> >& paths, int path_id, int gap_pos,
+bool ExtendPathsAlt(PathSet& paths, Graph& gr, int threshold,
+                    const ReachOverrides& reach, default_random_engine& gen);
+bool ExtendPaths(PathSet& new_paths, Graph& gr, int threshold,
+    const ReachOverrides& reach, ProbCalculator& prob_calc,
+    default_random_engine& gen);
+int SamplePathByLength(PathSet& paths, Graph& gr, default_random_engine& gen);
+bool FixGapLength(PathSet& paths, int path_id, int gap_pos,
                   ProbCalculator& prob_calc, int prev_len);
-bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
-                    PacbioReadSet& rs, int kmer, ProbCalculator& prob_calc);
-bool ExtendPathsAdv(vector<vector<int> >& paths, Graph&gr, int threshold,
-                    ReadSet& rs1, ReadSet& rs2, int kmer, ProbCalculator& prob_calc);
-bool FixGapLength(vector<vector<int> >& paths, ProbCalculator& prob_calc);
+// Same when cur_p, the score of paths as they are, is already known.
+bool FixGapLength(PathSet& paths, int path_id, int gap_pos,
+                  ProbCalculator& prob_calc, int prev_len, double cur_p);
+bool ExtendPathsAdv(PathSet& paths, Graph&gr, int threshold,
+                    PacbioReadSet& rs, int kmer, const ReachOverrides& reach,
+                    ProbCalculator& prob_calc, default_random_engine& gen);
+bool ExtendPathsAdv(PathSet& paths, Graph&gr, int threshold,
+                    ReadSet& rs1, ReadSet& rs2, int kmer, const ReachOverrides& reach,
+                    ProbCalculator& prob_calc, default_random_engine& gen);
+bool FixGapLength(PathSet& paths, ProbCalculator& prob_calc, double cur_p,
+                  default_random_engine& gen);
 bool SplitOnNode(int node, vector<vector<int>>& paths);
-void FixRepForNode2(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
+void FixRepForNode2(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
                    int node, ProbCalculator& prob_calc);
-bool FixBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
-                ProbCalculator& prob_calc);
-bool FixSomeBigReps(vector<vector<int>>& paths, Graph&gr, int threshold, bool disjoin_similar,
+// cur_score is the score of paths committed to prob_calc, NAN when unknown.
+void FixRepForNode2(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
+                   int node, ProbCalculator& prob_calc, double cur_score);
+bool FixBigReps(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
                 ProbCalculator& prob_calc);
+bool FixSomeBigReps(PathSet& paths, Graph&gr, int threshold, bool disjoin_similar,
+                ProbCalculator& prob_calc, default_random_engine& gen);
 bool FixRepForNode(int node, vector<vector<int>>& paths, int threshold, Graph& gr,
                    ProbCalculator& prob_calc);
 #endif
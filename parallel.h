@@ -0,0 +1,210 @@
+#ifndef PARALLEL_H__
+#define PARALLEL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Number of worker threads from the configuration, 0 means one per core.
+extern int gThreads;
+
+inline int NumThreads() {
+  int threads = gThreads;
+  if (threads <= 0) {
+    threads = thread::hardware_concurrency();
+  }
+  return max(threads, 1);
+}
+
+// Calls f(thread_index, i) for every i in [begin, end). Indexes are handed
+// out in chunks of grain to whichever thread is free, thread_index is in
+// [0, NumThreads()) and can be used to pick per thread scratch space.
+template<class F>
+void ParallelFor(int begin, int end, int grain, F f) {
+  grain = max(grain, 1);
+  int threads = min(NumThreads(), (end - begin + grain - 1) / grain);
+  if (threads <= 1) {
+    for (int i = begin; i < end; i++) {
+      f(0, i);
+    }
+    return;
+  }
+  atomic<int> next(begin);
+  auto worker = [&](int t) {
+    while (true) {
+      int b = next.fetch_add(grain);
+      if (b >= end) break;
+      int e = min(b + grain, end);
+      for (int i = b; i < e; i++) {
+        f(t, i);
+      }
+    }
+  };
+  vector<thread> pool;
+  for (int t = 1; t < threads; t++) {
+    pool.push_back(thread(worker, t));
+  }
+  worker(0);
+  for (auto &th: pool) {
+    th.join();
+  }
+}
+
+// Threads kept between calls of Run, for work repeated many times over the
+// same per thread state. Run(f) calls f(t) for every t in [0, Size()) and
+// returns when all calls are done, t = 0 runs on the calling thread.
+class WorkerPool {
+ public:
+  explicit WorkerPool(int size)
+      : size_(max(size, 1)), task_(NULL), round_(0), busy_(0), stop_(false) {
+    for (int t = 1; t < size_; t++) {
+      threads_.push_back(thread(&WorkerPool::Work, this, t));
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      lock_guard<mutex> l(m_);
+      stop_ = true;
+    }
+    start_.notify_all();
+    for (auto &th: threads_) {
+      th.join();
+    }
+  }
+
+  int Size() const {
+    return size_;
+  }
+
+  void Run(const function<void(int)>& f) {
+    {
+      lock_guard<mutex> l(m_);
+      task_ = &f;
+      busy_ = size_ - 1;
+      round_++;
+    }
+    start_.notify_all();
+    f(0);
+    unique_lock<mutex> l(m_);
+    done_.wait(l, [this] { return busy_ == 0; });
+    task_ = NULL;
+  }
+
+ private:
+  WorkerPool(const WorkerPool&);
+  WorkerPool& operator=(const WorkerPool&);
+
+  void Work(int t) {
+    int seen = 0;
+    while (true) {
+      const function<void(int)>* task;
+      {
+        unique_lock<mutex> l(m_);
+        start_.wait(l, [&] { return stop_ || round_ != seen; });
+        if (stop_) return;
+        seen = round_;
+        task = task_;
+      }
+      (*task)(t);
+      lock_guard<mutex> l(m_);
+      if (--busy_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  int size_;
+  const function<void(int)>* task_;
+  int round_;
+  int busy_;
+  bool stop_;
+  mutex m_;
+  condition_variable start_;
+  condition_variable done_;
+  vector<thread> threads_;
+};
+
+// Seconds the calling thread has spent blocked on SharedMutex locks, so
+// timings of work sharing caches with other threads can leave them out.
+inline double& LockWaitSeconds() {
+  thread_local double seconds = 0;
+  return seconds;
+}
+
+// Lock with shared owners (readers of a cache) and exclusive ones (threads
+// filling it). A waiting exclusive owner blocks new shared ones, so fills are
+// not starved by a steady stream of readers. Not recursive: a thread holding
+// the lock must not lock it again.
+class SharedMutex {
+ public:
+  SharedMutex() : readers_(0), writer_(false), writers_waiting_(0) {}
+
+  void lock() {
+    unique_lock<mutex> l(m_);
+    writers_waiting_++;
+    Wait(l, [this] { return !writer_ && readers_ == 0; });
+    writers_waiting_--;
+    writer_ = true;
+  }
+
+  void unlock() {
+    lock_guard<mutex> l(m_);
+    writer_ = false;
+    cv_.notify_all();
+  }
+
+  void lock_shared() {
+    unique_lock<mutex> l(m_);
+    Wait(l, [this] { return !writer_ && writers_waiting_ == 0; });
+    readers_++;
+  }
+
+  void unlock_shared() {
+    lock_guard<mutex> l(m_);
+    if (--readers_ == 0) {
+      cv_.notify_all();
+    }
+  }
+
+ private:
+  template<class P>
+  void Wait(unique_lock<mutex>& l, P ready) {
+    if (ready()) return;
+    auto start = chrono::steady_clock::now();
+    cv_.wait(l, ready);
+    LockWaitSeconds() += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  mutex m_;
+  condition_variable cv_;
+  int readers_;
+  bool writer_;
+  int writers_waiting_;
+};
+
+// Shared ownership of a SharedMutex for a scope (lock_guard is the exclusive
+// one).
+class SharedLock {
+ public:
+  explicit SharedLock(SharedMutex& m) : m_(m) {
+    m_.lock_shared();
+  }
+  ~SharedLock() {
+    m_.unlock_shared();
+  }
+
+ private:
+  SharedLock(const SharedLock&);
+  SharedLock& operator=(const SharedLock&);
+  SharedMutex& m_;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef PATH_SET_H__
+#define PATH_SET_H__
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/iterator/indirect_iterator.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+
+using namespace std;
+
+// Paths of an assembly. Copies of a set share their paths and a path is
+// copied only when it is changed through Mutable, so copying a set costs a
+// pointer per path. References returned by Mutable are valid until the set
+// is copied, take a new one after that.
+class PathSet {
+ public:
+  typedef boost::indirect_iterator<vector<shared_ptr<vector<int> > >::const_iterator,
+                                   const vector<int> > const_iterator;
+
+  PathSet() {}
+  explicit PathSet(const vector<vector<int> >& paths) {
+    for (auto &p: paths) {
+      push_back(p);
+    }
+  }
+
+  int size() const {
+    return paths_.size();
+  }
+  bool empty() const {
+    return paths_.empty();
+  }
+  const vector<int>& operator[](int i) const {
+    return *paths_[i];
+  }
+  const vector<int>& back() const {
+    return *paths_.back();
+  }
+  const_iterator begin() const {
+    return const_iterator(paths_.begin());
+  }
+  const_iterator end() const {
+    return const_iterator(paths_.end());
+  }
+
+  // Path i for changing, copied first when another set shares it.
+  vector<int>& Mutable(int i) {
+    if (paths_[i].use_count() > 1) {
+      paths_[i] = make_shared<vector<int> >(*paths_[i]);
+    }
+    return *paths_[i];
+  }
+  void Set(int i, vector<int> path) {
+    paths_[i] = make_shared<vector<int> >(std::move(path));
+  }
+
+  void push_back(vector<int> path) {
+    paths_.push_back(make_shared<vector<int> >(std::move(path)));
+  }
+  // Appends path i of b, shared with b.
+  void Append(const PathSet& b, int i) {
+    paths_.push_back(b.paths_[i]);
+  }
+  void pop_back() {
+    paths_.pop_back();
+  }
+  void insert(const_iterator pos, vector<int> path) {
+    paths_.insert(paths_.begin() + (pos - begin()),
+                  make_shared<vector<int> >(std::move(path)));
+  }
+  void erase(const_iterator pos) {
+    paths_.erase(paths_.begin() + (pos - begin()));
+  }
+  void swap(PathSet& b) {
+    paths_.swap(b.paths_);
+  }
+
+  // Indexes of paths of this set which b does not share (removed) and of
+  // paths of b not shared with this set (added). A set made from this one
+  // by moves differs only in the paths they changed, so this is the change
+  // made by the moves.
+  void Diff(const PathSet& b, vector<int>& removed, vector<int>& added) const {
+    Unshared(b, removed);
+    b.Unshared(*this, added);
+  }
+
+  // For every path of this set the index of a path of b it shares, -1 when
+  // there is none. A path of b is matched at most once.
+  void Match(const PathSet& b, vector<int>& from) const {
+    unordered_map<const vector<int>*, vector<int> > shared;
+    for (int i = b.paths_.size() - 1; i >= 0; i--) {
+      shared[b.paths_[i].get()].push_back(i);
+    }
+    from.assign(paths_.size(), -1);
+    for (int i = 0; i < paths_.size(); i++) {
+      auto it = shared.find(paths_[i].get());
+      if (it != shared.end() && !it->second.empty()) {
+        from[i] = it->second.back();
+        it->second.pop_back();
+      }
+    }
+  }
+
+  vector<vector<int> > ToVectors() const {
+    return vector<vector<int> >(begin(), end());
+  }
+
+  // Stored as vector<vector<int> >.
+  template<class Archive>
+  void save(Archive & ar, const unsigned int version) const {
+    vector<vector<int> > paths = ToVectors();
+    ar << paths;
+  }
+  template<class Archive>
+  void load(Archive & ar, const unsigned int version) {
+    vector<vector<int> > paths;
+    ar >> paths;
+    *this = PathSet(paths);
+  }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+ private:
+  // Indexes of paths of this set not shared with b.
+  void Unshared(const PathSet& b, vector<int>& out) const {
+    unordered_map<const vector<int>*, int> shared;
+    for (auto &p: b.paths_) {
+      shared[p.get()]++;
+    }
+    for (int i = 0; i < paths_.size(); i++) {
+      auto it = shared.find(paths_[i].get());
+      if (it != shared.end() && it->second > 0) {
+        it->second--;
+      } else {
+        out.push_back(i);
+      }
+    }
+  }
+
+  vector<shared_ptr<vector<int> > > paths_;
+};
+
+// Change of a few paths of a set: paths[k] replaces path ids[k] and an empty
+// one removes it, ids from the size of the set on are appended in the order
+// given. Paths not named are left shared with the set the edit is applied to.
+struct PathEdit {
+  void Replace(int id, vector<int> path) {
+    ids.push_back(id);
+    paths.push_back(std::move(path));
+  }
+  void Remove(int id) {
+    Replace(id, vector<int>());
+  }
+
+  // Replacements go first, then removals from the back, then appends.
+  void Apply(PathSet& set) const {
+    int size = set.size();
+    vector<int> removed;
+    for (int k = 0; k < ids.size(); k++) {
+      if (ids[k] >= size) continue;
+      if (paths[k].empty()) {
+        removed.push_back(ids[k]);
+      } else {
+        set.Set(ids[k], paths[k]);
+      }
+    }
+    sort(removed.rbegin(), removed.rend());
+    for (auto id: removed) {
+      set.erase(set.begin() + id);
+    }
+    for (int k = 0; k < ids.size(); k++) {
+      if (ids[k] >= size && !paths[k].empty()) {
+        set.push_back(paths[k]);
+      }
+    }
+  }
+
+  vector<int> ids;
+  vector<vector<int> > paths;
+};
+
+#endif
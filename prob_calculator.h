@@ -1,7 +1,12 @@
 #ifndef PROB_CALCULATOR_H__
 #define PROB_CALCULATOR_H__
 
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <unordered_set>
 #include "graph.h"
+#include "parallel.h"
 #include "utility.h"
 
 struct SingleReadConfig {
@@ -42,8 +47,14 @@ class ProbCalculator {
       const vector<pair<SingleReadConfig, PacbioReadSet*>>& pacbio_reads,
       Graph& gr) :
         single_reads(single_reads), paired_reads(paired_reads),
-        pacbio_reads(pacbio_reads), gr(gr) {
+        pacbio_reads(pacbio_reads), committed_len(0), gr(gr) {
     paired_scoring_states.resize(paired_reads.size());
+    single_committed.resize(single_reads.size());
+    pacbio_committed.resize(pacbio_reads.size());
+    single_scores.resize(single_reads.size());
+    single_scratch.resize(single_reads.size());
+    pacbio_scores.resize(pacbio_reads.size());
+    pacbio_scratch.resize(pacbio_reads.size());
   }
 
   vector<vector<int>> NormalizePaths(vector<vector<int>>& paths) {
@@ -59,68 +70,320 @@ class ProbCalculator {
     return ret;
   }
 
-
-  double CalcProb(vector<vector<int>>& pathso,
+  // Read sets and their aligment caches are shared by all calculators (one
+  // per chain with parallel tempering or per speculative proposal). They lock
+  // the caches themselves, scoring state and scratch space are kept here, so
+  // calculators score at the same time.
+  //
+  // Scores of paths are kept for the committed path set, the one last given
+  // to CalcProb or Commit. Paths shared with it (or equal to one of its
+  // paths) are not looked up again, only the others are scored.
+  double CalcProb(const PathSet& paths,
                   vector<pair<int, int>>& zeros,
                   int& total_len) {
-//    vector<vector<int>> paths = NormalizePaths(pathso);
-    vector<vector<int>> paths=pathso;
+    return Score(paths, true, zeros, total_len);
+  }
+  double CalcProb(const PathSet& paths,
+                  int& total_len) {
+    vector<pair<int, int>> zeros;
+    return CalcProb(paths, zeros, total_len);
+  }
+  double CalcProb(const PathSet& paths) {
+    int tl;
+    return CalcProb(paths, tl);
+  }
+
+  // Score of paths with edit applied, the committed state is not changed.
+  // Scoring small edits of the committed set costs the edited paths.
+  double EvalEdit(const PathSet& paths, const PathEdit& edit) {
+    PathSet edited = paths;
+    edit.Apply(edited);
+    vector<pair<int, int>> zeros;
+    int total_len;
+    return Score(edited, false, zeros, total_len);
+  }
+  // Applies edit to paths and commits them, returns their score.
+  double Commit(PathSet& paths, const PathEdit& edit) {
+    edit.Apply(paths);
+    return CalcProb(paths);
+  }
+
+  // Scores every edit of paths and returns the index of the best one, or -1
+  // when there is none. build(i, edit) fills edit with candidate i or returns
+  // false when there is none. scores[i] is the score of candidate i,
+  // -infinity for candidates not built. Edits are scored with EvalEdit on
+  // NumThreads() threads, the first one uses this calculator and the others
+  // worker calculators kept from call to call. Workers get the committed
+  // state from the changes logged since the last call, so every candidate
+  // scores bit for bit the same on any thread.
+  template<class F>
+  int CalcProbs(const PathSet& paths, int num, F build, vector<double>& scores) {
+    scores.assign(num, -numeric_limits<double>::infinity());
+    vector<PathEdit> edits(num);
+    vector<bool> built(num);
+    for (int i = 0; i < num; i++) {
+      built[i] = build(i, edits[i]);
+    }
+    int threads = min(NumThreads(), num);
+    if (threads > 1) {
+      SyncWorkers();
+      if (!paired_reads.empty()) {
+        // aligments are done up front, one fill per read set
+        unordered_set<vector<int>> added_set;
+        for (int i = 0; i < num; i++) {
+          if (!built[i]) continue;
+          for (auto &p: edits[i].paths) {
+            if (!p.empty()) {
+              added_set.insert(p);
+            }
+          }
+        }
+        vector<vector<int>> added(added_set.begin(), added_set.end());
+        for (auto &rs: paired_reads) {
+          rs.second.first->PrecomputeAlignmentForScoring(added, gr);
+          rs.second.second->PrecomputeAlignmentForScoring(added, gr);
+        }
+      }
+    }
+    atomic<int> next(0);
+    auto score = [&](int t) {
+      ProbCalculator& calc = t == 0 ? *this : *workers_.calcs[t-1];
+      for (int i = next++; i < num; i = next++) {
+        if (built[i]) {
+          scores[i] = calc.EvalEdit(paths, edits[i]);
+        }
+      }
+    };
+    if (threads > 1) {
+      workers_.pool->Run(score);
+    } else {
+      score(0);
+    }
+    int best = -1;
+    for (int i = 0; i < num; i++) {
+      if (built[i] && (best == -1 || scores[i] > scores[best])) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  // Write aligment caches of single and paired read sets as they are at
+  // PinAligments, SavePinnedAligments can run in another thread (PacBio read
+  // sets save theirs on their own).
+  void PinAligments() const {
+    for (auto &e: single_reads) {
+      e.second->PinAligments();
+    }
+    for (auto &e: paired_reads) {
+      e.second.first->PinAligments();
+      e.second.second->PinAligments();
+    }
+  }
+  void SavePinnedAligments() {
+    for (auto &e: single_reads) {
+      e.second->SavePinnedAligments();
+    }
+    for (auto &e: paired_reads) {
+      e.second.first->SavePinnedAligments();
+      e.second.second->SavePinnedAligments();
+    }
+  }
+
+  // Only paired scoring states are kept in checkpoints, per path scores are
+  // computed again when needed.
+  template<class Archive>
+  void serialize(Archive & ar, const unsigned int version) {
+    ar & paired_scoring_states;
+    if (Archive::is_loading::value) {
+      committed_paths = PathSet();
+      if (!paired_scoring_states.empty()) {
+        committed_paths = paired_scoring_states[0].old_paths;
+      }
+      committed_len = GetTotalLen(gr, committed_paths);
+      for (auto &s: single_committed) {
+        s.assign(committed_paths.size(), nullptr);
+      }
+      for (auto &s: pacbio_committed) {
+        s.assign(committed_paths.size(), nullptr);
+      }
+    }
+  }
+
+  vector<pair<SingleReadConfig, ReadSet*>> single_reads;
+  vector<pair<PairedReadConfig, pair<ReadSet*, ReadSet*>>> paired_reads;
+  vector<pair<SingleReadConfig, PacbioReadSet*>> pacbio_reads;
+  // Scores are kept per path and only changed paths are scored again, so
+  // moves evaluating small edits pay for the edited paths.
+  vector<ScoringState> paired_scoring_states;
+  vector<PathScoreCache<double>> single_scores;
+  vector<PathScoreCache<logdouble>> pacbio_scores;
+  // committed path set, its length and the scores of its paths per read set
+  PathSet committed_paths;
+  int committed_len;
+  vector<vector<shared_ptr<const PathScore<double>>>> single_committed;
+  vector<vector<shared_ptr<const PathScore<logdouble>>>> pacbio_committed;
+  // per read set scratch space of scoring
+  vector<PositionsScratch> single_scratch;
+  vector<PacbioReadSet::Scratch> pacbio_scratch;
+  Graph& gr;
+
+ private:
+  // Worker calculators of CalcProbs and their threads, made on first use.
+  // Paired probs changed by commits since the workers were synced are logged
+  // here, a log longer than the probs is dropped and all probs are copied.
+  // Copies of a calculator start without workers.
+  struct Workers {
+    Workers() : full_sync(false) {}
+    Workers(const Workers&) : full_sync(false) {}
+    Workers& operator=(const Workers&) {
+      return *this;
+    }
+
+    vector<unique_ptr<ProbCalculator>> calcs;
+    unique_ptr<WorkerPool> pool;
+    vector<vector<pair<int, double>>> paired_log;
+    bool full_sync;
+  };
+
+  // Makes the workers or brings them to the committed state of this one.
+  void SyncWorkers() {
+    if (workers_.calcs.empty()) {
+      int threads = NumThreads();
+      for (int t = 1; t < threads; t++) {
+        workers_.calcs.emplace_back(new ProbCalculator(*this));
+      }
+      workers_.pool.reset(new WorkerPool(threads));
+      workers_.paired_log.resize(paired_reads.size());
+      return;
+    }
+    for (auto &w: workers_.calcs) {
+      w->committed_paths = committed_paths;
+      w->committed_len = committed_len;
+      w->single_committed = single_committed;
+      w->pacbio_committed = pacbio_committed;
+      for (int ind = 0; ind < paired_scoring_states.size(); ind++) {
+        ScoringState& from = paired_scoring_states[ind];
+        ScoringState& to = w->paired_scoring_states[ind];
+        if (workers_.full_sync || to.probs.size() != from.probs.size()) {
+          to.probs = from.probs;
+        } else {
+          for (auto &e: workers_.paired_log[ind]) {
+            to.probs[e.first] = from.probs[e.first];
+          }
+        }
+        to.bad_bases = from.bad_bases;
+        to.old_paths = from.old_paths;
+      }
+    }
+    for (auto &log: workers_.paired_log) {
+      log.clear();
+    }
+    workers_.full_sync = false;
+  }
+
+  Workers workers_;
+
+  // Score of paths, with commit they become the committed set. Paths not
+  // shared with the committed set are matched to its other paths by content,
+  // so sets built from scratch score the same way.
+  double Score(const PathSet& paths, bool commit,
+               vector<pair<int, int>>& zeros, int& total_len) {
+    vector<int> from;
+    paths.Match(committed_paths, from);
+    vector<bool> kept(committed_paths.size());
+    for (auto j: from) {
+      if (j >= 0) kept[j] = true;
+    }
+    unordered_multimap<vector<int>, int> left;
+    for (int j = 0; j < committed_paths.size(); j++) {
+      if (!kept[j]) left.insert(make_pair(committed_paths[j], j));
+    }
+    vector<vector<int>> erased, added;
+    int len = committed_len;
+    for (int i = 0; i < paths.size(); i++) {
+      if (from[i] >= 0) continue;
+      auto it = left.empty() ? left.end() : left.find(paths[i]);
+      if (it != left.end()) {
+        from[i] = it->second;
+        kept[it->second] = true;
+        left.erase(it);
+      } else {
+        added.push_back(paths[i]);
+        len += GetPathLen(gr, paths[i]);
+      }
+    }
+    for (int j = 0; j < committed_paths.size(); j++) {
+      if (!kept[j]) {
+        erased.push_back(committed_paths[j]);
+        len -= GetPathLen(gr, committed_paths[j]);
+      }
+    }
+
     zeros.clear();
     double prob = 0;
-    for (auto &e: single_reads) {
+    for (int i = 0; i < single_reads.size(); i++) {
+      auto &e = single_reads[i];
       int zero = 0;
-      prob += CalcScoreForPaths(
-          gr, paths, *e.second, zero, total_len,
-          true, e.first.penalty_constant, e.first.step,
-          e.first.min_prob_per_base, e.first.min_prob_start) * e.first.weight;
+      vector<shared_ptr<const PathScore<double>>> scores(paths.size());
+      for (int k = 0; k < paths.size(); k++) {
+        if (from[k] >= 0) scores[k] = single_committed[i][from[k]];
+      }
+      // penalty of single reads is not used, their bad bases are always 0
+      prob += CalcScoreForPathsNew(
+          gr, paths, scores, *e.second, zero, total_len, single_scores[i],
+          single_scratch[i], e.first.min_prob_per_base,
+          e.first.min_prob_start) * e.first.weight;
       zeros.push_back(make_pair(zero, e.second->GetNumberOfReads()));
+      if (commit) single_committed[i].swap(scores);
     }
     int ind = 0;
     for (auto &e: paired_reads) {
-/*      double score_slow = CalcScoreForPaths(
-          gr, paths, *e.second.first, *e.second.second, 
-          e.first.insert_mean, e.first.insert_std, zero,
-          total_len, true, e.first.penalty_constant,
-          e.first.step, true,
-          e.first.min_prob_per_base, e.first.min_prob_start) * e.first.weight;
-      int zero2, t2;*/
       int zero = 0;
+      total_len = len;
+      // commits are logged for the workers
+      vector<pair<int, double>>* log = NULL;
+      if (commit && !workers_.calcs.empty() && !workers_.full_sync) {
+        log = &workers_.paired_log[ind];
+      }
       double score_fast = CalcScoreForPathsNew(
-          gr, paths, *e.second.first, *e.second.second,
+          gr, paths, erased, added, len, *e.second.first, *e.second.second,
           e.first.insert_mean, e.first.insert_std,
-          zero, total_len, paired_scoring_states[ind],
+          zero, paired_scoring_states[ind], commit, log,
           true, e.first.penalty_constant,
           e.first.step, true, e.first.min_prob_per_base,
           e.first.min_prob_start) * e.first.weight;
-//      printf("cmp %lf %lf\n", score_slow, score_fast);
       zeros.push_back(make_pair(zero, e.second.first->GetNumberOfReads()));
       prob += score_fast;
+      if (log && log->size() > paired_scoring_states[ind].probs.size()) {
+        workers_.full_sync = true;
+        for (auto &l: workers_.paired_log) {
+          l.clear();
+        }
+      }
       ind++;
     }
-    for (auto &e: pacbio_reads) {
+    for (int i = 0; i < pacbio_reads.size(); i++) {
+      auto &e = pacbio_reads[i];
       int zero = 0;
-      prob += CalcScoreForPacbio(
-          gr, paths, *e.second, zero, total_len, true,
-          e.first.penalty_constant, e.first.step,
+      vector<shared_ptr<const PathScore<logdouble>>> scores(paths.size());
+      for (int k = 0; k < paths.size(); k++) {
+        if (from[k] >= 0) scores[k] = pacbio_committed[i][from[k]];
+      }
+      prob += CalcScoreForPacbioNew(
+          gr, paths, scores, *e.second, zero, total_len, pacbio_scores[i],
+          pacbio_scratch[i], e.first.penalty_constant, e.first.step,
           e.first.min_prob_per_base, e.first.min_prob_start) * e.first.weight;
       zeros.push_back(make_pair(zero, e.second->GetNumberOfReads()));
+      if (commit) pacbio_committed[i].swap(scores);
+    }
+    if (commit) {
+      committed_paths = paths;
+      committed_len = len;
     }
     return prob;
   }
-  double CalcProb(vector<vector<int> >& paths,
-                  int& total_len) {
-    vector<pair<int, int>> zeros;
-    return CalcProb(paths, zeros, total_len);
-  }
-  double CalcProb(vector<vector<int> >& paths) {
-    int tl;
-    return CalcProb(paths, tl);
-  }
-  vector<pair<SingleReadConfig, ReadSet*>> single_reads;
-  vector<pair<PairedReadConfig, pair<ReadSet*, ReadSet*>>> paired_reads;
-  vector<pair<SingleReadConfig, PacbioReadSet*>> pacbio_reads;
-  vector<ScoringState> paired_scoring_states;
-  Graph& gr;
+
 };
 
 
@@ -0,0 +1,350 @@
+#include "reach_table.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <thread>
+
+struct ReachTable::LazyState {
+  typedef shared_ptr<const vector<ReachEntry> > Entries;
+
+  LazyState(int num_sources_, SearchFunc search_, int capacity_)
+      : num_sources(num_sources_), search(search_), capacity(max(capacity_, 1)),
+        stop(false) {}
+
+  ~LazyState() {
+    {
+      lock_guard<mutex> g(lock);
+      stop = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  Entries Get(int s) {
+    {
+      lock_guard<mutex> g(lock);
+      auto it = cache.find(s);
+      if (it != cache.end()) {
+        lru.splice(lru.begin(), lru, it->second.second);
+        return it->second.first;
+      }
+    }
+    // The search runs without the lock, two threads asking for the same
+    // source may both compute it and the first one is kept.
+    unique_ptr<SearchScratch> sc = TakeScratch();
+    vector<ReachEntry>* out = new vector<ReachEntry>;
+    search(s, *out, *sc);
+    sort(out->begin(), out->end());
+    Entries entries(out);
+    lock_guard<mutex> g(lock);
+    free_scratch.push_back(std::move(sc));
+    auto it = cache.find(s);
+    if (it != cache.end()) {
+      return it->second.first;
+    }
+    lru.push_front(s);
+    cache[s] = make_pair(entries, lru.begin());
+    while (cache.size() > capacity) {
+      cache.erase(lru.back());
+      lru.pop_back();
+    }
+    return entries;
+  }
+
+  // Scratch from the pool or a new one, the caller returns it to
+  // free_scratch.
+  unique_ptr<SearchScratch> TakeScratch() {
+    lock_guard<mutex> g(lock);
+    if (free_scratch.empty()) {
+      return unique_ptr<SearchScratch>(new SearchScratch);
+    }
+    unique_ptr<SearchScratch> sc = std::move(free_scratch.back());
+    free_scratch.pop_back();
+    return sc;
+  }
+
+  bool Cached(int s) {
+    lock_guard<mutex> g(lock);
+    return cache.count(s) > 0;
+  }
+
+  void Prefetch(const vector<int>& sources) {
+    {
+      lock_guard<mutex> g(lock);
+      for (auto s: sources) {
+        if (s >= 0 && s < num_sources && cache.count(s) == 0) {
+          pending.push_back(s);
+        }
+      }
+      if (!worker.joinable()) {
+        worker = thread(&LazyState::Work, this);
+      }
+    }
+    cv.notify_one();
+  }
+
+  void Work() {
+    while (true) {
+      int s;
+      {
+        unique_lock<mutex> g(lock);
+        cv.wait(g, [this] { return stop || !pending.empty(); });
+        if (stop) return;
+        s = pending.front();
+        pending.pop_front();
+      }
+      if (!Cached(s)) {
+        Get(s);
+      }
+    }
+  }
+
+  int num_sources;
+  SearchFunc search;
+  size_t capacity;
+  mutex lock;
+  list<int> lru;
+  unordered_map<int, pair<Entries, list<int>::iterator> > cache;
+  deque<int> pending;
+  // scratch of finished searches, kept for the next ones
+  vector<unique_ptr<SearchScratch> > free_scratch;
+  condition_variable cv;
+  bool stop;
+  thread worker;
+};
+
+void ReachTable::Reset() {
+  lazy_.reset();
+  mapped_.reset();
+  offsets_store_.clear();
+  entries_store_.clear();
+  num_sources_ = 0;
+  offsets_ = NULL;
+  entries_ = NULL;
+  total_ = 0;
+  lock_guard<mutex> g(overrides_lock_);
+  overrides_.clear();
+}
+
+void ReachTable::Build(vector<vector<ReachEntry> >& per_source) {
+  Reset();
+  long long total = 0;
+  for (auto &e: per_source) {
+    total += e.size();
+  }
+  offsets_store_.assign(1, 0);
+  offsets_store_.reserve(per_source.size() + 1);
+  entries_store_.reserve(total);
+  for (auto &e: per_source) {
+    sort(e.begin(), e.end());
+    for (auto &x: e) {
+      total_ += x.target;
+    }
+    entries_store_.insert(entries_store_.end(), e.begin(), e.end());
+    offsets_store_.push_back(entries_store_.size());
+    vector<ReachEntry>().swap(e);
+  }
+  num_sources_ = per_source.size();
+  offsets_ = offsets_store_.data();
+  entries_ = entries_store_.data();
+}
+
+void ReachTable::SetLazy(int num_sources, SearchFunc search, int capacity) {
+  Reset();
+  lazy_.reset(new LazyState(num_sources, search, capacity));
+}
+
+void ReachTable::Write(FILE* f) const {
+  assert(!lazy_);
+  long long header[3] = {num_sources_, num_sources_ ? offsets_[num_sources_] : 0,
+                         total_};
+  fwrite(header, sizeof(long long), 3, f);
+  if (num_sources_ == 0) return;
+  fwrite(offsets_, sizeof(long long), num_sources_ + 1, f);
+  fwrite(entries_, sizeof(ReachEntry), header[1], f);
+  long long pad = (8 - header[1] * sizeof(ReachEntry) % 8) % 8;
+  for (int i = 0; i < pad; i++) {
+    fputc(0, f);
+  }
+}
+
+long long ReachTable::Map(const char* data, size_t size, shared_ptr<MappedFile> mapped) {
+  Reset();
+  long long header[3];
+  if (size < sizeof(header)) return -1;
+  memcpy(header, data, sizeof(header));
+  long long num_sources = header[0], num_entries = header[1];
+  if (num_sources < 0 || num_entries < 0) return -1;
+  if (num_sources == 0) return sizeof(header);
+  long long entries_bytes = num_entries * sizeof(ReachEntry);
+  long long need = sizeof(header) + (num_sources + 1) * sizeof(long long) +
+                   entries_bytes + (8 - entries_bytes % 8) % 8;
+  if (need > (long long)size) return -1;
+  const long long* offsets = (const long long*)(data + sizeof(header));
+  if (offsets[0] != 0 || offsets[num_sources] != num_entries) return -1;
+  num_sources_ = num_sources;
+  offsets_ = offsets;
+  entries_ = (const ReachEntry*)(offsets + num_sources + 1);
+  total_ = header[2];
+  mapped_ = mapped;
+  return need;
+}
+
+void ReachTable::Prefetch(const vector<int>& sources) {
+  if (lazy_) {
+    lazy_->Prefetch(sources);
+  }
+}
+
+int ReachTable::NumSources() const {
+  if (lazy_) {
+    return lazy_->num_sources;
+  }
+  return num_sources_;
+}
+
+ReachTable::SourceView ReachTable::GetSource(int s) const {
+  SourceView v;
+  if (s < 0 || s >= NumSources()) return v;
+  if (lazy_) {
+    v.hold = lazy_->Get(s);
+    v.b = v.hold->data();
+    v.e = v.b + v.hold->size();
+  } else {
+    v.b = entries_ + offsets_[s];
+    v.e = entries_ + offsets_[s+1];
+  }
+  return v;
+}
+
+const ReachEntry* ReachTable::SourceView::Find(int node) const {
+  const ReachEntry* it = lower_bound(b, e, ReachEntry(node, 0, 0, false));
+  if (it == e || it->node != node) return NULL;
+  return it;
+}
+
+vector<int> ReachTable::GetPath(int s, int t) const {
+  vector<int> ret;
+  {
+    lock_guard<mutex> g(overrides_lock_);
+    auto it = overrides_.find(PairKey(s, t));
+    if (it != overrides_.end()) {
+      return it->second;
+    }
+  }
+  SourceView v = GetSource(s);
+  const ReachEntry* e = v.Find(t);
+  if (e == NULL) return ret;
+  int cur = e->parent;
+  while (cur != s) {
+    ret.push_back(cur);
+    cur = v.Find(cur)->parent;
+  }
+  reverse(ret.begin(), ret.end());
+  return ret;
+}
+
+vector<int> ReachTable::GetPath(int s, int t, const PathOverrides& local) const {
+  auto it = local.find(PairKey(s, t));
+  if (it != local.end()) {
+    return it->second;
+  }
+  return GetPath(s, t);
+}
+
+void ReachTable::SetPath(int s, int t, const vector<int>& path) {
+  lock_guard<mutex> g(overrides_lock_);
+  overrides_[PairKey(s, t)] = path;
+}
+
+void ReachTable::MergeOverrides(const PathOverrides& overrides) {
+  lock_guard<mutex> g(overrides_lock_);
+  for (auto &e: overrides) {
+    overrides_[e.first] = e.second;
+  }
+}
+
+vector<int> ReachTable::GetTargets(int s) const {
+  vector<int> ret;
+  SourceView v = GetSource(s);
+  for (const ReachEntry* it = v.b; it != v.e; ++it) {
+    if (it->target) {
+      ret.push_back(it->node);
+    }
+  }
+  return ret;
+}
+
+void SelfLoops::Reset() {
+  mapped_.reset();
+  node_offsets_store_.clear();
+  loop_offsets_store_.clear();
+  nodes_store_.clear();
+  num_nodes_ = 0;
+  node_offsets_ = NULL;
+  loop_offsets_ = NULL;
+  nodes_ = NULL;
+}
+
+void SelfLoops::Build(vector<vector<int> >& loops) {
+  Reset();
+  node_offsets_store_.push_back(0);
+  loop_offsets_store_.push_back(0);
+  for (auto &l: loops) {
+    for (int k = 0; k < l.size(); k += l[k] + 1) {
+      nodes_store_.insert(nodes_store_.end(), l.begin() + k + 1,
+                          l.begin() + k + 1 + l[k]);
+      loop_offsets_store_.push_back(nodes_store_.size());
+    }
+    node_offsets_store_.push_back(loop_offsets_store_.size() - 1);
+    vector<int>().swap(l);
+  }
+  num_nodes_ = loops.size();
+  node_offsets_ = node_offsets_store_.data();
+  loop_offsets_ = loop_offsets_store_.data();
+  nodes_ = nodes_store_.data();
+}
+
+void SelfLoops::Write(FILE* f) const {
+  long long num_loops = NumLoopsTotal();
+  long long header[3] = {num_nodes_, num_loops,
+                         num_loops ? loop_offsets_[num_loops] : 0};
+  fwrite(header, sizeof(long long), 3, f);
+  if (num_nodes_ == 0) return;
+  fwrite(node_offsets_, sizeof(long long), num_nodes_ + 1, f);
+  fwrite(loop_offsets_, sizeof(long long), num_loops + 1, f);
+  fwrite(nodes_, sizeof(int), header[2], f);
+  if (header[2] % 2) {
+    int pad = 0;
+    fwrite(&pad, sizeof(int), 1, f);
+  }
+}
+
+long long SelfLoops::Map(const char* data, size_t size, shared_ptr<MappedFile> mapped) {
+  Reset();
+  long long header[3];
+  if (size < sizeof(header)) return -1;
+  memcpy(header, data, sizeof(header));
+  long long num_nodes = header[0], num_loops = header[1], num_ids = header[2];
+  if (num_nodes < 0 || num_loops < 0 || num_ids < 0) return -1;
+  if (num_nodes == 0) return sizeof(header);
+  long long need = sizeof(header) + (num_nodes + 1 + num_loops + 1) * sizeof(long long) +
+                   (num_ids + num_ids % 2) * sizeof(int);
+  if (need > (long long)size) return -1;
+  const long long* node_offsets = (const long long*)(data + sizeof(header));
+  const long long* loop_offsets = node_offsets + num_nodes + 1;
+  if (node_offsets[num_nodes] != num_loops || loop_offsets[num_loops] != num_ids) {
+    return -1;
+  }
+  num_nodes_ = num_nodes;
+  node_offsets_ = node_offsets;
+  loop_offsets_ = loop_offsets;
+  nodes_ = (const int*)(loop_offsets + num_loops + 1);
+  mapped_ = mapped;
+  return need;
+}
@@ -0,0 +1,193 @@
+#ifndef REACH_TABLE_H__
+#define REACH_TABLE_H__
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "mapped_file.h"
+
+using namespace std;
+
+struct ReachEntry {
+  ReachEntry() {}
+  ReachEntry(int node_, int parent_, int dist_, bool target_)
+      : node(node_), parent(parent_), dist(dist_), target(target_) {}
+
+  bool operator<(const ReachEntry& b) const {
+    return node < b.node;
+  }
+
+  // reached node and the node before it on the path from the source
+  int node;
+  int parent;
+  unsigned dist : 31;
+  unsigned target : 1;
+};
+
+// Arrays for one graph search, reused across sources. A slot is valid only
+// when its stamp equals the current epoch, so nothing is cleared between
+// sources.
+struct SearchScratch {
+  vector<int> seen;
+  vector<int> done;
+  vector<int> dist;
+  vector<int> prev;
+  vector<int> order;
+  int epoch;
+  priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> fr;
+
+  SearchScratch() : epoch(0) {}
+
+  void Next(int n) {
+    if (seen.size() != n) {
+      seen.assign(n, 0);
+      done.assign(n, 0);
+      dist.resize(n);
+      prev.resize(n);
+      order.resize(n);
+    }
+    epoch++;
+  }
+};
+
+// Paths replacing stored ones, keyed by ReachTable::PairKey(s, t).
+typedef unordered_map<long long, vector<int> > PathOverrides;
+
+// Paths from every source node stored as predecessor trees. Entries of one
+// source are sorted by node. Nodes which are only passed through are kept
+// with target = false.
+// The trees are either all built up front (Build) or computed when a source
+// is first queried and kept in a size-bounded LRU cache (SetLazy).
+class ReachTable {
+ public:
+  typedef function<void(int, vector<ReachEntry>&, SearchScratch&)> SearchFunc;
+
+  ReachTable() : num_sources_(0), offsets_(NULL), entries_(NULL), total_(0) {}
+
+  // Takes over entries of every source (they get sorted).
+  void Build(vector<vector<ReachEntry> >& per_source);
+  // search(s, out, sc) fills entries of source s using scratch sc, at most
+  // capacity sources are kept. Scratch is pooled between searches.
+  void SetLazy(int num_sources, SearchFunc search, int capacity);
+  // Computes sources in a background thread (lazy mode only).
+  void Prefetch(const vector<int>& sources);
+
+  bool HasTarget(int s, int t) const {
+    SourceView v = GetSource(s);
+    const ReachEntry* e = v.Find(t);
+    return e != NULL && e->target;
+  }
+
+  // Nodes strictly between s and t.
+  vector<int> GetPath(int s, int t) const;
+  // Same, paths in local take precedence over all others.
+  vector<int> GetPath(int s, int t, const PathOverrides& local) const;
+  // Replaces the stored path between s and t.
+  void SetPath(int s, int t, const vector<int>& path);
+
+  vector<int> GetTargets(int s) const;
+
+  // SetPath for all paths of overrides.
+  void MergeOverrides(const PathOverrides& overrides);
+
+  static long long PairKey(int s, int t) {
+    return ((long long)s << 32) | (unsigned)t;
+  }
+
+  int NumSources() const;
+
+  // Number of targets of built tables.
+  long long NumTargets() const {
+    return total_;
+  }
+
+  // Serialization of built tables. Map points the table into data (which
+  // mapped keeps alive) and returns number of bytes consumed or -1.
+  void Write(FILE* f) const;
+  long long Map(const char* data, size_t size, shared_ptr<MappedFile> mapped);
+
+ private:
+  ReachTable(const ReachTable&);
+  ReachTable& operator=(const ReachTable&);
+
+  struct SourceView {
+    SourceView() : b(NULL), e(NULL) {}
+    const ReachEntry* Find(int node) const;
+
+    // keeps cached entries alive when the cache evicts them
+    shared_ptr<const vector<ReachEntry> > hold;
+    const ReachEntry* b;
+    const ReachEntry* e;
+  };
+
+  struct LazyState;
+
+  SourceView GetSource(int s) const;
+  void Reset();
+
+  int num_sources_;
+  const long long* offsets_;
+  const ReachEntry* entries_;
+  vector<long long> offsets_store_;
+  vector<ReachEntry> entries_store_;
+  shared_ptr<MappedFile> mapped_;
+  long long total_;
+  shared_ptr<LazyState> lazy_;
+  mutable mutex overrides_lock_;
+  PathOverrides overrides_;
+};
+
+// Short walks from every node back to itself. Walks of one node are kept in
+// one flat buffer, the walk starts with the node and does not repeat it at
+// the end.
+class SelfLoops {
+ public:
+  SelfLoops() : num_nodes_(0), node_offsets_(NULL), loop_offsets_(NULL),
+                nodes_(NULL) {}
+
+  // loops[i] holds walks of node i as (length, nodes...) records.
+  void Build(vector<vector<int> >& loops);
+
+  int NumLoops(int node) const {
+    if (node < 0 || node >= num_nodes_) return 0;
+    return node_offsets_[node+1] - node_offsets_[node];
+  }
+
+  vector<int> GetLoop(int node, int k) const {
+    long long l = node_offsets_[node] + k;
+    return vector<int>(nodes_ + loop_offsets_[l], nodes_ + loop_offsets_[l+1]);
+  }
+
+  int NumNodes() const {
+    return num_nodes_;
+  }
+
+  long long NumLoopsTotal() const {
+    return num_nodes_ ? node_offsets_[num_nodes_] : 0;
+  }
+
+  void Write(FILE* f) const;
+  long long Map(const char* data, size_t size, shared_ptr<MappedFile> mapped);
+
+ private:
+  SelfLoops(const SelfLoops&);
+  SelfLoops& operator=(const SelfLoops&);
+
+  void Reset();
+
+  int num_nodes_;
+  const long long* node_offsets_;
+  const long long* loop_offsets_;
+  const int* nodes_;
+  vector<long long> node_offsets_store_;
+  vector<long long> loop_offsets_store_;
+  vector<int> nodes_store_;
+  shared_ptr<MappedFile> mapped_;
+};
+
+#endif
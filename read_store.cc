@@ -0,0 +1,132 @@
+#include "read_store.h"
+#include <cstring>
+#include <sys/stat.h>
+
+namespace {
+const char kReadStoreMagic[8] = {'G', 'A', 'M', 'L', 'R', 'E', 'A', 'D'};
+const int kReadStoreVersion = 1;
+// Bases which can be stored, everything else becomes N.
+const char kReadStoreCodes[] = "ACGTNacgtnRYKMSW";
+const unsigned char kCodeN = 4;
+
+struct ReadStoreHeader {
+  char magic[8];
+  int version;
+  int num_reads;
+  long long source_size;
+  long long table_offset;
+};
+
+long long FileSize(const string& filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) return -1;
+  return st.st_size;
+}
+
+unsigned char EncodeBase(char c) {
+  static unsigned char table[256];
+  static bool init = false;
+  if (!init) {
+    memset(table, kCodeN, sizeof(table));
+    for (int i = 0; i < 16; i++) {
+      table[(unsigned char)kReadStoreCodes[i]] = i;
+    }
+    init = true;
+  }
+  return table[(unsigned char)c];
+}
+}
+
+bool PackedReadStore::Open(const string& filename, const string& source_filename,
+                           int num_reads) {
+  if (!mapped_.Open(filename)) return false;
+  ReadStoreHeader header;
+  bool ok = mapped_.size() >= sizeof(header);
+  if (ok) {
+    memcpy(&header, mapped_.data(), sizeof(header));
+    ok = memcmp(header.magic, kReadStoreMagic, sizeof(kReadStoreMagic)) == 0 &&
+         header.version == kReadStoreVersion &&
+         header.num_reads == num_reads &&
+         header.source_size == FileSize(source_filename) &&
+         header.table_offset % sizeof(long long) == 0 &&
+         header.table_offset + (long long)num_reads *
+             (sizeof(long long) + sizeof(int)) <= (long long)mapped_.size();
+  }
+  if (!ok) {
+    mapped_.Close();
+    return false;
+  }
+  num_reads_ = num_reads;
+  offsets_ = (const long long*)(mapped_.data() + header.table_offset);
+  lens_ = (const int*)(offsets_ + num_reads);
+  return true;
+}
+
+void PackedReadStore::GetSeq(int read_id, string& out) const {
+  int len = lens_[read_id];
+  const unsigned char* p = (const unsigned char*)mapped_.data() + offsets_[read_id];
+  out.resize(len);
+  for (int i = 0; i + 1 < len; i += 2) {
+    out[i] = kReadStoreCodes[p[i/2] & 15];
+    out[i+1] = kReadStoreCodes[p[i/2] >> 4];
+  }
+  if (len % 2) {
+    out[len-1] = kReadStoreCodes[p[len/2] & 15];
+  }
+}
+
+PackedReadWriter::~PackedReadWriter() {
+  if (f_ != NULL) {
+    fclose(f_);
+  }
+}
+
+bool PackedReadWriter::Open(const string& filename, const string& source_filename) {
+  f_ = fopen(filename.c_str(), "wb");
+  if (f_ == NULL) return false;
+  source_size_ = FileSize(source_filename);
+  // header is written in Close
+  ReadStoreHeader header;
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, f_);
+  pos_ = sizeof(header);
+  return true;
+}
+
+void PackedReadWriter::Add(int read_id, const string& seq) {
+  if (read_id >= offsets_.size()) {
+    offsets_.resize(read_id + 1, pos_);
+    lens_.resize(read_id + 1, 0);
+  }
+  offsets_[read_id] = pos_;
+  lens_[read_id] = seq.length();
+  buffer_.assign((seq.length() + 1) / 2, 0);
+  for (int i = 0; i < seq.length(); i++) {
+    buffer_[i/2] |= EncodeBase(seq[i]) << (4 * (i % 2));
+  }
+  fwrite(buffer_.data(), 1, buffer_.size(), f_);
+  pos_ += buffer_.size();
+}
+
+bool PackedReadWriter::Close(int num_reads) {
+  offsets_.resize(num_reads, pos_);
+  lens_.resize(num_reads, 0);
+  while (pos_ % sizeof(long long) != 0) {
+    fputc(0, f_);
+    pos_++;
+  }
+  ReadStoreHeader header;
+  memcpy(header.magic, kReadStoreMagic, sizeof(kReadStoreMagic));
+  header.version = kReadStoreVersion;
+  header.num_reads = num_reads;
+  header.source_size = source_size_;
+  header.table_offset = pos_;
+  fwrite(offsets_.data(), sizeof(long long), num_reads, f_);
+  fwrite(lens_.data(), sizeof(int), num_reads, f_);
+  fseek(f_, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, f_);
+  bool ok = !ferror(f_);
+  ok = (fclose(f_) == 0) && ok;
+  f_ = NULL;
+  return ok;
+}
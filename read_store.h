@@ -0,0 +1,58 @@
+#ifndef READ_STORE_H__
+#define READ_STORE_H__
+
+#include <string>
+#include <cstdio>
+#include <vector>
+#include "mapped_file.h"
+
+using namespace std;
+
+// Read sequences packed to 4 bits per base in a file which is memory-mapped,
+// so only the pages of reads which are actually used get loaded.
+// Layout: header, packed sequences (each read starts at a byte boundary),
+// table of byte offsets and lengths indexed by read id.
+class PackedReadStore {
+ public:
+  PackedReadStore() : num_reads_(0), offsets_(NULL), lens_(NULL) {}
+
+  // Fails if the file is missing, damaged or was built from a different
+  // source file or number of reads.
+  bool Open(const string& filename, const string& source_filename, int num_reads);
+
+  bool IsOpen() const {
+    return mapped_.IsOpen();
+  }
+
+  int GetLength(int read_id) const {
+    return lens_[read_id];
+  }
+
+  void GetSeq(int read_id, string& out) const;
+
+ private:
+  MappedFile mapped_;
+  int num_reads_;
+  const long long* offsets_;
+  const int* lens_;
+};
+
+class PackedReadWriter {
+ public:
+  PackedReadWriter() : f_(NULL), pos_(0) {}
+  ~PackedReadWriter();
+
+  bool Open(const string& filename, const string& source_filename);
+  void Add(int read_id, const string& seq);
+  bool Close(int num_reads);
+
+ private:
+  FILE* f_;
+  long long source_size_;
+  long long pos_;
+  vector<long long> offsets_;
+  vector<int> lens_;
+  vector<unsigned char> buffer_;
+};
+
+#endif